@@ -6,24 +6,49 @@
 #define data_TREE_BTREE_HPP
 
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 #include <functional>
 #include <cassert>
+#include <vector>
+#include <type_traits>
+#include <memory>
+#include <climits>
+#include <unordered_map>
+#include <unordered_set>
 #include "cache.hpp"
+#include "pool.hpp"
+#include "keys.hpp"
+#include "alloc.hpp"
+#include "wal.hpp"
+#include "latch.hpp"
+#include "layout.hpp"
+#include "search.hpp"
+#include "page.hpp"
+#include "bloom.hpp"
+#include "flusher.hpp"
+#include <string>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace Sirius {
 
     /*
      * 文件上的B树
      */
-    template<class Key, class Val, int M = 4> //Key - Value Pair, M为阶数
+    template<class Key, class Val, int M = 4, class KeyPolicy = HashKey<Key>, class CachePolicy = LRUPolicy, bool CONCURRENT = false>
+    //Key - Value Pair, M为阶数, KeyPolicy为key的储存策略, CachePolicy为cache的替换策略, CONCURRENT为是否多线程 (见 latch.hpp)
     class BTree {
-        typedef int fpos_t; //约定文件上的位置均用 int32 表示
-        typedef int hash_t; //key 值统一经过哈希, 类型约定为 int32 (-1表示不存在)
-        static const int HASH_MOD = (2147483647);
+        typedef long long fpos_t; //约定文件上的位置均用 int64 表示, 文件可以超过 2GiB
+        typedef typename KeyPolicy::store_t store_t; //节点里实际储存的 key, 默认为哈希值 (见 keys.hpp)
         static const fpos_t NULL_NUM = -1; //空文件位置
         static const int NODE_MIN_SIZE = (M + 1) / 2 - 1; //除根节点外, BTreeNode size下限
+        static const fpos_t TRUNCATE_SLACK = 4ll << 20; //compact 时文件尾部空出这么多才截, 截一次要落盘
+        static const size_t FILTER_MIN_KEYS = 1 << 14; //过滤器至少按这么多 key 开, 删得比这少不重建
 
     private:
         /*
@@ -32,114 +57,603 @@ namespace Sirius {
          * 统一大小+1, 因为插入时会多; son由于头尾都有, 比K-V数量多一, 处理时候多多注意
          */
         struct BTreeNode {
-            fpos_t parent;
             size_t siz;
-            hash_t key[M + 1]; //关键字
+            store_t key[M + 1]; //关键字, 只有 [0, siz) 有意义
             Val val[M + 1]; //数据位置
             fpos_t son[M + 2]; //子节点指针
-            BTreeNode() : parent(NULL_NUM), siz(0) {
-                for (int i = 0; i < M; ++i) key[i] = NULL_NUM;
-                for (int i = 0; i < M + 1; ++i) son[i] = NULL_NUM;
+            BTreeNode() : siz(0) {
+                for (int i = 0; i < M + 2; ++i) son[i] = NULL_NUM;
             }
         };
 
         /*
-         *  内存回收记录，是一个栈
+         * B-Tree 主体: base + data 设计
+         * base为树的基础, data为数据储存
+         * base 在文件开头, 带 magic 和版本号, 打开时校验, 防止读入旧格式或用别的模板参数打开
+         */
+        static const int TREE_VERSION = 6;
+
+        /*
+         * 变长 key (KeyPolicy::VARIABLE) 的节点在盘上是槽页, cache 读写时编解码; 节点满不满按编码后的字节数算
+         * 定长 key 原样按字节存, 满不满只看个数, 和原来一样
+         */
+        static const bool VAR_KEYS = KeyPolicy::VARIABLE;
+        typedef typename std::conditional<VAR_KEYS, SlottedCodec<BTreeNode, KeyPolicy, Val>, RawCodec<BTreeNode> >::type Codec;
+        typedef typename std::conditional<CONCURRENT, ShardedCache<BTreeNode, 3000, CachePolicy, Codec>,
+                                          LRUCache<BTreeNode, 3000, CachePolicy, Codec> >::type PrivateCache; //多线程时 cache 分片加锁
+        typedef typename std::conditional<std::is_same<CachePolicy, SharedPoolPolicy>::value, PooledCache<BTreeNode, Codec>,
+                                          PrivateCache>::type Cache; //SharedPoolPolicy: 不开私有 cache, 用进程共享的 pool
+
+        struct TreeBase {
+            char magic[8];
+            int version;
+            int nodeSize; //sizeof(BTreeNode), 阶数或 K-V 类型不同则节点大小不同
+            fpos_t rootPos; //根节点
+            size_t siz;
+            typename PageAllocator<Cache>::Meta pages; //页分配器的高水位与空闲链
+
+            explicit TreeBase(fpos_t _rootPos): version(TREE_VERSION), nodeSize(sizeof(BTreeNode)),
+                                                rootPos(_rootPos), siz(0), pages(1) {
+                memset(magic, 0, sizeof(magic));
+                strcpy(magic, "SRBTREE");
+            }
+
+            bool check() const {
+                return strcmp(magic, "SRBTREE") == 0 && version == TREE_VERSION && nodeSize == sizeof(BTreeNode);
+            }
+        } base;
+
+        /*
+         * 节点在文件里按槽位排: 从 NODE_BEGIN 开始每 NODE_STRIDE 字节一个, 槽位补齐后不跨页 (见 layout.hpp)
+         */
+        static const fpos_t NODE_STRIDE = nodeStride(Codec::BYTES);
+        static const fpos_t NODE_BEGIN = nodeBegin(sizeof(TreeBase), NODE_STRIDE);
+
+        int data; //文件描述符
+        Pager pager; //读写后端, pread/pwrite 或 mmap, 构造时选择
+        Cache disk;
+        PageAllocator<Cache> pages;
+        PageLatches<CONCURRENT> latches; //页版本号与写者闩, 单线程时为空
+
+        /*
+         * WAL 模式 (构造时 walGroup > 0 开启), 日志文件为数据文件名加 ".wal"
+         * 重做记录在 store_t 上记, 哈希策略下 key 还原不回来也能重放
+         */
+        enum WalOp {WAL_INSERT = 1, WAL_MODIFY, WAL_DEL};
+        struct RedoRecord {
+            int op;
+            store_t key;
+            Val val;
+        };
+        static const fpos_t WAL_CHECKPOINT_SIZE = 64ll << 20; //日志超过这么大就做一次检查点
+        WriteAheadLog wal;
+        bool replaying; //恢复时重放的操作不再记日志
+
+        /*
+         * 快照 (写时复制), 见 snapshot()
+         * 拍快照时还在树里的页都 "冻住" 了: 之后要改就写到新页上, 祖先一路改到新根, 旧页等快照都放掉才真正释放
+         * 页 "出生" 的代 (generation) 不早于所有活着的快照时可以原地改, 没有快照时一切照旧
+         * 操作中途位置都是逻辑的 (操作开始时的位置), 搬走的页记在 remap 里, 读写时换成实际位置, 操作结束时再改祖先
+         */
+        struct SnapshotState {
+            fpos_t rootPos;
+            size_t siz;
+            long long gen;
+            int fd; //快照自己的只读描述符, 读的时候不碰树的 cache 和 pager
+
+            ~SnapshotState() {
+                if (fd >= 0) close(fd);
+            }
+        };
+        std::string dataName;
+        std::vector<std::shared_ptr<SnapshotState> > snapshots; //按 gen 递增, 只剩树持有 (use_count 为 1) 即已放掉
+        long long generation, frozenGen; //frozenGen 为最新的活快照的 gen, 0 为没有快照
+        std::unordered_map<fpos_t, long long> birth; //有快照时新分配的页 -> 分配时的 generation, 不在表里的算 0
+        std::vector<std::pair<fpos_t, long long> > retired; //被换掉的旧页及换掉时的 generation, gen 不超过它的快照还可能在读
+        std::unordered_map<fpos_t, fpos_t> remap; //本次操作搬走的页: 逻辑位置 -> 实际位置
+
+        /*
+         * 布隆过滤器 (构造时 filterBits > 0 开启, 每个 key 这么多位), 存在数据文件名加 ".bloom" 里, 见 bloom.hpp
+         * 点查先问 filter, 说没有就直接返回; filter 为空是还没建好, 点查照常走树
+         * 重建在后台线程里做: 拍一个快照, 读出快照里所有的 key 加进 building; 这期间写者新插的 key 两边都加, 建好后由写者换上
+         * 换上时大小不变就按字覆盖, 变了就换指针, 旧的留在 filters 里直到析构 (多线程时读者可能还在读)
          */
-        template<int LEN = 10>
-        struct RecyclePool {
-            fpos_t pool[LEN + 1];
-            size_t tp;
+        enum FilterJob {FILTER_IDLE, FILTER_RUNNING, FILTER_DONE, FILTER_FAILED};
+        int filterBits;
+        int filterFd;
+        BloomFilter *filter;
+        std::vector<std::unique_ptr<BloomFilter> > filters;
+        std::unique_ptr<BloomFilter> building;
+        std::thread filterThread;
+        std::atomic<int> filterJob;
+        std::atomic<bool> filterStop; //析构时让后台重建提前结束
+        bool filterClean; //盘上那份是 clean 的, 再置位前要先标脏
+        int treeLevels; //树高, 换根时作废 (-1), 写者在 filterMaybeRebuild 里重算; 估算省掉的节点访问用
+        FilterStats filterCounter;
 
-            RecyclePool(): tp(0) {
-                for (int i = 0; i <= LEN; ++i) pool[i] = NULL_NUM;
+        /*
+         * cache 预热 (构造时 warmup 为 true 开启), 常驻页的位置从热到冷存在数据文件名加 ".warm" 里, 见 warmup.hpp
+         * 关闭和 sync 时存, 也可以随时调 saveWarmup; 打开时后台按位置顺序成段读回来, cache 被访问时装进空闲页框
+         */
+        bool warmup;
+        std::unique_ptr<WarmLoader> warmer;
+
+        /*
+         * 后台写回 (构造时 dirtyHighWater > 0 开启), 见 flusher.hpp; cache 淘汰和 flush 的脏页交给后台线程写
+         * 脏页占到 cache 的 dirtyHighWater 以上时提前把最冷的交出去, 前台淘汰时多半碰到干净的页
+         * 不和 WAL 一起用 (写前的前像钩子只能在写者线程里调), 共享 pool 也不用, 构造时一起开会抛异常
+         */
+        std::unique_ptr<Flusher> flusher;
+
+        /*
+         * 内部函数, 获取一个内存空位, 用于开一块新的BTreeNode
+         * 交给页分配器: 空闲链上有就复用, 没有就返回高水位处, 高水位随文件头持久化
+         * 注意一开始的root位置相当于已分配, 所以高水位从1开始
+         * 多线程时闩耦合的写者会同时分配、释放, 空闲链要加锁
+         */
+        fpos_t newFilePos() {
+            fpos_t pos;
+            {
+                AllocScope<CONCURRENT> scope(latches);
+                pos = pages.alloc();
             }
+            if (frozenGen > 0) birth[pos] = generation;
+            return pos;
+        }
+
+        /*
+         * 快照可能还在读的页: 出生得比最新的活快照早
+         */
+        bool frozen(fpos_t pos) const {
+            if (frozenGen == 0) return false;
+            auto it = birth.find(pos);
+            return (it == birth.end() ? 0 : it->second) < frozenGen;
+        }
+
+        fpos_t physical(fpos_t pos) const {
+            auto it = remap.find(pos);
+            return it == remap.end() ? pos : it->second;
+        }
+
+        void nodeRead(fpos_t pos, BTreeNode &node) {
+            disk.read(remap.empty() ? pos : physical(pos), node);
+        }
+
+        /*
+         * 写者改动页都经过这里: 先锁住这页 (多线程时读者会看到版本号变化), 再写进 cache
+         * 根的位置也当成一页, 挂在文件头的位置 0 上
+         */
+        void nodeWrite(fpos_t pos, const BTreeNode &node) {
+            if (frozenGen > 0) pos = shadow(pos);
+            latches.lock(pos);
+            disk.write(pos, node);
+        }
+
+        /*
+         * 冻住的页第一次被改时搬到新页, 旧页退休
+         */
+        fpos_t shadow(fpos_t pos) {
+            auto it = remap.find(pos);
+            if (it != remap.end()) return it->second;
+            if (!frozen(pos)) return pos;
+            fpos_t newPos = newFilePos();
+            latches.lock(pos); //旧页内容不变, 但正从旧根往下走的读者要重来, 否则可能走进原地改过的孩子
+            remap[pos] = newPos;
+            retired.push_back(std::make_pair(pos, generation));
+            return newPos;
+        }
 
-            void push(fpos_t freePos) {
-                if (tp == LEN) { //满, 浪费
+        void pageFree(fpos_t pos) {
+            if (frozenGen > 0) {
+                auto it = remap.find(pos);
+                if (it != remap.end()) { //旧页已经退休, 释放搬过去的新页
+                    fpos_t newPos = it->second;
+                    remap.erase(it);
+                    birth.erase(newPos);
+                    pos = newPos;
+                } else if (frozen(pos)) {
+                    retired.push_back(std::make_pair(pos, generation));
+                    disk.discard(pos);
                     return;
+                } else {
+                    birth.erase(pos);
+                }
+            }
+            latches.lock(pos);
+            {
+                AllocScope<CONCURRENT> scope(latches);
+                pages.free(pos);
+            }
+            latches.release(pos); //马上放开写者闩, 别的写者分配到这页时不用等; 版本号留到操作结束
+        }
+
+        /*
+         * 写时复制的收尾, 每个修改操作结束时调用: 被搬走的页的祖先都还指着旧位置
+         * 先按 key 从根找出每个被搬的页的所有祖先, 再从深到浅重写 (son 换成实际位置), 冻住的祖先自己也会被搬, 最后换根
+         */
+        void cowFinish() {
+            if (remap.empty()) return;
+            std::vector<std::pair<int, fpos_t> > todo; //(深度, 逻辑位置)
+            std::unordered_set<fpos_t> seen;
+            std::vector<fpos_t> path;
+            BTreeNode node;
+            for (const std::pair<const fpos_t, fpos_t> &moved : remap) {
+                if (moved.first == base.rootPos) continue;
+                nodeRead(moved.first, node);
+                ancestorPath(node.key[0], moved.first, path);
+                for (size_t d = 0; d < path.size(); ++d) {
+                    if (seen.insert(path[d]).second) todo.push_back(std::make_pair((int)d, path[d]));
                 }
-                for (int i = 1; i <= LEN; ++i)
-                    if (pool[i] == freePos) return; // 不重复回收
-                pool[++tp] = freePos;
             }
+            std::sort(todo.begin(), todo.end(), std::greater<std::pair<int, fpos_t> >());
+            for (const std::pair<int, fpos_t> &t : todo) {
+                nodeRead(t.second, node);
+                for (size_t i = 0; i <= node.siz; ++i) {
+                    if (node.son[i] != NULL_NUM) node.son[i] = physical(node.son[i]);
+                }
+                nodeWrite(t.second, node);
+            }
+            fpos_t rootPos = physical(base.rootPos);
+            remap.clear();
+            if (rootPos != base.rootPos) setRoot(rootPos);
+        }
 
-            fpos_t top() const {
-                return pool[tp];
+        /*
+         * 放掉的快照出列; 退休的页如果已经没有更早的快照在读, 还给分配器
+         */
+        void reclaim() {
+            snapshots.erase(std::remove_if(snapshots.begin(), snapshots.end(), [](const std::shared_ptr<SnapshotState> &snap) {
+                return snap.use_count() == 1;
+            }), snapshots.end());
+            frozenGen = snapshots.empty() ? 0 : snapshots.back()->gen;
+            long long oldest = snapshots.empty() ? LLONG_MAX : snapshots.front()->gen;
+            size_t kept = 0;
+            for (const std::pair<fpos_t, long long> &page : retired) {
+                if (page.second < oldest) {
+                    latches.lock(page.first);
+                    pages.free(page.first);
+                } else {
+                    retired[kept++] = page;
+                }
             }
+            retired.resize(kept);
+            if (frozenGen == 0) birth.clear();
+        }
 
-            bool empty() const {
-                return tp == 0;
+        void reclaimMaybe() {
+            if (!snapshots.empty() || !retired.empty()) reclaim();
+        }
+
+        /*
+         * 整理文件用: 活页 from 搬到空页 to, 父亲 (或根) 改指向新位置, from 释放
+         * 没有父指针, 用节点的第一个 key 从根找父亲, 同 cowFinish
+         */
+        void relocate(fpos_t from, fpos_t to) {
+            BTreeNode node;
+            nodeRead(from, node);
+            pages.take(to);
+            nodeWrite(to, node);
+            if (from == base.rootPos) {
+                setRoot(to);
+            } else {
+                std::vector<fpos_t> path;
+                ancestorPath(node.key[0], from, path);
+                BTreeNode parentNode;
+                nodeRead(path.back(), parentNode);
+                for (size_t i = 0; i <= parentNode.siz; ++i) {
+                    if (parentNode.son[i] == from) parentNode.son[i] = to;
+                }
+                nodeWrite(path.back(), parentNode);
             }
+            pageFree(from);
+        }
 
-            void pop() {
-                if (tp > 0) tp--;
+        /*
+         * 高水位以后的部分截掉; 先把 cache 和文件头落盘 (WAL 模式做检查点), 这样截掉的部分不会再被恢复或写回需要
+         */
+        void truncateTail() {
+            if (wal.enabled()) {
+                checkpoint();
+            } else {
+                disk.flush();
+                pager.write(0, &base, sizeof(TreeBase));
+                pager.sync();
             }
-        };
+            pager.truncate(NODE_BEGIN + pages.pageCount() * NODE_STRIDE);
+        }
+
+        fpos_t fileSize() const {
+            struct stat fileStat;
+            fstat(data, &fileStat);
+            return fileStat.st_size;
+        }
+
+        void setRoot(fpos_t pos) {
+            __atomic_store_n(&treeLevels, -1, __ATOMIC_RELAXED);
+            latches.lock(0);
+            __atomic_store_n(&base.rootPos, pos, __ATOMIC_RELEASE);
+        }
 
         /*
-         * B-Tree 主体: base + data 设计
-         * base为树的基础, data为数据储存
+         * 过滤器里用的哈希: 定长 key 按整个 store_t 的字节算, 变长 key 只算有效的部分
+         */
+        static unsigned long long keyHash(const store_t &key, std::false_type) {
+            return hashBytes(&key, sizeof(store_t));
+        }
+
+        static unsigned long long keyHash(const store_t &key, std::true_type) {
+            return hashBytes(KeyPolicy::data(key), KeyPolicy::length(key));
+        }
+
+        static void filterCount(size_t &field, size_t n = 1) {
+            __atomic_fetch_add(&field, n, __ATOMIC_RELAXED);
+        }
+
+        /*
+         * 点查之前问过滤器, 返回 false 说明 key 一定不在树里; 没开或还没建好总是 true
+         * 读者也会调用, 不碰写者的状态
          */
+        bool filterPass(const store_t &key) {
+            if (filterBits == 0) return true;
+            const BloomFilter *now = __atomic_load_n(&filter, __ATOMIC_ACQUIRE);
+            if (now == nullptr) return true;
+            filterCount(filterCounter.checks);
+            if (now->mayContain(keyHash(key, VarTag()))) return true;
+            filterCount(filterCounter.negatives);
+            return false;
+        }
 
-        struct TreeBase {
-            fpos_t rootPos; //根节点
-            size_t siz;
-            RecyclePool<2002> recyclePool;
+        //过滤器放过去了, 树里却没有
+        void filterMiss() {
+            if (filterBits > 0 && __atomic_load_n(&filter, __ATOMIC_ACQUIRE) != nullptr) filterCount(filterCounter.falsePositives);
+        }
 
-            explicit TreeBase(fpos_t _rootPos): siz(0), rootPos(_rootPos), recyclePool() {
+        /*
+         * 树里新插入了 key (insert / insertBatch / bulkLoad / 重放), 过滤器里也加上
+         * 盘上那份还是 clean 的话先标脏, 这之后崩溃打开时就会重建
+         */
+        void filterAdd(const store_t &key) {
+            if (filterBits == 0) return;
+            unsigned long long h = keyHash(key, VarTag());
+            if (filter != nullptr) {
+                if (filterClean) {
+                    BloomFilter::markDirty(filterFd);
+                    filterClean = false;
+                }
+                filter->add(h);
+                filter->added++;
             }
-        } base;
+            if (building) {
+                building->add(h);
+                building->added++;
+            }
+        }
 
-        FILE *data;
-        LRUCache<BTreeNode, 3000> disk;
+        void filterRemove() {
+            if (filter != nullptr) filter->removed++;
+            if (building) building->removed++;
+        }
 
         /*
-         * 内部函数, 获取一个内存空位, 用于开一块新的BTreeNode
-         * 如果回收池里有就获取, 没有就返回末位置, alloc会不断往后计数, 内存回收使得其不会浪费
-         * 注意一开始的root位置相当于已分配, 所以计数器从1开始
+         * 换上新的过滤器: 和现在的一样大就按字覆盖, 否则换指针
          */
-        fpos_t newFilePos() {
-            static int allocCounter = 0;
-            if (base.recyclePool.empty()) {
-                allocCounter++;
-                return sizeof(TreeBase) + allocCounter * sizeof(BTreeNode);
+        void filterInstall(std::unique_ptr<BloomFilter> fresh) {
+            if (filter != nullptr && filter->sameShape(*fresh)) {
+                filter->copyFrom(*fresh);
+            } else {
+                if (!CONCURRENT) filters.clear();
+                filters.push_back(std::move(fresh));
+                __atomic_store_n(&filter, filters.back().get(), __ATOMIC_RELEASE);
+            }
+            filterClean = false;
+        }
+
+        /*
+         * 后台重建结束了就收尾: 成功则换上, 失败 (读盘出错或被叫停) 则丢掉, 下次再建
+         * wait 为 true 时等它结束
+         */
+        void filterCollect(bool wait) {
+            if (!filterThread.joinable() || (!wait && filterJob.load(std::memory_order_acquire) == FILTER_RUNNING)) return;
+            filterThread.join();
+            if (filterJob.load(std::memory_order_acquire) == FILTER_DONE) filterInstall(std::move(building));
+            building.reset();
+            filterJob.store(FILTER_IDLE, std::memory_order_relaxed);
+        }
+
+        /*
+         * 写者在修改操作结束时调用: 收掉已经建好的, 需要的话开始新一轮重建
+         * 要重建: 还没有过滤器; 加进去的 key 超过了容量 (误判率上去了); 删掉的 key 超过加进去的一半 (残留的位太多)
+         * 新的按现有 K-V 个数的两倍开, 现在的大小在一到四倍之间就沿用, 这样多半可以按字覆盖
+         */
+        void filterMaybeRebuild() {
+            if (filterBits == 0) return;
+            if (treeLevels < 0) __atomic_store_n(&treeLevels, levels(), __ATOMIC_RELAXED);
+            filterCollect(false);
+            if (filterThread.joinable()) return;
+            if (filter != nullptr && filter->added <= filter->capacity() &&
+                (filter->removed < FILTER_MIN_KEYS || filter->removed * 2 < filter->added)) return;
+
+            size_t capacity = std::max(base.siz * 2, (size_t)FILTER_MIN_KEYS);
+            if (filter != nullptr && filter->capacity() >= capacity && filter->capacity() <= capacity * 4 &&
+                filter->added <= filter->capacity()) capacity = filter->capacity();
+            building.reset(new BloomFilter(filterBits, capacity));
+            if (base.siz == 0) { //空树不用读, 直接换上
+                filterInstall(std::move(building));
+                return;
+            }
+            Snapshot snap = snapshotLocked();
+            building->added = base.siz;
+            BloomFilter *target = building.get();
+            filterStop.store(false, std::memory_order_relaxed);
+            filterJob.store(FILTER_RUNNING, std::memory_order_relaxed);
+            filterThread = std::thread([this, snap, target] {
+                int job = FILTER_DONE;
+                try {
+                    if (!snap.forEach([&](const store_t &key) {
+                        target->add(keyHash(key, VarTag()));
+                        return !filterStop.load(std::memory_order_relaxed);
+                    })) job = FILTER_FAILED;
+                } catch (...) {
+                    job = FILTER_FAILED;
+                }
+                filterJob.store(job, std::memory_order_release);
+            });
+        }
+
+        /*
+         * 检查点时把过滤器写回去 (只在有改动时), 之后盘上那份是 clean 的
+         */
+        void filterSave() {
+            if (filterBits == 0 || filter == nullptr || filterClean) return;
+            filter->save(filterFd, base.siz);
+            filterClean = true;
+        }
+
+        /*
+         * 存下的位置不一定还对 (上次没正常关闭、被整理截短过), 只留落在节点槽位上、没超过高水位的
+         */
+        void warmStart() {
+            std::vector<fpos_t> list = WarmLoader::load(dataName + ".warm", Codec::BYTES), valid;
+            fpos_t end = NODE_BEGIN + pages.pageCount() * NODE_STRIDE;
+            for (fpos_t pos : list) {
+                if (pos >= NODE_BEGIN && pos < end && (pos - NODE_BEGIN) % NODE_STRIDE == 0) valid.push_back(pos);
+            }
+            if (valid.empty()) return;
+            warmer.reset(new WarmLoader(dataName, std::move(valid), Codec::BYTES, NODE_STRIDE));
+            disk.warmFrom(warmer.get());
+        }
+
+        void warmSave() {
+            std::vector<fpos_t> list;
+            disk.forEachResident([&list](fpos_t pos) {list.push_back(pos);});
+            WarmLoader::save(dataName + ".warm", list, Codec::BYTES);
+        }
+
+        /*
+         * 树高: 沿最左边走到叶子
+         */
+        int levels() {
+            if (base.siz == 0) return 0;
+            BTreeNode node;
+            int ret = 1;
+            nodeRead(base.rootPos, node);
+            while (node.son[0] != NULL_NUM) {
+                nodeRead(node.son[0], node);
+                ret++;
             }
-            fpos_t ret = base.recyclePool.top();
-            base.recyclePool.pop();
             return ret;
         }
 
+        /*
+         * 内部函数, 显示一个key, 保序策略还原为原 key 显示, 哈希策略直接显示哈希值
+         */
+        static void keyDisplay(const store_t &key, std::true_type) {
+            std::cout << KeyPolicy::decode(key) << " ";
+        }
+
+        static void keyDisplay(const store_t &key, std::false_type) {
+            std::cout << key << " ";
+        }
+
         /*
          * 内部函数, 显示一个BTreeNode信息, 并且递归到其子节点
          */
         void nodeDisplay(fpos_t nodePos) {
             if (nodePos == NULL_NUM) return;
             BTreeNode node;
-            disk.read(nodePos, node);
-            printf("\n* Node stored in %d *\n", nodePos);
+            nodeRead(nodePos, node);
+            printf("\n* Node stored in %lld *\n", nodePos);
             printf("size: %lu\n", node.siz);
-            printf("parent: %d\n", node.parent);
             printf("key: ");
             for (int i = 0; i < node.siz; ++i)
-                printf("%d ", node.key[i]);
+                keyDisplay(node.key[i], std::integral_constant<bool, KeyPolicy::ORDERED>());
             printf("\nval: ");
             for (int i = 0; i < node.siz; ++i)
                 std::cout << node.val[i] << " ";
             printf("\nson: ");
             for (int i = 0; i < node.siz + 1; ++i)
-                printf("%d ", node.son[i]);
+                printf("%lld ", node.son[i]);
             printf("\n");
             for (int i = 0; i < node.siz + 1; ++i)
                 nodeDisplay(node.son[i]);
         }
 
+        /*
+         * 内部函数, 节点不存父亲, 插入和删除下降时把经过的节点位置压进 path (根在底, 父亲在顶)
+         * 分裂、合并往上走时从 path 里取父亲, 不用再去改每个挪动了的孩子
+         */
+
+        /*
+         * 内部函数, 节点满/不足的判断和分裂点: 定长 key 只看个数; 变长 key 还要看槽页编码后的字节数
+         * 变长 key 的节点个数可以远少于 NODE_MIN_SIZE, 只保证非根节点不空, 不到 1/4 页算不足 (删除时尽量合并)
+         */
+        typedef std::integral_constant<bool, VAR_KEYS> VarTag;
+
+        static bool overflow(const BTreeNode &node, std::false_type) {return node.siz >= M;}
+        static bool overflow(const BTreeNode &node, std::true_type) {return node.siz >= M || !Codec::fits(node);}
+        static bool overflow(const BTreeNode &node) {return overflow(node, VarTag());}
+
+        static bool underflow(const BTreeNode &node, std::false_type) {return node.siz < NODE_MIN_SIZE;}
+        static bool underflow(const BTreeNode &node, std::true_type) {return node.siz == 0 || Codec::bytes(node) < Codec::BYTES / 4;}
+        static bool underflow(const BTreeNode &node) {return underflow(node, VarTag());}
+
+        static int splitPoint(const BTreeNode &node, std::false_type) {return node.siz / 2;}
+        static int splitPoint(const BTreeNode &node, std::true_type) {return Codec::splitPoint(node);}
+        static int splitPoint(const BTreeNode &node) {return splitPoint(node, VarTag());}
+
+        static int safeEntries(std::false_type) {return M - 1;}
+        static int safeEntries(std::true_type) {return Codec::SAFE_ENTRIES;}
+
+        /*
+         * 内部函数, 把 key/val 和 right 整个接到 left 后面, 调用者保证个数不超
+         */
+        static void nodeMerge(BTreeNode &left, const store_t &key, const Val &val, const BTreeNode &right) {
+            left.key[left.siz] = key;
+            left.val[left.siz] = val;
+            left.son[left.siz + 1] = right.son[0];
+            for (size_t j = 0; j < right.siz; ++j) {
+                left.key[left.siz + 1 + j] = right.key[j];
+                left.val[left.siz + 1 + j] = right.val[j];
+                left.son[left.siz + 2 + j] = right.son[j + 1];
+            }
+            left.siz += right.siz + 1;
+        }
+
+        /*
+         * 内部函数, leftPos 分裂出了右兄弟 rightPos, 把中间的 K-V 交给父亲 (path 顶); 没有父亲则长出新根
+         */
+        void attachSibling(fpos_t leftPos, std::vector<fpos_t> &path,
+                           const store_t &key, const Val &val, fpos_t rightPos) {
+            if (path.empty()) {
+                //如果当前节点是根节点, 创造新根节点
+                //son[0] key[0] son[1]
+                BTreeNode newRoot;
+                fpos_t newRootPos = newFilePos();
+                DEBUG("nodePos: " << leftPos << " newNodePos: " << rightPos << " newRootPos: " << newRootPos)
+                newRoot.siz = 1;
+                newRoot.key[0] = key;
+                newRoot.val[0] = val;
+                newRoot.son[0] = leftPos;
+                newRoot.son[1] = rightPos;
+                nodeWrite(newRootPos, newRoot);
+                setRoot(newRootPos); //换根
+                return;
+            }
+            //否则将mid插入父节点
+            fpos_t parentPos = path.back();
+            path.pop_back();
+            BTreeNode parentNode;
+            nodeRead(parentPos, parentNode);
+            int i = nodeSearch(parentNode.key, (int)parentNode.siz, key);
+            nodeInsert(parentNode, parentPos, path, i, key, val, rightPos); //一定找得到
+        }
+
         /*
          * 内部函数, 在一个BTreeNode里插入一个K-V, 如果数量>M则分裂并上提中间元素, 递归父亲nodeInsert
          * 注意递归到根节点的处理, 注意son位置的修改
          */
-        void nodeInsert(BTreeNode &node, fpos_t nodePos, int insertPos,
-                        fpos_t keyHash, const Val& val, fpos_t sonPos) {
+        void nodeInsert(BTreeNode &node, fpos_t nodePos, std::vector<fpos_t> &path, int insertPos,
+                        const store_t &key, const Val& val, fpos_t sonPos) {
             //son[ip-1] key[ip-1] son[ip] key[ip] ...
             //[insertPos, node.siz) 位移到 [insertPos+1, node.siz+1), 新节点插入在insertPos
             node.siz++;
@@ -148,96 +662,176 @@ namespace Sirius {
                 node.val[i] = node.val[i - 1];
                 node.son[i + 1] = node.son[i];
             }
-            node.key[insertPos] = keyHash;
+            node.key[insertPos] = key;
             node.val[insertPos] = val;
             node.son[insertPos + 1] = sonPos;
 
             //如果已经满, 考虑分裂
-            if (node.siz >= M) {
-                int mid = node.siz / 2; //mid 上提
-                hash_t midKeyHash = node.key[mid];
-                Val midVal = node.val[mid];
-
-                DEBUG("mid up K-V: " << midKeyHash << " " << midVal)
-
-                //分裂, 新节点转移 [mid+1, node.siz) 部分的数据, 原数据清空
-                BTreeNode newNode;
-                fpos_t newNodePos = newFilePos();
-                newNode.parent = node.parent;
-
-                for (int i = mid + 1; i < node.siz; ++i) {
-                    newNode.siz++;
-                    newNode.key[i - mid - 1] = node.key[i];
-                    newNode.val[i - mid - 1] = node.val[i];
-                    newNode.son[i - mid] = node.son[i + 1];
-                    disk.writeParent(node.son[i+1], newNodePos);
-                    node.key[i] = node.son[i + 1] = NULL_NUM;
-                }
-                node.siz -= newNode.siz;
-
-                //son 数组多一个处理
-                newNode.son[0] = node.son[mid + 1];
-                disk.writeParent(node.son[mid+1], newNodePos);
-                node.son[mid + 1] = NULL_NUM;
-
-                //mid 在原块删除
-                node.siz--;
-                node.key[mid] = NULL_NUM;
-
-                if (node.parent == NULL_NUM) {
-                    //如果当前节点是根节点, 创造新根节点
-                    //son[0] key[0] son[1]
-                    BTreeNode newRoot;
-                    fpos_t newRootPos = newFilePos();
-                    DEBUG("nodePos: " << nodePos << " newNodePos: " << newNodePos << " newRootPos: " << newRootPos)
-                    newRoot.siz = 1;
-                    newRoot.key[0] = midKeyHash;
-                    newRoot.val[0] = midVal;
-                    newRoot.son[0] = nodePos;
-                    newRoot.son[1] = newNodePos;
-                    node.parent = newNode.parent = newRootPos;
-                    disk.write(newRootPos, newRoot);
-                    base.rootPos = newRootPos; //换根
-                    disk.write(nodePos, node);
-                    disk.write(newNodePos, newNode);
-                    return;
-                } else {
-                    //否则将mid插入父节点
-                    BTreeNode parentNode;
-                    disk.read(node.parent, parentNode);
-                    int i = std::lower_bound(parentNode.key, parentNode.key+parentNode.siz, midKeyHash) - parentNode.key;
-                    disk.write(nodePos, node);
-                    disk.write(newNodePos, newNode);
-                    nodeInsert(parentNode, node.parent, i, midKeyHash, midVal, newNodePos); //一定找得到
+            if (overflow(node)) {
+                nodeSplit(node, nodePos, path);
+                return;
+            }
+            nodeWrite(nodePos, node);
+        }
+
+        /*
+         * 内部函数, 节点放不下了: 中间的 K-V 上提给父亲 (path 顶), 右半边成为新节点
+         * 定长 key 按个数对半分, 变长 key 按字节对半分
+         */
+        void nodeSplit(BTreeNode &node, fpos_t nodePos, std::vector<fpos_t> &path) {
+            int mid = splitPoint(node); //mid 上提
+            store_t midKey = node.key[mid];
+            Val midVal = node.val[mid];
+
+            DEBUG("mid up val: " << midVal)
+
+            //分裂, 新节点转移 [mid+1, node.siz) 部分的数据, 原数据清空
+            BTreeNode newNode;
+            fpos_t newNodePos = newFilePos();
+
+            for (size_t i = mid + 1; i < node.siz; ++i) {
+                newNode.siz++;
+                newNode.key[i - mid - 1] = node.key[i];
+                newNode.val[i - mid - 1] = node.val[i];
+                newNode.son[i - mid] = node.son[i + 1];
+                node.son[i + 1] = NULL_NUM;
+            }
+            node.siz -= newNode.siz;
+
+            //son 数组多一个处理
+            newNode.son[0] = node.son[mid + 1];
+            node.son[mid + 1] = NULL_NUM;
+
+            //mid 在原块删除
+            node.siz--;
+
+            nodeWrite(nodePos, node);
+            nodeWrite(newNodePos, newNode);
+            attachSibling(nodePos, path, midKey, midVal, newNodePos);
+        }
+
+        /*
+         * 内部函数, 个数调整, 会一直往上递归, path 顶为父亲
+         */
+        void deleteFix(BTreeNode &node, fpos_t nodePos, std::vector<fpos_t> &path) {
+            deleteFix(node, nodePos, path, VarTag());
+        }
+
+        /*
+         * 变长 key 的调整: 不足时先试着和左/右兄弟合并 (合并后要放得下), 合并不了而节点已经空了才从兄弟借一个
+         * 合并不了说明兄弟很满, 借走一个还剩不少; 父亲那个位置换成兄弟的 key 后可能放不下, 那就把父亲分裂
+         */
+        void deleteFix(BTreeNode &node, fpos_t nodePos, std::vector<fpos_t> &path, std::true_type) {
+            if (!underflow(node) || nodePos == currentRoot()) return;
+
+            fpos_t parentPos = path.back();
+            BTreeNode parentNode;
+            nodeRead(parentPos, parentNode);
+            int i = 0;
+            while (parentNode.son[i] != nodePos) i++;
+
+            //son[sep] key[sep] son[sep+1] 合并进 son[sep]
+            for (int sep = i - 1; sep <= i; ++sep) {
+                if (sep < 0 || (size_t)sep >= parentNode.siz) continue;
+                fpos_t leftPos = parentNode.son[sep], rightPos = parentNode.son[sep + 1];
+                BTreeNode merged, right;
+                if (leftPos == nodePos) merged = node;
+                else latches.acquire(leftPos), nodeRead(leftPos, merged);
+                if (rightPos == nodePos) right = node;
+                else latches.acquire(rightPos), nodeRead(rightPos, right);
+                if (merged.siz + 1 + right.siz >= M) continue;
+                nodeMerge(merged, parentNode.key[sep], parentNode.val[sep], right);
+                if (!Codec::fits(merged)) continue;
+
+                for (size_t j = sep + 1; j < parentNode.siz; ++j) {
+                    parentNode.key[j - 1] = parentNode.key[j];
+                    parentNode.val[j - 1] = parentNode.val[j];
+                    parentNode.son[j] = parentNode.son[j + 1];
+                }
+                parentNode.siz--;
+                parentNode.son[parentNode.siz + 1] = NULL_NUM;
+                pageFree(rightPos);
+
+                if (parentNode.siz <= 0 && parentPos == currentRoot()) { //根节点删空, 减少一层
+                    setRoot(leftPos);
+                    pageFree(parentPos);
+                    nodeWrite(leftPos, merged);
                     return;
                 }
+                nodeWrite(parentPos, parentNode);
+                nodeWrite(leftPos, merged);
+                path.pop_back();
+                deleteFix(parentNode, parentPos, path);
+                return;
+            }
+            if (node.siz > 0) return;
+
+            BTreeNode bro;
+            if (i > 0) { //left key[i-1] node, 左兄弟最后一个上去, key[i-1] 下来
+                nodeRead(parentNode.son[i - 1], bro);
+                node.son[1] = node.son[0];
+                node.key[0] = parentNode.key[i - 1];
+                node.val[0] = parentNode.val[i - 1];
+                node.son[0] = bro.son[bro.siz];
+                node.siz = 1;
+                parentNode.key[i - 1] = bro.key[bro.siz - 1];
+                parentNode.val[i - 1] = bro.val[bro.siz - 1];
+                bro.son[bro.siz] = NULL_NUM;
+                bro.siz--;
+                nodeWrite(parentNode.son[i - 1], bro);
+            } else { //node key[0] right, 右兄弟第一个上去, key[0] 下来
+                nodeRead(parentNode.son[1], bro);
+                node.key[0] = parentNode.key[0];
+                node.val[0] = parentNode.val[0];
+                node.son[1] = bro.son[0];
+                node.siz = 1;
+                parentNode.key[0] = bro.key[0];
+                parentNode.val[0] = bro.val[0];
+                for (size_t j = 0; j + 1 < bro.siz; ++j) {
+                    bro.key[j] = bro.key[j + 1];
+                    bro.val[j] = bro.val[j + 1];
+                    bro.son[j] = bro.son[j + 1];
+                }
+                bro.son[bro.siz - 1] = bro.son[bro.siz];
+                bro.son[bro.siz] = NULL_NUM;
+                bro.siz--;
+                nodeWrite(parentNode.son[1], bro);
+            }
+            nodeWrite(nodePos, node);
+            if (Codec::fits(parentNode)) {
+                nodeWrite(parentPos, parentNode);
+            } else {
+                path.pop_back();
+                nodeSplit(parentNode, parentPos, path);
             }
-            disk.write(nodePos, node);
         }
 
         /*
-         * 内部函数, 个数调整, 会一直往上递归
+         * 定长 key 的调整: 兄弟多于下限就借, 否则合并
          */
-        void deleteFix(BTreeNode &node, fpos_t nodePos) {
+        void deleteFix(BTreeNode &node, fpos_t nodePos, std::vector<fpos_t> &path, std::false_type) {
             //根节点无MIN_SIZE限制
-            if (node.siz >= NODE_MIN_SIZE || nodePos == base.rootPos) return;
+            if (node.siz >= NODE_MIN_SIZE || nodePos == currentRoot()) return;
 
+            fpos_t parentPos = path.back();
             BTreeNode parentNode, leftBro, rightBro;
-            disk.read(node.parent, parentNode);
+            nodeRead(parentPos, parentNode);
 
             //stupid find bro method
             //son[0] key[0] son[1] key[1] ...
             for (int i = 0; i < parentNode.siz + 1; ++i) {
                 if (parentNode.son[i] == nodePos) {
+                    //拿着父亲再闩兄弟
                     if (i > 0) {
-                        disk.read(parentNode.son[i - 1], leftBro);
+                        latches.acquire(parentNode.son[i - 1]);
+                        nodeRead(parentNode.son[i - 1], leftBro);
                     }
                     if (i < parentNode.siz) {
-                        disk.read(parentNode.son[i + 1], rightBro);
+                        latches.acquire(parentNode.son[i + 1]);
+                        nodeRead(parentNode.son[i + 1], rightBro);
                     }
 
-                    //borrow 均为 K-V 值交换, 不改变树的结构, (不用改parent) 狗屁!!!
-                    //merge 需要改
+                    //borrow 均为 K-V 值交换, 不改变树的结构, 节点不存 parent, 挪动的孩子也不用改
 
                     if (leftBro.siz > NODE_MIN_SIZE) { // borrow from left
                         //left key[i-1] node
@@ -252,24 +846,23 @@ namespace Sirius {
                         node.key[0] = parentNode.key[i - 1];
                         node.val[0] = parentNode.val[i - 1];
                         node.son[0] = leftBro.son[leftBro.siz];
-                        disk.writeParent(leftBro.son[leftBro.siz], nodePos);
                         node.siz++;
 
                         parentNode.key[i - 1] = leftBro.key[leftBro.siz - 1];
                         parentNode.val[i - 1] = leftBro.val[leftBro.siz - 1];
-                        leftBro.key[leftBro.siz - 1] = leftBro.son[leftBro.siz] = NULL_NUM;
+                        leftBro.son[leftBro.siz] = NULL_NUM;
                         leftBro.siz--;
 
-                        disk.write(parentNode.son[i-1], leftBro);
-                        disk.write(node.parent, parentNode);
-                        disk.write(nodePos, node);
+                        nodeWrite(parentNode.son[i-1], leftBro);
+                        nodeWrite(parentPos, parentNode);
+                        nodeWrite(nodePos, node);
+                        deleteFix(node, nodePos, path); //批量删除时可能一次缺不止一个, 借完还不够就继续
                     } else if (rightBro.siz > NODE_MIN_SIZE) { // borrow from right
                         //node key[i] right
                         DEBUG("right borrow")
                         node.key[node.siz] = parentNode.key[i];
                         node.val[node.siz] = parentNode.val[i];
                         node.son[node.siz + 1] = rightBro.son[0];
-                        disk.writeParent(rightBro.son[0], nodePos);
                         node.siz++;
 
                         parentNode.key[i] = rightBro.key[0];
@@ -282,12 +875,13 @@ namespace Sirius {
                             rightBro.son[j + 1] = rightBro.son[j + 2];
                         }
 
-                        rightBro.key[rightBro.siz-1] = rightBro.son[rightBro.siz] = NULL_NUM;
+                        rightBro.son[rightBro.siz] = NULL_NUM;
                         rightBro.siz--;
 
-                        disk.write(parentNode.son[i+1], rightBro);
-                        disk.write(node.parent, parentNode);
-                        disk.write(nodePos, node);
+                        nodeWrite(parentNode.son[i+1], rightBro);
+                        nodeWrite(parentPos, parentNode);
+                        nodeWrite(nodePos, node);
+                        deleteFix(node, nodePos, path);
                     } else { // merge
                         if (leftBro.siz > 0) {
                             DEBUG("left merge")
@@ -295,12 +889,10 @@ namespace Sirius {
                             leftBro.key[leftBro.siz] = parentNode.key[i-1];
                             leftBro.val[leftBro.siz] = parentNode.val[i-1];
                             leftBro.son[leftBro.siz + 1] = node.son[0];
-                            disk.writeParent(node.son[0], parentNode.son[i-1]);
                             for (int j = 0; j < node.siz; ++j) {
                                 leftBro.key[leftBro.siz + 1 + j] = node.key[j];
                                 leftBro.val[leftBro.siz + 1 + j] = node.val[j];
                                 leftBro.son[leftBro.siz + 1 + j + 1] = node.son[j + 1];
-                                disk.writeParent(node.son[j+1], parentNode.son[i-1]);
                             }
 
                             leftBro.siz += node.siz + 1;
@@ -311,20 +903,20 @@ namespace Sirius {
                                 parentNode.son[j] = parentNode.son[j+1];
                             }
                             parentNode.siz--;
-                            parentNode.key[parentNode.siz] = parentNode.son[parentNode.siz + 1] = NULL_NUM;
+                            parentNode.son[parentNode.siz + 1] = NULL_NUM;
 
-                            base.recyclePool.push(nodePos); //delete node
+                            pageFree(nodePos); //delete node
 
-                            if (parentNode.siz <= 0) { //父节点删空, 减少一层
-                                base.rootPos = parentNode.son[i-1];
-                                base.recyclePool.push(node.parent);
-                                node.parent = NULL_NUM;
-                                disk.write(parentNode.son[i-1], leftBro);
+                            if (parentNode.siz <= 0 && parentPos == currentRoot()) { //根节点删空, 减少一层
+                                setRoot(parentNode.son[i-1]);
+                                pageFree(parentPos);
+                                nodeWrite(parentNode.son[i-1], leftBro);
                                 return;
                             } else {
-                                disk.write(node.parent, parentNode);
-                                disk.write(parentNode.son[i-1], leftBro);
-                                deleteFix(parentNode, leftBro.parent);
+                                nodeWrite(parentPos, parentNode);
+                                nodeWrite(parentNode.son[i-1], leftBro);
+                                path.pop_back();
+                                deleteFix(parentNode, parentPos, path);
                             }
                         } else if (rightBro.siz > 0) {
                             DEBUG("right merge")
@@ -332,18 +924,16 @@ namespace Sirius {
                             node.key[node.siz] = parentNode.key[i];
                             node.val[node.siz] = parentNode.val[i];
                             node.son[node.siz + 1] = rightBro.son[0];
-                            disk.writeParent(rightBro.son[0], nodePos);
 
                             for (int j = 0; j < rightBro.siz; ++j) {
                                 node.key[node.siz + 1 + j] = rightBro.key[j];
                                 node.val[node.siz + 1 + j] = rightBro.val[j];
                                 node.son[node.siz + 1 + j + 1] = rightBro.son[j + 1];
-                                disk.writeParent(rightBro.son[j+1], nodePos);
                             }
                             node.siz += rightBro.siz + 1;
                             //node key[i] right key[i+1], delete key
 
-                            base.recyclePool.push(parentNode.son[i+1]); //delete right
+                            pageFree(parentNode.son[i+1]); //delete right
 
                             for (int j = i+1; j < parentNode.siz; ++j) {
                                 parentNode.key[j-1] = parentNode.key[j];
@@ -351,18 +941,18 @@ namespace Sirius {
                                 parentNode.son[j] = parentNode.son[j+1];
                             }
                             parentNode.siz--;
-                            parentNode.key[parentNode.siz] = parentNode.son[parentNode.siz + 1] = NULL_NUM;
+                            parentNode.son[parentNode.siz + 1] = NULL_NUM;
 
-                            if (parentNode.siz <= 0) { //父节点删空, 减少一层
-                                base.rootPos = parentNode.son[i];
-                                base.recyclePool.push(node.parent);
-                                node.parent = NULL_NUM;
-                                disk.write(nodePos, node);
+                            if (parentNode.siz <= 0 && parentPos == currentRoot()) { //根节点删空, 减少一层
+                                setRoot(parentNode.son[i]);
+                                pageFree(parentPos);
+                                nodeWrite(nodePos, node);
                                 return;
                             } else {
-                                disk.write(node.parent, parentNode);
-                                disk.write(nodePos, node);
-                                deleteFix(parentNode, node.parent);
+                                nodeWrite(parentPos, parentNode);
+                                nodeWrite(nodePos, node);
+                                path.pop_back();
+                                deleteFix(parentNode, parentPos, path);
                             }
                         } else {
                             throw "Panic";
@@ -376,206 +966,1377 @@ namespace Sirius {
         /*
          * 内部函数, 删除指定位置的节点
          * 一定是最底层, son均为-1, 不用操作, fix交给专门函数做
+         * 根节点删空时保留这一页作为空根, 不能退回第一页, 那一页可能早已被回收复用
          */
-        void nodeDelete(BTreeNode &node, fpos_t nodePos, int deletePos) {
+        void nodeDelete(BTreeNode &node, fpos_t nodePos, std::vector<fpos_t> &path, int deletePos) {
             node.siz--;
             DEBUG("deletePos: " << deletePos)
             for (int i = deletePos; i < node.siz; ++i) {
                 node.key[i] = node.key[i + 1];
                 node.val[i] = node.val[i + 1];
             }
-            node.key[node.siz] = node.son[node.siz+1] = NULL_NUM;
-            disk.write(nodePos, node);
-            deleteFix(node, nodePos);
+            node.son[node.siz+1] = NULL_NUM;
+            nodeWrite(nodePos, node);
+            deleteFix(node, nodePos, path);
+        }
 
-            if (base.rootPos == nodePos && node.siz == 0) {
-                base.rootPos = sizeof(TreeBase);
-            }
+        void walLog(int op, const store_t &key, const Val &val) {
+            if (!wal.enabled() || replaying) return;
+            RedoRecord rec;
+            memset(&rec, 0, sizeof(RedoRecord));
+            rec.op = op;
+            rec.key = key;
+            rec.val = val;
+            wal.logRedo(&rec, sizeof(RedoRecord));
         }
 
-    public:
         /*
-         * 采用单文件设计, 便于内存回收
-         * 索引-数据库架构可以将此B树作为索引, 另写一个文件池结合搭建
+         * 只在一个操作完整结束后检查, 操作中途做检查点会把还没写进节点的修改和它的日志一起丢掉
          */
-        BTree(const char *dataFileName):base(sizeof(TreeBase)) {
-            data = fopen(dataFileName, "rb+");
-
-            if (!data) {
-                FILE *fileCreator;
-                fileCreator = fopen(dataFileName, "wb");
-                fwrite(reinterpret_cast<char *>(&base), sizeof(TreeBase), 1, fileCreator);
-                fclose(fileCreator);
-                data = fopen(dataFileName, "rb+");
-                disk.setFile(data);
-            } else {
-                DEBUG("second time")
-                fseek(data, 0, SEEK_SET);
-                fread(reinterpret_cast<char *>(&base), sizeof(TreeBase), 1, data);
-                disk.setFile(data);
-            }
+        void walMaybeCheckpoint() {
+            if (wal.enabled() && !replaying && wal.size() > WAL_CHECKPOINT_SIZE) checkpoint();
         }
 
-        ~BTree() {
-            //析构时注意写回base
-            fseek(data, 0, SEEK_SET);
-            fwrite(reinterpret_cast<char *>(&base), sizeof(TreeBase), 1, data);
-            fclose(data);
+        /*
+         * 检查点: 先把所有脏页的前像一次记下落盘, 再写回脏页和 base, 数据文件落盘后清空日志
+         */
+        void checkpoint() {
+            wal.commit();
+            disk.forEachDirty([&](fpos_t pos) {wal.preImage(pos, Codec::BYTES);});
+            wal.preImage(0, sizeof(TreeBase));
+            wal.commit();
+            disk.flush();
+            pager.write(0, &base, sizeof(TreeBase));
+            pager.sync();
+            struct stat fileStat;
+            fstat(data, &fileStat);
+            wal.checkpoint(fileStat.st_size);
         }
 
-        size_t size() const {return base.siz;}
-
-        void display() {
-            printf("\n* --- BTree (%d level) --- *\n", M);
-            printf("size: %lu\n", base.siz);
-            printf("base size: %lu\n", sizeof(TreeBase));
-            printf("node size: %lu\n", sizeof(BTreeNode));
-            if (base.siz > 0) {
-                printf("rootPos: %d\n", base.rootPos);
-                nodeDisplay(base.rootPos);
-            } else {
-                printf("<empty tree>\n");
-            }
+        void replay(const std::vector<char> &bytes) {
+            if (bytes.size() != sizeof(RedoRecord)) throw "bad log record";
+            RedoRecord rec;
+            memcpy(&rec, bytes.data(), sizeof(RedoRecord));
+            if (rec.op == WAL_INSERT) storedInsert(rec.key, rec.val);
+            else if (rec.op == WAL_MODIFY) storedModify(rec.key, rec.val);
+            else storedDel(rec.key);
         }
 
         /*
-         * 插入: 从根开始, 到最底层的节点 (子节点是nullptr) 插入
-         * 只负责从根开始往下找到最底层节点, 插入的递归交给内部函数 nodeInsert
-         * 返回是否插入成功
+         * find 的主体, 单线程: 只读, 用 peek 直接看页框 (或 mmap 的映射), 不拷贝整个节点
          */
-        bool insert(const Key &key, const Val &val) {
-            hash_t keyHash = std::hash<Key>{}(key) % HASH_MOD;
-            BTreeNode nowNode;
-            fpos_t nowNodePos = base.rootPos;
-
-            if (base.siz != 0) { //为空则不读, 直接调用默认构造函数
-                //fread(reinterpret_cast<char *>(&nowNode), sizeof(BTreeNode), 1, data);
-                disk.read(nowNodePos, nowNode);
+        bool findDispatch(const store_t &storeKey, Val &val, std::false_type) {
+            if (base.siz == 0) {
+                return false;
             }
 
+            const BTreeNode *nowNode = disk.peek(base.rootPos);
             while (true) {
-                int i = std::lower_bound(nowNode.key, nowNode.key+nowNode.siz, keyHash) - nowNode.key;
-                if (nowNode.key[i] == keyHash) {
-                    DEBUG("key duplicate")
-                    return false;
-                }
-                if (nowNode.son[i] == NULL_NUM) { //最后一层, i与后面后移
-                    DEBUG("insert K-V pair: " << keyHash << " " << val)
-                    nodeInsert(nowNode, nowNodePos, i, keyHash, val, NULL_NUM);
-                    base.siz++;
+                size_t i = nodeSearch(nowNode->key, (int)nowNode->siz, storeKey);
+                if (i < nowNode->siz && nowNode->key[i] == storeKey) {
+                    val = nowNode->val[i]; //found
                     return true;
                 }
-                nowNodePos = nowNode.son[i];
-                disk.read(nowNodePos, nowNode);
+                if (nowNode->son[i] == NULL_NUM) { //最后一层, 找不到
+                    return false;
+                }
+                nowNode = disk.peek(nowNode->son[i]);
             }
         }
 
         /*
-         * 查询: 从根向下遍历
-         * 返回: 是否找到, 值的返回采用引用的方式提高效率
+         * find 的主体, 多线程: 乐观锁耦合, 不拿任何锁 (cache 分片锁只在拷贝时拿一下)
+         * 每个节点拷贝出来后先核对版本号才用; 下到孩子前先记下孩子的版本号再核对父亲, 保证孩子指针那时仍有效
+         * 核对失败就从根重来; 空树的根是 siz 为 0 的页 (可能从没写过, 读出来全 0)
          */
-        bool find(const Key &key, Val &val) {
-            hash_t keyHash = std::hash<Key>{}(key) % HASH_MOD;
+        bool findDispatch(const store_t &storeKey, Val &val, std::true_type) {
             BTreeNode nowNode;
-
-            if (base.siz == 0) {
-                return false;
-            }
-
-            disk.read(base.rootPos, nowNode);
             while (true) {
-                int i = std::lower_bound(nowNode.key, nowNode.key+nowNode.siz, keyHash) - nowNode.key;
-                if (nowNode.key[i] == keyHash) {
-                    val = nowNode.val[i]; //found
-                    return true;
-                }
-                if (nowNode.son[i] == NULL_NUM) { //最后一层, 找不到
-                    return false;
+                typename PageLatches<CONCURRENT>::version_t baseVersion = latches.readBegin(0);
+                fpos_t nowNodePos = __atomic_load_n(&base.rootPos, __ATOMIC_ACQUIRE);
+                typename PageLatches<CONCURRENT>::version_t version = latches.readBegin(nowNodePos);
+                if (!latches.validate(0, baseVersion)) continue;
+
+                while (true) {
+                    disk.read(nowNodePos, nowNode); //读者只看实际位置, remap 是写者操作中途的
+                    if (!latches.validate(nowNodePos, version)) break;
+                    if (nowNode.siz == 0) return false;
+                    size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, storeKey);
+                    if (i < nowNode.siz && nowNode.key[i] == storeKey) {
+                        val = nowNode.val[i];
+                        return true;
+                    }
+                    if (nowNode.son[i] == NULL_NUM) return false;
+                    fpos_t sonPos = nowNode.son[i];
+                    typename PageLatches<CONCURRENT>::version_t sonVersion = latches.readBegin(sonPos);
+                    if (!latches.validate(nowNodePos, version)) break;
+                    nowNodePos = sonPos;
+                    version = sonVersion;
                 }
-                disk.read(nowNode.son[i], nowNode);
             }
         }
 
         /*
-         * 修改: 基本同查询, 找到值后修改即可
-         * 返回: 是否修改成功
+         * 闩耦合时孩子 "安全" 的判断: 这次操作的分裂/合并到它为止, 不会再改它上面的节点
+         * 插入: 再多一个也不会分裂; 变长 key 按 key 全是最长算
+         * 删除: 少一个也不会不足 (根: 少一个也不会删空); 变长 key 按剩下的 key 全被前缀压掉算字节数,
+         *       借的时候父亲那个位置换上的 key 可能更长, 还要满足插入的条件
+         * 修改: 只改 val, 总是安全
          */
-        bool modify(const Key &key, const Val &val) {
-            hash_t keyHash = std::hash<Key>{}(key) % HASH_MOD;
-            BTreeNode nowNode;
-            fpos_t nowNodePos = base.rootPos;
+        static bool insertSafe(const BTreeNode &node, bool) {
+            return node.siz + 1 < M && (int)node.siz + 1 <= safeEntries(VarTag());
+        }
 
-            if (base.siz == 0) {
+        static bool deleteSafe(const BTreeNode &node, bool isRoot, std::false_type) {
+            return isRoot ? node.siz >= 2 : (int)node.siz > NODE_MIN_SIZE;
+        }
+
+        static bool deleteSafe(const BTreeNode &node, bool isRoot, std::true_type) {
+            if (node.siz < 2 || !insertSafe(node, isRoot)) return false;
+            return isRoot || SLOTTED_HEAD + (node.siz - 1) * (SLOTTED_SLOT + sizeof(Val)) >= Codec::BYTES / 4;
+        }
+
+        static bool deleteSafe(const BTreeNode &node, bool isRoot) {return deleteSafe(node, isRoot, VarTag());}
+
+        static bool modifySafe(const BTreeNode &, bool) {return true;}
+
+        /*
+         * 闩耦合的下降: 先闩再读, 安全就放开上面闩着的; 不是闩耦合时就是 nodeRead
+         */
+        void crabRead(fpos_t pos, BTreeNode &node, bool isRoot, bool (*safe)(const BTreeNode &, bool)) {
+            latches.acquire(pos);
+            nodeRead(pos, node);
+            if (safe(node, isRoot)) latches.releaseAbove(pos);
+        }
+
+        /*
+         * 根的位置和元素个数, 闩耦合的写者可能正在改, 原子地读
+         */
+        fpos_t currentRoot() const {return __atomic_load_n(&base.rootPos, __ATOMIC_ACQUIRE);}
+        size_t currentSize() const {return __atomic_load_n(&base.siz, __ATOMIC_RELAXED);}
+
+        /*
+         * 以下三个为 insert/modify/del 的主体, 直接在 store_t 上做, WAL 重放也走这里
+         * 闩耦合时先闩住根指针 (位置 0) 再读根的位置
+         */
+        bool storedInsert(const store_t &storeKey, const Val &val) {
+            BTreeNode nowNode;
+            std::vector<fpos_t> path;
+
+            latches.acquire(0);
+            fpos_t nowNodePos = currentRoot();
+            if (currentSize() != 0) { //为空则不读, 直接调用默认构造函数
+                //fread(reinterpret_cast<char *>(&nowNode), sizeof(BTreeNode), 1, data);
+                crabRead(nowNodePos, nowNode, true, insertSafe);
+            } else if (latches.crabbing()) { //根可能从没写过, 而别的写者正在插第一个, 独占重做
+                latches.giveUp();
+                return false;
+            }
+
+            while (true) {
+                size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, storeKey);
+                if (i < nowNode.siz && nowNode.key[i] == storeKey) {
+                    DEBUG("key duplicate")
+                    return false;
+                }
+                if (nowNode.son[i] == NULL_NUM) { //最后一层, i与后面后移
+                    DEBUG("insert val: " << val)
+                    filterAdd(storeKey);
+                    nodeInsert(nowNode, nowNodePos, path, i, storeKey, val, NULL_NUM);
+                    __atomic_add_fetch(&base.siz, 1, __ATOMIC_RELAXED);
+                    return true;
+                }
+                path.push_back(nowNodePos);
+                nowNodePos = nowNode.son[i];
+                crabRead(nowNodePos, nowNode, false, insertSafe);
+            }
+        }
+
+        bool storedModify(const store_t &storeKey, const Val &val) {
+            BTreeNode nowNode;
+
+            if (currentSize() == 0) {
                 return false;
             }
 
-            disk.read(nowNodePos, nowNode);
+            latches.acquire(0);
+            fpos_t nowNodePos = currentRoot();
+            crabRead(nowNodePos, nowNode, true, modifySafe);
             while (true) {
-                int i = std::lower_bound(nowNode.key, nowNode.key+nowNode.siz, keyHash) - nowNode.key;
-                if (nowNode.key[i] == keyHash) {
+                size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, storeKey);
+                if (i < nowNode.siz && nowNode.key[i] == storeKey) {
                     nowNode.val[i] = val;
-                    disk.write(nowNodePos, nowNode);
+                    nodeWrite(nowNodePos, nowNode);
                     return true;
                 }
                 if (nowNode.son[i] == NULL_NUM) { //最后一层, 找不到
                     return false;
                 }
                 nowNodePos = nowNode.son[i];
-                disk.read(nowNodePos, nowNode);
+                crabRead(nowNodePos, nowNode, false, modifySafe);
             }
         }
 
-        /*
-         * 删除: 基本同查询, 找到值后调用内部函数删除
-         * 返回: 是否删除成功 (即是否找到)
-         */
-        bool del(const Key &key) {
-            hash_t keyHash = std::hash<Key>{}(key) % HASH_MOD;
+        bool storedDel(const store_t &storeKey) {
             BTreeNode nowNode;
-            fpos_t nowNodePos = base.rootPos;
+            std::vector<fpos_t> path;
 
-            if (base.siz <= 0) {
+            if (currentSize() == 0) {
                 DEBUG("empty tree")
                 return false;
             }
 
-            disk.read(nowNodePos, nowNode);
+            latches.acquire(0);
+            fpos_t nowNodePos = currentRoot();
+            crabRead(nowNodePos, nowNode, true, deleteSafe);
             while (true) {
-                if (nowNode.siz > M) {
-                    std::cout << nowNode.parent << ' ' << nowNode.siz << '\n';
-                }
                 assert(nowNode.siz < M);
                 assert(nowNode.siz >= 0);
-                int i = std::lower_bound(nowNode.key, nowNode.key+nowNode.siz, keyHash) - nowNode.key;
-                if (nowNode.key[i] == keyHash) {
+                size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, storeKey);
+                if (i < nowNode.siz && nowNode.key[i] == storeKey) {
                     //son[i] key[i] son[i+1]
+                    if (nowNode.son[i+1] != NULL_NUM && latches.crabbing()) { //非最后一层: 要改的两页之间没闩着, 独占重做
+                        latches.giveUp();
+                        return false;
+                    }
                     if (nowNode.son[i+1] != NULL_NUM) { //非最后一层
                         BTreeNode targetNode;
-                        int targetNodePos = nowNode.son[i+1];
-                        disk.read(targetNodePos, targetNode);
+                        fpos_t targetNodePos = nowNode.son[i+1];
+                        size_t depth = path.size();
+                        path.push_back(nowNodePos);
+                        nodeRead(targetNodePos, targetNode);
                         while (targetNode.son[0] != NULL_NUM) { //查后继
+                            path.push_back(targetNodePos);
                             targetNodePos = targetNode.son[0];
-                            disk.read(targetNodePos, targetNode);
+                            nodeRead(targetNodePos, targetNode);
                         }
                         DEBUG("target: " << targetNodePos)
                         nowNode.key[i] = targetNode.key[0];
                         nowNode.val[i] = targetNode.val[0];
-                        disk.write(nowNodePos, nowNode);
-                        nodeDelete(targetNode, targetNodePos, 0);
+                        if (overflow(nowNode)) { //变长 key 换成更长的后继可能放不下, 先分裂, 再重新找后继所在叶子的祖先
+                            std::vector<fpos_t> upper(path.begin(), path.begin() + depth);
+                            nodeSplit(nowNode, nowNodePos, upper);
+                            ancestorPath(targetNode.key[0], targetNodePos, path);
+                        } else {
+                            nodeWrite(nowNodePos, nowNode);
+                        }
+                        nodeDelete(targetNode, targetNodePos, path, 0);
                     }
                     else {
-                        nodeDelete(nowNode, nowNodePos, i);
+                        nodeDelete(nowNode, nowNodePos, path, i);
                     }
-                    base.siz--;
+                    __atomic_sub_fetch(&base.siz, 1, __ATOMIC_RELAXED);
+                    filterRemove();
                     return true;
                 }
                 if (nowNode.son[i] == NULL_NUM) { //最后一层, 找不到
                     return false;
                 }
+                path.push_back(nowNodePos);
+                nowNodePos = nowNode.son[i];
+                crabRead(nowNodePos, nowNode, false, deleteSafe);
+            }
+        }
+
+        /*
+         * 批量建树的布局: 由总数 N 和每块容量 cap 完全确定
+         * cnt[j] 为第 j 层 (0 为叶子) 的节点数, 每层的孩子/K-V 都尽量平均分给上一层
+         * 节点按后序 (完成顺序) 连续排在文件里, 所以写出时正好按文件顺序, 每页只写一次
+         */
+        struct BulkLayout {
+            std::vector<long long> cnt;
+            long long total, leafEntries;
+
+            BulkLayout(long long n, int cap) {
+                cnt.push_back(std::max((n + 1 + cap) / (cap + 1), 1ll)); //叶子数 L, 满足 n - (L - 1) <= L * cap
+                while (cnt.back() > 1) cnt.push_back((cnt.back() + cap) / (cap + 1));
+                total = 0;
+                for (long long c : cnt) total += c;
+                leafEntries = n - (cnt[0] - 1); //内部节点的 key 数 = 叶子数 - 1
+            }
+
+            int height() const {return cnt.size();}
+
+            //第 j 层 (j >= 1) 第 t 个节点的第一个孩子在第 j-1 层的下标
+            long long childBegin(int j, long long t) const {
+                long long q = cnt[j - 1] / cnt[j], r = cnt[j - 1] % cnt[j];
+                return t * q + std::min(t, r);
+            }
+
+            //第 j 层第 t 个节点的父亲在第 j+1 层的下标
+            long long parentOf(int j, long long t) const {
+                long long q = cnt[j] / cnt[j + 1], r = cnt[j] % cnt[j + 1];
+                return t < r * (q + 1) ? t / (q + 1) : r + (t - r * (q + 1)) / q;
+            }
+
+            long long leafSize(long long t) const {
+                return leafEntries / cnt[0] + (t < leafEntries % cnt[0] ? 1 : 0);
+            }
+
+            /*
+             * 后序下标 = 比它先完成的节点数:
+             * 下面各层里在它 (含) 之前的子树的节点 + 同层在它之前的 + 上面各层祖先之前的
+             */
+            long long postIndex(int j, long long t) const {
+                long long ret = t, boundary = t + 1;
+                for (int i = j; i > 0; --i) {
+                    boundary = boundary == cnt[i] ? cnt[i - 1] : childBegin(i, boundary);
+                    ret += boundary;
+                }
+                long long ancestor = t;
+                for (int k = j; k + 1 < height(); ++k) {
+                    ancestor = parentOf(k, ancestor);
+                    ret += ancestor;
+                }
+                return ret;
+            }
+        };
+
+        /*
+         * 批量建树时的顺序写: 连续的节点攒成一大块再写, 每个节点后面补 0 到槽位大小
+         */
+        class SequentialWriter {
+            Pager &pager;
+            std::vector<char> buf;
+            fpos_t bufPos;
+            static const size_t BUF_SIZE = 1 << 20;
+
+        public:
+            explicit SequentialWriter(Pager &_pager): pager(_pager), bufPos(0) {buf.reserve(BUF_SIZE);}
+
+            void write(fpos_t pos, const BTreeNode &node) {
+                if (!buf.empty() && pos != bufPos + (fpos_t)buf.size()) flush();
+                if (buf.empty()) bufPos = pos;
+                size_t offset = buf.size();
+                buf.resize(offset + NODE_STRIDE, 0);
+                Codec::encode(node, buf.data() + offset);
+                if (buf.size() >= BUF_SIZE) flush();
+            }
+
+            void flush() {
+                if (buf.empty()) return;
+                pager.write(bufPos, buf.data(), buf.size());
+                buf.clear();
+            }
+        };
+
+        /*
+         * 批量建树主体, fetch(key, val) 按顺序给出第 i 个 K-V
+         * 先整片叶子顺序填满, 一个节点完成就挂到父亲上, 父亲的孩子没满时下一个 K-V 作为分隔进父亲
+         */
+        template<class Fetch>
+        void bulkBuild(long long n, double fillFactor, Fetch fetch) {
+            int cap = std::min(M - 1, std::max(2 * NODE_MIN_SIZE, (int)(fillFactor * (M - 1))));
+            if (VAR_KEYS) cap = std::min(cap, safeEntries(VarTag())); //变长 key 按最长的算, 保证放得下
+            cap = std::max(cap, 1);
+            BulkLayout layout(n, cap);
+            int height = layout.height();
+
+            //空树只剩一个空根, 分配器整个重置, 新树从第一页开始连续排
+            //新树绕过 cache 直接写文件, 建好之前锁住根; 旧根那页读者可能又读进了 cache, 写完再丢一次
+            fpos_t oldRoot = base.rootPos;
+            latches.lock(0);
+            latches.lock(oldRoot);
+            disk.discard(oldRoot);
+            pages.reset();
+            fpos_t runBegin = pages.allocRun(layout.total);
+            auto posOf = [&](int j, long long t) {
+                return runBegin + layout.postIndex(j, t) * NODE_STRIDE;
+            };
+
+            SequentialWriter writer(pager);
+            std::vector<BTreeNode> open(height);
+            std::vector<long long> openIdx(height, 0);
+
+            for (long long leaf = 0; leaf < layout.cnt[0]; ++leaf) {
+                BTreeNode &node = open[0];
+                for (long long k = layout.leafSize(leaf); k > 0; --k) {
+                    fetch(node.key[node.siz], node.val[node.siz]);
+                    node.siz++;
+                }
+                //完成的节点挂到父亲上, 父亲孩子满了则父亲也完成, 一直往上
+                for (int j = 0; ; ++j) {
+                    long long t = openIdx[j];
+                    fpos_t nodePos = posOf(j, t);
+                    writer.write(nodePos, open[j]);
+                    open[j] = BTreeNode();
+                    openIdx[j]++;
+                    if (j + 1 == height) {
+                        setRoot(nodePos);
+                        break;
+                    }
+                    BTreeNode &parent = open[j + 1];
+                    parent.son[parent.siz] = nodePos;
+                    if (t + 1 < layout.childBegin(j + 1, openIdx[j + 1] + 1)) { //不是最后一个孩子, 下一个 K-V 做分隔
+                        fetch(parent.key[parent.siz], parent.val[parent.siz]);
+                        parent.siz++;
+                        break;
+                    }
+                }
+            }
+            writer.flush();
+            disk.discard(oldRoot);
+            base.siz = n;
+        }
+
+        template<class Iterator>
+        void bulkLoadDispatch(Iterator first, Iterator last, double fillFactor, std::true_type) {
+            //先过一遍数个数并检查顺序, 检查通过才动树
+            long long n = 1;
+            store_t lastKey = KeyPolicy::encode(first->first);
+            for (Iterator it = std::next(first); it != last; ++it, ++n) {
+                store_t key = KeyPolicy::encode(it->first);
+                if (!(lastKey < key)) throw "bulkLoad input must be sorted with unique keys";
+                lastKey = key;
+            }
+            bulkBuild(n, fillFactor, [&](store_t &key, Val &val) {
+                key = KeyPolicy::encode(first->first);
+                val = first->second;
+                filterAdd(key);
+                ++first;
+            });
+        }
+
+        /*
+         * 哈希策略没有顺序可言, 先全部编码后按哈希值排序, 哈希冲突的只保留第一个 (同 insert)
+         */
+        template<class Iterator>
+        void bulkLoadDispatch(Iterator first, Iterator last, double fillFactor, std::false_type) {
+            std::vector<std::pair<store_t, Val> > sorted;
+            for (; first != last; ++first) sorted.push_back(std::make_pair(KeyPolicy::encode(first->first), first->second));
+            std::stable_sort(sorted.begin(), sorted.end(),
+                             [](const std::pair<store_t, Val> &a, const std::pair<store_t, Val> &b) {return a.first < b.first;});
+            sorted.erase(std::unique(sorted.begin(), sorted.end(),
+                                     [](const std::pair<store_t, Val> &a, const std::pair<store_t, Val> &b) {return a.first == b.first;}),
+                         sorted.end());
+            size_t i = 0;
+            bulkBuild(sorted.size(), fillFactor, [&](store_t &key, Val &val) {
+                key = sorted[i].first;
+                val = sorted[i].second;
+                filterAdd(key);
+                i++;
+            });
+        }
+
+        /*
+         * 批量操作的路径栈: 根到当前节点每层一份拷贝, 加上该子树 key 的上界 (开区间)
+         * 批内 key 递增, 下一个 key 只要还小于某层的上界就一定落在那层的子树里, 从那层往下接着找即可
+         * 根没有上界; 树结构变了 (分裂/合并) 就整个清空, 下一个 key 从根重新走
+         */
+        struct PathEntry {
+            fpos_t pos;
+            BTreeNode node;
+            bool hasHi;
+            store_t hi;
+        };
+
+        /*
+         * 在路径栈上找 key: 先弹掉上界 <= key 的层, 再往下走到命中或最底层
+         * 返回是否命中, 命中或落点为栈顶节点的第 idx 个位置
+         */
+        bool pathSeek(std::vector<PathEntry> &path, const store_t &key, int &idx) {
+            while (!path.empty() && path.back().hasHi && !(key < path.back().hi)) path.pop_back();
+            if (path.empty()) {
+                path.push_back(PathEntry());
+                path.back().pos = base.rootPos;
+                path.back().hasHi = false;
+                if (base.siz != 0) nodeRead(base.rootPos, path.back().node);
+            }
+            while (true) {
+                const BTreeNode &nowNode = path.back().node;
+                size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, key);
+                idx = i;
+                if (i < nowNode.siz && nowNode.key[i] == key) return true;
+                if (nowNode.son[i] == NULL_NUM) return false;
+
+                PathEntry child;
+                child.pos = nowNode.son[i];
+                child.hasHi = i < nowNode.siz || path.back().hasHi;
+                child.hi = i < nowNode.siz ? nowNode.key[i] : path.back().hi;
+                nodeRead(child.pos, child.node);
+                path.push_back(child);
+            }
+        }
+
+        /*
+         * 批内 key 的处理顺序: 按 store_t 稳定排序后的下标, 相同的 key 保持输入顺序
+         */
+        std::vector<size_t> batchOrder(const std::vector<store_t> &keys) {
+            std::vector<size_t> order(keys.size());
+            for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {return keys[a] < keys[b];});
+            return order;
+        }
+
+        /*
+         * 从根往下找 key, 走到 targetPos 为止, 经过的祖先位置放进 path
+         * 遇到相等的 key 往右走: 删除时后继刚被复制到上面, 叶子里那份在它的右子树
+         */
+        void ancestorPath(const store_t &key, fpos_t targetPos, std::vector<fpos_t> &path) {
+            path.clear();
+            fpos_t nowNodePos = base.rootPos;
+            BTreeNode nowNode;
+            while (nowNodePos != targetPos) {
+                nodeRead(nowNodePos, nowNode);
+                path.push_back(nowNodePos);
+                size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, key);
+                if (i < nowNode.siz && nowNode.key[i] == key) i++;
+                nowNodePos = nowNode.son[i];
+            }
+        }
+
+        /*
+         * 切块方案, 返回每块的个数, 块之间各隔一个分隔 K-V
+         * 定长 key: 切成 k 块, 每块至多 M-1 个且尽量平均
+         * 变长 key: 按字节贪心装, 每块不超过 3/4 页 (后面再插几个也不会马上分裂), 个数不超过 M-2
+         */
+        static std::vector<size_t> piecePlan(const std::vector<std::pair<store_t, Val> > &entries, std::false_type) {
+            long long s = entries.size();
+            long long k = (s + 1 + M - 1) / M; //每块至多 M-1 个, 加上 k-1 个分隔共 s 个
+            long long q = (s - (k - 1)) / k, r = (s - (k - 1)) % k;
+            std::vector<size_t> ret;
+            for (long long p = 0; p < k; ++p) ret.push_back(q + (p < r ? 1 : 0));
+            return ret;
+        }
+
+        static std::vector<size_t> piecePlan(const std::vector<std::pair<store_t, Val> > &entries, std::true_type) {
+            const size_t limit = Codec::BYTES * 3 / 4 - SLOTTED_HEAD;
+            std::vector<size_t> ret;
+            size_t s = entries.size(), e = 0;
+            while (e < s) {
+                size_t cnt = 0, used = 0;
+                while (e < s && cnt < M - 2 && (cnt == 0 || used + Codec::entryBytes(entries[e].first, false) <= limit)) {
+                    used += Codec::entryBytes(entries[e].first, false);
+                    cnt++, e++;
+                }
+                ret.push_back(cnt);
+                if (e + 1 < s) e++; //分隔, 后面至少还要留一个给下一块
+                else if (e < s) ret.back()++, e++;
+            }
+            return ret;
+        }
+
+        /*
+         * 叶子一次插入多个 K-V 后放不下: 一次切成 k 块, 块间的 k-1 个 K-V 逐个插进父亲
+         * 第 0 块留在原位置, 其余块新开; 父亲那边还是走 nodeInsert
+         * 前面的块挂上去时父亲可能已经分裂过, 所以每挂一块都按分隔 key 从根重新找一遍第 p 块的祖先
+         * (分隔 key 比第 p 块都大、比第 p+1 块都小, 第 p+1 块还没挂上, 一定走到第 p 块)
+         */
+        void leafSplitInsert(const std::vector<std::pair<store_t, Val> > &entries, fpos_t leafPos) {
+            std::vector<size_t> pieceSize = piecePlan(entries, VarTag());
+            long long k = pieceSize.size();
+
+            std::vector<fpos_t> piecePos(k);
+            std::vector<size_t> sepIdx;
+            size_t e = 0;
+            for (long long p = 0; p < k; ++p) {
+                BTreeNode piece;
+                for (size_t c = pieceSize[p]; c > 0; --c, ++e) {
+                    piece.key[piece.siz] = entries[e].first;
+                    piece.val[piece.siz] = entries[e].second;
+                    piece.siz++;
+                }
+                if (p + 1 < k) sepIdx.push_back(e++);
+                piecePos[p] = p == 0 ? leafPos : newFilePos();
+                nodeWrite(piecePos[p], piece);
+            }
+
+            std::vector<fpos_t> path;
+            for (long long p = 0; p + 1 < k; ++p) {
+                const store_t &sepKey = entries[sepIdx[p]].first;
+                ancestorPath(sepKey, piecePos[p], path);
+                attachSibling(piecePos[p], path, sepKey, entries[sepIdx[p]].second, piecePos[p + 1]);
+            }
+        }
+
+    public:
+        /*
+         * 采用单文件设计, 便于内存回收
+         * 索引-数据库架构可以将此B树作为索引, 另写一个文件池结合搭建
+         * walGroup > 0 开启 WAL; filterBits > 0 开启布隆过滤器, 每个 key 占这么多位 (10 位误判率约 1%)
+         * warmup 为 true 时关闭前记下 cache 里的页, 下次打开时在后台预读回来
+         * dirtyHighWater > 0 开启后台写回, 脏页占 cache 的比例超过它时提前写回最冷的脏页 (随机写用 1, 低了同一页会被改了又写好几次); 不能和 WAL、共享 pool 一起用, 否则抛异常
+         */
+        BTree(const char *dataFileName, PagerType pagerType = PAGER_PIO, int walGroup = 0, int _filterBits = 0, bool _warmup = false,
+              double dirtyHighWater = 0):
+            base(NODE_BEGIN), pages(base.pages, disk, NODE_BEGIN, NODE_STRIDE), replaying(false),
+            dataName(dataFileName), generation(0), frozenGen(0), filterBits(std::max(_filterBits, 0)), filterFd(-1),
+            filter(nullptr), filterJob(FILTER_IDLE), filterStop(false), filterClean(false), treeLevels(-1), warmup(_warmup) {
+            if (dirtyHighWater > 0 && (walGroup > 0 || std::is_same<CachePolicy, SharedPoolPolicy>::value))
+                throw "dirtyHighWater cannot be combined with WAL or SharedPoolPolicy";
+            data = open(dataFileName, O_RDWR | O_CREAT, 0644);
+            if (data < 0) throw "cannot open tree file";
+
+            //WAL 模式先恢复, 数据文件回到上次检查点, 重做记录等树打开后再重放
+            std::vector<std::vector<char> > redo;
+            if (walGroup > 0) {
+                wal.open((std::string(dataFileName) + ".wal").c_str(), walGroup);
+                redo = wal.recover(data);
+            }
+
+            struct stat fileStat;
+            fstat(data, &fileStat);
+            pager.open(data, pagerType);
+            if (fileStat.st_size == 0) {
+                pager.write(0, &base, sizeof(TreeBase));
+            } else {
+                DEBUG("second time")
+                pager.read(0, &base, sizeof(TreeBase));
+                if (!base.check()) {
+                    pager.close();
+                    close(data);
+                    throw "bad tree file: magic, version or node size mismatch";
+                }
+            }
+            disk.setPager(&pager);
+            pages.setPager(&pager);
+            if (dirtyHighWater > 0) {
+                flusher.reset(new Flusher(pager, Codec::BYTES, NODE_STRIDE));
+                disk.flushWith(flusher.get(), dirtyHighWater);
+            }
+            pager.setShared(CONCURRENT || flusher); //后台写回线程和前台同时用 pager
+
+            //过滤器要在重放之前读进来, 重放插入的 key 也要加进去; 读不进来就在后台重建
+            if (filterBits > 0) {
+                filterFd = open((dataName + ".bloom").c_str(), O_RDWR | O_CREAT, 0644);
+                if (filterFd < 0) throw "cannot open bloom filter file";
+                std::unique_ptr<BloomFilter> loaded = BloomFilter::load(filterFd, filterBits, base.siz);
+                if (loaded) {
+                    filterInstall(std::move(loaded));
+                    filterClean = true;
+                }
+            }
+
+            WriteScope<CONCURRENT> scope(latches);
+            if (wal.enabled()) {
+                wal.setPager(&pager);
+                pager.setHook(&wal);
+                replaying = true;
+                for (const std::vector<char> &rec : redo) replay(rec);
+                replaying = false;
+                checkpoint();
+            }
+            filterMaybeRebuild();
+            //重放完再开始预热, 之后改到的页 cache 都会记下
+            if (warmup) warmStart();
+        }
+
+        ~BTree() {
+            //后台重建的过滤器不要了, 下次打开再建
+            filterStop.store(true, std::memory_order_relaxed);
+            if (filterThread.joinable()) filterThread.join();
+            building.reset();
+            //还没读完的预热不要了
+            disk.warmFrom(nullptr);
+            warmer.reset();
+            //还没放掉的快照从此失效, 退休的页全部还给分配器
+            snapshots.clear();
+            reclaim();
+            //析构时注意先写回cache再写回base, 最后才能关文件
+            if (wal.enabled()) {
+                checkpoint();
+                pager.setHook(nullptr);
+            } else {
+                disk.flush();
+                pager.write(0, &base, sizeof(TreeBase));
+            }
+            //交给后台的页在上面 flush 时已经写完
+            disk.flushWith(nullptr);
+            flusher.reset();
+            filterSave();
+            if (filterFd >= 0) close(filterFd);
+            if (warmup) warmSave();
+            pager.close();
+            close(data);
+        }
+
+        /*
+         * 检查点: cache 脏页和 base 写回后落盘 (mmap 后端为 msync), WAL 模式下之后清空日志
+         */
+        void sync() {
+            WriteScope<CONCURRENT> scope(latches);
+            if (wal.enabled()) {
+                checkpoint();
+            } else {
+                disk.flush();
+                pager.write(0, &base, sizeof(TreeBase));
+                pager.sync();
+            }
+            filterCollect(false);
+            filterSave();
+            if (warmup) warmSave();
+        }
+
+        /*
+         * 现在就把 cache 里的页存下来给下次打开预热, 不用等 sync 或关闭; 开了 warmup 才有用
+         * 只写一个小文件, 不落盘, 可以按固定间隔调用
+         */
+        void saveWarmup() {
+            WriteScope<CONCURRENT> scope(latches);
+            if (warmup) warmSave();
+        }
+
+        /*
+         * WAL 模式下的组提交: 还没 fsync 的重做记录立刻落盘, 返回后之前的修改崩溃也不会丢
+         * 不调用的话每 walGroup 条记录自动提交一次
+         */
+        void commit() {
+            if (wal.enabled()) wal.commit();
+        }
+
+        /*
+         * WAL 模式下每次日志落盘、检查点之前调用, 树外的数据 (如值日志) 在这里先落盘
+         */
+        void setBeforeCommit(std::function<void()> hook) {
+            wal.setBeforeCommit(hook);
+        }
+
+        size_t size() const {return currentSize();}
+
+        CacheStats cacheStats() const {return disk.stats();}
+
+        /*
+         * 计数汇总: cache (命中、淘汰、写回、直接写盘), 数据文件的读写字节数, 页的分配与释放, 布隆过滤器的拦截与误判
+         * 计数一直开着, 开销只是几次加法; resetStats 清零, 方便只看一段负载
+         */
+        struct Stats {
+            CacheStats cache;
+            IoStats io;
+            size_t pagesAllocated, pagesFreed;
+            FilterStats filter;
+            size_t warmupReads, warmupPages; //预热的后台读盘次数和读上来的页数, 装进 cache 的见 cache.prefetched
+            size_t backgroundWrites, backgroundPages, foregroundStalls; //后台写回的写盘次数、页数, 前台因为队列满等的次数
+        };
+
+        Stats stats() {
+            WriteScope<CONCURRENT> scope(latches);
+            Stats ret;
+            ret.cache = disk.stats();
+            ret.io = pager.stats();
+            ret.pagesAllocated = pages.pagesAllocated();
+            ret.pagesFreed = pages.pagesReleased();
+            ret.filter.checks = __atomic_load_n(&filterCounter.checks, __ATOMIC_RELAXED);
+            ret.filter.negatives = __atomic_load_n(&filterCounter.negatives, __ATOMIC_RELAXED);
+            ret.filter.falsePositives = __atomic_load_n(&filterCounter.falsePositives, __ATOMIC_RELAXED);
+            int height = __atomic_load_n(&treeLevels, __ATOMIC_RELAXED);
+            ret.filter.pagesSaved = base.siz == 0 ? 0 : ret.filter.negatives * std::max(height, 0);
+            ret.warmupReads = warmer ? warmer->reads() : 0;
+            ret.warmupPages = warmer ? warmer->pages() : 0;
+            ret.backgroundWrites = flusher ? flusher->backgroundWrites() : 0;
+            ret.backgroundPages = flusher ? flusher->backgroundPages() : 0;
+            ret.foregroundStalls = flusher ? flusher->foregroundStalls() : 0;
+            return ret;
+        }
+
+        void resetStats() {
+            WriteScope<CONCURRENT> scope(latches);
+            disk.resetStats();
+            pager.resetStats();
+            pages.resetStats();
+            if (flusher) flusher->resetStats();
+            __atomic_store_n(&filterCounter.checks, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&filterCounter.negatives, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&filterCounter.falsePositives, 0, __ATOMIC_RELAXED);
+        }
+
+        void display() {
+            WriteScope<CONCURRENT> scope(latches);
+            printf("\n* --- BTree (%d level) --- *\n", M);
+            printf("size: %lu\n", base.siz);
+            printf("base size: %lu\n", sizeof(TreeBase));
+            printf("node size: %lu (slot %lld)\n", sizeof(BTreeNode), NODE_STRIDE);
+            printf("pages: %lld (free %lld)\n", pages.pageCount(), pages.freeCount());
+            CacheStats cacheStat = disk.stats();
+            IoStats ioStat = pager.stats();
+            printf("cache (%s) hit rate: %.4lf, evictions: %lu\n", CachePolicy::name(), cacheStat.hitRate(), cacheStat.evictions);
+            printf("cache write backs: %lu (skipped %lu), direct writes: %lu\n", cacheStat.writeBacks, cacheStat.writeBacksSkipped,
+                   cacheStat.directWrites);
+            printf("io: %lu reads (%lu bytes), %lu writes (%lu bytes), %lu syncs\n", ioStat.reads, ioStat.bytesRead,
+                   ioStat.writes, ioStat.bytesWritten, ioStat.syncs);
+            printf("pages allocated: %lu, freed: %lu\n", pages.pagesAllocated(), pages.pagesReleased());
+            if (flusher) printf("background write back: %lu writes, %lu pages, %lu stalls\n", flusher->backgroundWrites(),
+                                flusher->backgroundPages(), flusher->foregroundStalls());
+            if (warmer) printf("warm-up: %lu reads, %lu pages read, %lu prefetched\n", warmer->reads(), warmer->pages(), cacheStat.prefetched);
+            if (wal.enabled()) printf("wal: %lu records, %lu syncs\n", wal.records(), wal.syncs());
+            if (filter != nullptr) {
+                printf("bloom filter: %lu bytes, %lu keys added, %lu removed, false positive rate %.4lf\n", filter->bytes(),
+                       filter->added, filter->removed, filterCounter.falsePositiveRate());
+            }
+            if (base.siz > 0) {
+                printf("rootPos: %lld\n", base.rootPos);
+                nodeDisplay(base.rootPos);
+            } else {
+                printf("<empty tree>\n");
+            }
+        }
+
+        /*
+         * 多线程时 insert / modify / del 先试闩耦合, 和别的闩耦合写者同时进行 (见 latch.hpp)
+         * 开了 WAL 或过滤器、有快照或退休的页时要动树外共用的东西, 直接独占; 中途发现要独占 (还没改任何页) 也退回来
+         * 返回 op 的结果, -1 表示调用者要独占重做
+         */
+        template<class Op>
+        int crabWrite(Op op) {
+            if (!CONCURRENT) return -1;
+            CrabScope<CONCURRENT> scope(latches);
+            if (wal.enabled() || filterBits > 0 || !snapshots.empty() || !retired.empty()) return -1;
+            bool ret = op();
+            return scope.gaveUp() ? -1 : ret;
+        }
+
+        /*
+         * 插入: 从根开始, 到最底层的节点 (子节点是nullptr) 插入
+         * 只负责从根开始往下找到最底层节点, 插入的递归交给内部函数 nodeInsert
+         * 返回是否插入成功
+         */
+        bool insert(const Key &key, const Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            int crabbed = crabWrite([&] {return storedInsert(storeKey, val);});
+            if (crabbed >= 0) return crabbed;
+            WriteScope<CONCURRENT> scope(latches);
+            reclaimMaybe();
+            if (!storedInsert(storeKey, val)) return false;
+            cowFinish();
+            walLog(WAL_INSERT, storeKey, val);
+            walMaybeCheckpoint();
+            filterMaybeRebuild();
+            return true;
+        }
+
+        /*
+         * 查询: 从根向下遍历
+         * 返回: 是否找到, 值的返回采用引用的方式提高效率
+         */
+        bool find(const Key &key, Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            if (!CONCURRENT) filterCollect(false); //单线程时没有别的写者, 建好的过滤器查询时也可以换上
+            if (!filterPass(storeKey)) return false;
+            if (findDispatch(storeKey, val, std::integral_constant<bool, CONCURRENT>())) return true;
+            filterMiss();
+            return false;
+        }
+
+        /*
+         * 修改: 基本同查询, 找到值后修改即可
+         * 返回: 是否修改成功
+         */
+        bool modify(const Key &key, const Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            if (!filterPass(storeKey)) return false;
+            int crabbed = crabWrite([&] {return storedModify(storeKey, val);});
+            if (crabbed >= 0) return crabbed;
+            WriteScope<CONCURRENT> scope(latches);
+            reclaimMaybe();
+            if (!storedModify(storeKey, val)) {
+                filterMiss();
+                return false;
+            }
+            cowFinish();
+            walLog(WAL_MODIFY, storeKey, val);
+            walMaybeCheckpoint();
+            return true;
+        }
+
+        /*
+         * 删除: 基本同查询, 找到值后调用内部函数删除
+         * 返回: 是否删除成功 (即是否找到)
+         */
+        bool del(const Key &key) {
+            store_t storeKey = KeyPolicy::encode(key);
+            if (!filterPass(storeKey)) return false;
+            int crabbed = crabWrite([&] {return storedDel(storeKey);});
+            if (crabbed >= 0) return crabbed;
+            WriteScope<CONCURRENT> scope(latches);
+            reclaimMaybe();
+            if (!storedDel(storeKey)) {
+                filterMiss();
+                return false;
+            }
+            cowFinish();
+            walLog(WAL_DEL, storeKey, Val());
+            walMaybeCheckpoint();
+            filterMaybeRebuild();
+            return true;
+        }
+
+        /*
+         * 批量建树: 只能对空树用, [first, last) 为 (key, val) 对, 保序策略下要求按 key 严格递增
+         * fillFactor 为每块的填充率, 会被限制在保证 B 树大小下限的范围内
+         * 叶子按顺序整片写出, 再写上层, 每页只写一次, 文件里按写出顺序连续排列
+         */
+        template<class Iterator>
+        void bulkLoad(Iterator first, Iterator last, double fillFactor = 1.0) {
+            WriteScope<CONCURRENT> scope(latches);
+            if (base.siz != 0) throw "bulkLoad requires an empty tree";
+            filterCollect(true); //后台重建拿着快照, 先等它结束
+            reclaimMaybe();
+            if (!snapshots.empty()) throw "bulkLoad with live snapshots"; //会重置分配器
+            if (first == last) return;
+            if (filterBits > 0) {
+                filterInstall(std::unique_ptr<BloomFilter>(
+                    new BloomFilter(filterBits, std::max((size_t)std::distance(first, last) * 2, (size_t)FILTER_MIN_KEYS))));
+            }
+            bulkLoadDispatch(first, last, fillFactor, std::integral_constant<bool, KeyPolicy::ORDERED>());
+            if (wal.enabled()) checkpoint(); //整棵树一次建好, 不记重做, 直接做检查点
+            filterMaybeRebuild();
+        }
+
+        /*
+         * 批量查询: 批内先按 store_t 排序, 相邻 key 共用路径栈, 同一节点不重复读
+         * vals/found 与 keys 下标对应, 返回找到的个数
+         */
+        size_t findBatch(const std::vector<Key> &keys, std::vector<Val> &vals, std::vector<bool> &found) {
+            WriteScope<CONCURRENT> scope(latches);
+            vals.assign(keys.size(), Val());
+            found.assign(keys.size(), false);
+            if (base.siz == 0) return 0;
+
+            std::vector<store_t> storeKeys;
+            for (const Key &key : keys) storeKeys.push_back(KeyPolicy::encode(key));
+            std::vector<size_t> order = batchOrder(storeKeys);
+            std::vector<PathEntry> path;
+            path.reserve(64);
+
+            size_t cnt = 0;
+            for (size_t id : order) {
+                int i;
+                if (!filterPass(storeKeys[id])) continue;
+                if (pathSeek(path, storeKeys[id], i)) {
+                    vals[id] = path.back().node.val[i];
+                    found[id] = true;
+                    cnt++;
+                } else {
+                    filterMiss();
+                }
+            }
+            return cnt;
+        }
+
+        /*
+         * 批量插入: 落在同一叶子的一段 key 合并后一次写回, 超出则一次多路分裂
+         * 重复的 key (与树中或批内之前的) 跳过, 同 insert; 返回插入的个数
+         */
+        size_t insertBatch(const std::vector<std::pair<Key, Val> > &kvs) {
+            WriteScope<CONCURRENT> scope(latches);
+            reclaimMaybe();
+            std::vector<store_t> storeKeys;
+            for (const std::pair<Key, Val> &kv : kvs) storeKeys.push_back(KeyPolicy::encode(kv.first));
+            std::vector<size_t> order = batchOrder(storeKeys);
+            std::vector<PathEntry> path;
+            path.reserve(64);
+            std::vector<std::pair<store_t, Val> > merged;
+
+            size_t cnt = 0;
+            for (size_t j = 0; j < order.size(); ) {
+                int i;
+                if (pathSeek(path, storeKeys[order[j]], i)) { //key duplicate
+                    j++;
+                    continue;
+                }
+                //叶子子树的开区间内不会有祖先的 key, 所以小于上界的都归这片叶子
+                PathEntry &leaf = path.back();
+                merged.clear();
+                size_t e = 0;
+                store_t *lastKey = nullptr;
+                for (; j < order.size() && (!leaf.hasHi || storeKeys[order[j]] < leaf.hi); ++j) {
+                    store_t &key = storeKeys[order[j]];
+                    if (lastKey != nullptr && *lastKey == key) continue; //批内重复
+                    lastKey = &key;
+                    while (e < leaf.node.siz && leaf.node.key[e] < key) {
+                        merged.push_back(std::make_pair(leaf.node.key[e], leaf.node.val[e]));
+                        e++;
+                    }
+                    if (e < leaf.node.siz && leaf.node.key[e] == key) continue; //树中重复
+                    merged.push_back(std::make_pair(key, kvs[order[j]].second));
+                    filterAdd(key);
+                    walLog(WAL_INSERT, key, kvs[order[j]].second);
+                    cnt++;
+                }
+                for (; e < leaf.node.siz; ++e) merged.push_back(std::make_pair(leaf.node.key[e], leaf.node.val[e]));
+
+                base.siz += merged.size() - leaf.node.siz;
+                bool direct = merged.size() < M;
+                if (direct) {
+                    for (size_t t = 0; t < merged.size(); ++t) {
+                        leaf.node.key[t] = merged[t].first;
+                        leaf.node.val[t] = merged[t].second;
+                    }
+                    leaf.node.siz = merged.size();
+                    direct = !overflow(leaf.node);
+                }
+                if (direct) {
+                    nodeWrite(leaf.pos, leaf.node);
+                } else {
+                    leafSplitInsert(merged, leaf.pos);
+                    path.clear();
+                }
+            }
+            cowFinish();
+            walMaybeCheckpoint();
+            filterMaybeRebuild();
+            return cnt;
+        }
+
+        /*
+         * 批量删除: 落在同一叶子的一段 key 一起删掉后只调整一次
+         * 删的 key 在内部节点上则退回单个 del (要换后继); 返回删除的个数
+         */
+        size_t delBatch(const std::vector<Key> &keys) {
+            WriteScope<CONCURRENT> scope(latches);
+            reclaimMaybe();
+            if (base.siz == 0) return 0;
+            std::vector<store_t> storeKeys;
+            for (const Key &key : keys) storeKeys.push_back(KeyPolicy::encode(key));
+            std::vector<size_t> order = batchOrder(storeKeys);
+            std::vector<PathEntry> path;
+            path.reserve(64);
+
+            size_t cnt = 0;
+            for (size_t j = 0; j < order.size() && base.siz > 0; ) {
+                int i;
+                bool hit = pathSeek(path, storeKeys[order[j]], i);
+                if (hit && path.back().node.son[i + 1] != NULL_NUM) {
+                    if (storedDel(storeKeys[order[j]])) {
+                        walLog(WAL_DEL, storeKeys[order[j]], Val());
+                        cnt++;
+                    }
+                    path.clear();
+                    j++;
+                    continue;
+                }
+                PathEntry &leaf = path.back();
+                BTreeNode &node = leaf.node;
+                size_t kept = 0, e = 0;
+                for (; j < order.size() && (!leaf.hasHi || storeKeys[order[j]] < leaf.hi); ++j) {
+                    const store_t &key = storeKeys[order[j]];
+                    for (; e < node.siz && node.key[e] < key; ++e, ++kept) {
+                        node.key[kept] = node.key[e];
+                        node.val[kept] = node.val[e];
+                    }
+                    if (e < node.siz && node.key[e] == key) { //删掉, 批内重复的 key 下一轮就对不上了
+                        walLog(WAL_DEL, key, Val());
+                        filterRemove();
+                        e++;
+                    }
+                }
+                for (; e < node.siz; ++e, ++kept) {
+                    node.key[kept] = node.key[e];
+                    node.val[kept] = node.val[e];
+                }
+                size_t removed = node.siz - kept;
+                if (removed == 0) continue;
+
+                node.siz = kept;
+                cnt += removed;
+                base.siz -= removed;
+                nodeWrite(leaf.pos, node);
+                if (underflow(node) && leaf.pos != base.rootPos) {
+                    std::vector<fpos_t> ancestors;
+                    for (size_t t = 0; t + 1 < path.size(); ++t) ancestors.push_back(path[t].pos);
+                    deleteFix(node, leaf.pos, ancestors);
+                    path.clear();
+                }
+            }
+            cowFinish();
+            walMaybeCheckpoint();
+            filterMaybeRebuild();
+            return cnt;
+        }
+
+        /*
+         * 快照句柄: 拍下时那棵树的只读视图, 之后写者的修改都写在新页上, 看不到
+         * 读的时候不加任何锁, 也不经过树的 cache, 用自己的描述符直接 pread 盘上的页, 多个线程可以同时读
+         * 句柄可以随意拷贝, 最后一个拷贝析构后, 这段时间里被换下的页在写者下一次修改时还给分配器
+         * 注意快照要在树析构前放掉; 进程崩溃时退休的页不会回收 (空间泄漏, 数据不受影响)
+         */
+        class Snapshot {
+            friend class BTree;
+
+            std::shared_ptr<SnapshotState> state;
+
+            explicit Snapshot(const std::shared_ptr<SnapshotState> &_state): state(_state) {}
+
+            void load(fpos_t pos, BTreeNode &node, std::vector<char> &page) const {
+                diskRead(state->fd, pos, page.data(), Codec::BYTES);
+                Codec::decode(page.data(), node);
+            }
+
+            template<class Callback>
+            bool scanNode(fpos_t pos, const store_t &lo, const store_t &hi, Callback &callback, size_t &cnt,
+                          std::vector<char> &page) const {
+                std::unique_ptr<BTreeNode> node(new BTreeNode);
+                load(pos, *node, page);
+                size_t i = nodeSearch(node->key, (int)node->siz, lo);
+                for (; i <= node->siz; ++i) {
+                    if (node->son[i] != NULL_NUM && !scanNode(node->son[i], lo, hi, callback, cnt, page)) return false;
+                    if (i == node->siz) break;
+                    if (hi < node->key[i]) return false;
+                    callback(KeyPolicy::decode(node->key[i]), node->val[i]);
+                    cnt++;
+                }
+                return true;
+            }
+
+            template<class Callback>
+            bool walk(fpos_t pos, Callback &callback, std::vector<char> &page) const {
+                std::unique_ptr<BTreeNode> node(new BTreeNode);
+                load(pos, *node, page);
+                for (int i = 0; i <= (int)node->siz; ++i) {
+                    if (node->son[i] != NULL_NUM && !walk(node->son[i], callback, page)) return false;
+                    if (i < (int)node->siz && !callback(node->key[i])) return false;
+                }
+                return true;
+            }
+
+            /*
+             * 快照里的每个 store_t 调用一次 callback, 返回 false 时停下; 不要求保序, 重建过滤器用
+             */
+            template<class Callback>
+            bool forEach(Callback callback) const {
+                if (state->siz == 0) return true;
+                std::vector<char> page(Codec::BYTES);
+                return walk(state->rootPos, callback, page);
+            }
+
+        public:
+            Snapshot() {}
+
+            bool valid() const {return state != nullptr;}
+
+            size_t size() const {return state->siz;}
+
+            bool find(const Key &key, Val &val) const {
+                if (state->siz == 0) return false;
+                store_t storeKey = KeyPolicy::encode(key);
+                std::unique_ptr<BTreeNode> node(new BTreeNode);
+                std::vector<char> page(Codec::BYTES);
+                fpos_t nowNodePos = state->rootPos;
+                while (nowNodePos != NULL_NUM) {
+                    load(nowNodePos, *node, page);
+                    size_t i = nodeSearch(node->key, (int)node->siz, storeKey);
+                    if (i < node->siz && node->key[i] == storeKey) {
+                        val = node->val[i];
+                        return true;
+                    }
+                    nowNodePos = node->son[i];
+                }
+                return false;
+            }
+
+            /*
+             * 范围查询, 同 BTree::scan, 返回访问的 K-V 个数
+             */
+            template<class Callback>
+            size_t scan(const Key &lo, const Key &hi, Callback callback) const {
+                static_assert(KeyPolicy::ORDERED, "scan requires an ordered KeyPolicy");
+                size_t cnt = 0;
+                if (state->siz == 0) return 0;
+                std::vector<char> page(Codec::BYTES);
+                scanNode(state->rootPos, KeyPolicy::encode(lo), KeyPolicy::encode(hi), callback, cnt, page);
+                return cnt;
+            }
+        };
+
+    private:
+        //拍快照的主体, 调用者已经独占整棵树 (后台重建过滤器时写者自己也会拍)
+        Snapshot snapshotLocked() {
+            reclaim();
+            if (wal.enabled()) checkpoint();
+            else disk.flush();
+            generation++;
+            std::shared_ptr<SnapshotState> state(new SnapshotState);
+            state->rootPos = base.rootPos, state->siz = base.siz, state->gen = generation;
+            state->fd = open(dataName.c_str(), O_RDONLY);
+            if (state->fd < 0) throw "cannot open snapshot";
+            snapshots.push_back(state);
+            frozenGen = generation;
+            return Snapshot(state);
+        }
+
+    public:
+        /*
+         * 拍快照: 先把脏页写回 (开 WAL 时做一次检查点), 盘上就是此刻的整棵树, 之后这些页都冻住
+         * 返回的句柄放掉之前, 写者改到冻住的页时写时复制 (见 cowFinish), 代价是祖先一路重写到根
+         */
+        Snapshot snapshot() {
+            WriteScope<CONCURRENT> scope(latches);
+            return snapshotLocked();
+        }
+
+        /*
+         * 在线整理: 文件尾部的活页搬到最靠前的空页上, 改好父亲的指针, 尾部连续的空页从高水位上摘掉
+         * 每次至多搬 maxPages 页, 可以和前台操作交替调用; 尾部空出 TRUNCATE_SLACK 以上或整理完时截短文件
+         * 第一次调用时把空闲链读进内存 (见 PageAllocator::buildIndex); 有活的快照时不整理, 后台重建过滤器用的快照则先等它结束
+         * 返回本次搬的页数, 返回 0 说明已经紧凑
+         */
+        size_t compact(size_t maxPages = 64) {
+            WriteScope<CONCURRENT> scope(latches);
+            filterCollect(true);
+            reclaimMaybe();
+            if (!snapshots.empty()) return 0;
+            pages.buildIndex();
+            size_t moved = 0;
+            while (true) {
+                pages.shrink();
+                fpos_t hole = pages.lowestFree();
+                if (hole == NULL_NUM || moved == maxPages) break;
+                relocate(pages.lastPage(), hole);
+                moved++;
+            }
+            fpos_t slack = fileSize() - pager.truncatedSize(NODE_BEGIN + pages.pageCount() * NODE_STRIDE);
+            if (slack > 0 && (slack >= TRUNCATE_SLACK || pages.lowestFree() == NULL_NUM)) truncateTail();
+            return moved;
+        }
+
+        /*
+         * 游标: 按 store_t 的顺序双向遍历, 只有保序的 KeyPolicy 遍历出来才是 key 的顺序
+         * path 记录根到当前节点的路径, 祖先记录的是下降时走的 son 下标, 当前节点记录的是 key 下标
+         * 当前节点保留一份拷贝, 同一节点内移动不读盘; 树被修改后游标失效, 需要重新 lowerBound
+         */
+        class Cursor {
+            friend class BTree;
+
+            BTree *tree;
+            std::vector<std::pair<fpos_t, size_t> > path;
+            BTreeNode node;
+
+            explicit Cursor(BTree *_tree): tree(_tree) {}
+
+            //从 path 的栈顶节点 (已读入 node) 一直往 son[sonIdx] 的最左/最右下降到最底层
+            void descend(size_t sonIdx, bool leftMost) {
+                path.back().second = sonIdx;
+                while (node.son[sonIdx] != NULL_NUM) {
+                    fpos_t sonPos = node.son[sonIdx];
+                    tree->disk.read(sonPos, node);
+                    sonIdx = leftMost ? 0 : node.siz;
+                    path.push_back(std::make_pair(sonPos, sonIdx));
+                }
+                path.back().second = leftMost ? 0 : node.siz - 1;
+            }
+
+            //当前节点走完, 回溯到第一个还有 key 没走的祖先
+            void ascend(bool forward) {
+                path.pop_back();
+                while (!path.empty()) {
+                    tree->disk.read(path.back().first, node);
+                    size_t sonIdx = path.back().second;
+                    if (forward && sonIdx < node.siz) return; //key[sonIdx] 正好在 son[sonIdx] 之后
+                    if (!forward && sonIdx > 0) {
+                        path.back().second = sonIdx - 1;
+                        return;
+                    }
+                    path.pop_back();
+                }
+            }
+
+        public:
+            bool valid() const {return !path.empty();}
+
+            Key key() const {
+                static_assert(KeyPolicy::ORDERED, "cursor key() requires an ordered KeyPolicy");
+                return KeyPolicy::decode(node.key[path.back().second]);
+            }
+
+            const Val &val() const {return node.val[path.back().second];}
+
+            /*
+             * 后继: 有右子树则去右子树最左, 否则同节点后移, 走完则回溯
+             * 返回移动后是否仍有效
+             */
+            bool next() {
+                if (!valid()) return false;
+                size_t i = path.back().second;
+                if (node.son[i + 1] != NULL_NUM) descend(i + 1, true);
+                else if (i + 1 < node.siz) path.back().second++;
+                else ascend(true);
+                return valid();
+            }
+
+            /*
+             * 前驱: 与 next 对称
+             */
+            bool prev() {
+                if (!valid()) return false;
+                size_t i = path.back().second;
+                if (node.son[i] != NULL_NUM) descend(i, false);
+                else if (i > 0) path.back().second--;
+                else ascend(false);
+                return valid();
+            }
+        };
+
+    private:
+        //lowerBound 的主体, scan 拿着写者的作用域也用它
+        Cursor seek(const Key &key) {
+            store_t storeKey = KeyPolicy::encode(key);
+            Cursor cursor(this);
+            if (base.siz == 0) return cursor;
+
+            fpos_t nowNodePos = base.rootPos;
+            disk.read(nowNodePos, cursor.node);
+            while (true) {
+                BTreeNode &nowNode = cursor.node;
+                size_t i = nodeSearch(nowNode.key, (int)nowNode.siz, storeKey);
+                if (i < nowNode.siz && nowNode.key[i] == storeKey) {
+                    cursor.path.push_back(std::make_pair(nowNodePos, i));
+                    return cursor;
+                }
+                if (nowNode.son[i] == NULL_NUM) { //最后一层, 落在 key[i] 之前; 落在末尾则视为末尾 key 的后继
+                    if (i < nowNode.siz) {
+                        cursor.path.push_back(std::make_pair(nowNodePos, i));
+                    } else {
+                        cursor.path.push_back(std::make_pair(nowNodePos, i - 1));
+                        cursor.next();
+                    }
+                    return cursor;
+                }
+                cursor.path.push_back(std::make_pair(nowNodePos, i));
                 nowNodePos = nowNode.son[i];
                 disk.read(nowNodePos, nowNode);
             }
         }
+
+    public:
+        /*
+         * 第一个 >= key 的位置, 没有则返回无效游标
+         * 游标移动时不加锁也不核对版本号, 多线程的树上不能用, 范围查询用 scan
+         */
+        Cursor lowerBound(const Key &key) {
+            static_assert(!CONCURRENT, "cursors are not latched, use scan on a concurrent tree");
+            return seek(key);
+        }
+
+        /*
+         * 最小的位置, 空树返回无效游标
+         */
+        Cursor begin() {
+            static_assert(!CONCURRENT, "cursors are not latched, use scan on a concurrent tree");
+            Cursor cursor(this);
+            if (base.siz == 0) return cursor;
+            cursor.path.push_back(std::make_pair(base.rootPos, 0));
+            disk.read(base.rootPos, cursor.node);
+            cursor.descend(0, true);
+            return cursor;
+        }
+
+        /*
+         * 范围查询: 对 [lo, hi] 内的每个 K-V 按顺序调用 callback(key, val)
+         * 返回访问的 K-V 个数
+         */
+        template<class Callback>
+        size_t scan(const Key &lo, const Key &hi, Callback callback) {
+            static_assert(KeyPolicy::ORDERED, "scan requires an ordered KeyPolicy");
+            WriteScope<CONCURRENT> scope(latches);
+            store_t storeHi = KeyPolicy::encode(hi);
+            size_t cnt = 0;
+            for (Cursor cursor = seek(lo); cursor.valid(); cursor.next()) {
+                const store_t &nowKey = cursor.node.key[cursor.path.back().second];
+                if (storeHi < nowKey) break;
+                callback(KeyPolicy::decode(nowKey), cursor.val());
+                cnt++;
+            }
+            return cnt;
+        }
     };
 }
 
@@ -0,0 +1,179 @@
+#ifndef DS01_B_TREE_ALLOC_HPP
+#define DS01_B_TREE_ALLOC_HPP
+
+#include "cache.hpp"
+#include <map>
+
+namespace Sirius {
+
+    /*
+     * 文件上的页分配器
+     * 页从 dataBegin 开始按 pageSize 连续排布, pageCount 为高水位 (分配过的页数)
+     * 空闲页串成一条链: 空闲页的开头 8 字节存链上的下一页, 链头存在 Meta 里
+     * alloc/free 都是 O(1), 释放的页不限数量地复用
+     * 整理文件 (compact) 时要按位置找空页、从链中间摘页, 这时才把整条链读进内存建索引 (buildIndex), 之后随 alloc/free 维护
+     */
+    template<class Cache>
+    class PageAllocator {
+        typedef long long fpos_t;
+        static const fpos_t NULL_NUM = -1;
+
+    public:
+        /*
+         * 需要持久化的部分, 由使用者放在文件头里一起读写
+         */
+        struct Meta {
+            fpos_t pageCount; //高水位
+            fpos_t freeHead; //空闲链头
+            fpos_t freeCount;
+
+            explicit Meta(fpos_t reserved = 0): pageCount(reserved), freeHead(NULL_NUM), freeCount(0) {}
+        };
+
+    private:
+        Meta &meta;
+        Cache &cache;
+        Pager *pager;
+        fpos_t dataBegin, pageSize;
+
+        //链在内存里的镜像: 空页 -> (链上的前一页, 后一页), 按位置有序
+        struct Link {
+            fpos_t prev, next;
+        };
+        std::map<fpos_t, Link> index;
+        bool indexed;
+        size_t allocated, released; //计数, 不持久化
+
+        void setPrev(fpos_t pos, fpos_t prev) {
+            if (pos != NULL_NUM) index[pos].prev = prev;
+        }
+
+    public:
+        PageAllocator(Meta &_meta, Cache &_cache, fpos_t _dataBegin, fpos_t _pageSize):
+            meta(_meta), cache(_cache), pager(nullptr), dataBegin(_dataBegin), pageSize(_pageSize), indexed(false), allocated(0), released(0) {}
+
+        void setPager(Pager *_pager) {
+            pager = _pager;
+        }
+
+        /*
+         * 优先从空闲链上取, 否则高水位往后涨
+         */
+        fpos_t alloc() {
+            allocated++;
+            if (meta.freeHead == NULL_NUM) {
+                return dataBegin + (meta.pageCount++) * pageSize;
+            }
+            fpos_t ret = meta.freeHead;
+            if (indexed) {
+                meta.freeHead = index[ret].next;
+                index.erase(ret);
+                setPrev(meta.freeHead, NULL_NUM);
+            } else {
+                pager->read(ret, &meta.freeHead, sizeof(fpos_t));
+            }
+            meta.freeCount--;
+            return ret;
+        }
+
+        /*
+         * 页挂到链头; cache 里的该页直接丢掉, 不能再写回, 否则会盖掉链指针
+         */
+        void free(fpos_t pos) {
+            cache.discard(pos, &meta.freeHead, sizeof(fpos_t));
+            released++;
+            if (indexed) {
+                setPrev(meta.freeHead, pos);
+                index[pos] = Link{NULL_NUM, meta.freeHead};
+            }
+            meta.freeHead = pos;
+            meta.freeCount++;
+        }
+
+        /*
+         * 顺着链读一遍建索引, 只在第一次调用时读盘
+         */
+        void buildIndex() {
+            if (indexed) return;
+            fpos_t prev = NULL_NUM;
+            for (fpos_t pos = meta.freeHead; pos != NULL_NUM; ) {
+                fpos_t next;
+                pager->read(pos, &next, sizeof(fpos_t));
+                index[pos] = Link{prev, next};
+                prev = pos, pos = next;
+            }
+            indexed = true;
+        }
+
+        /*
+         * 以下要先 buildIndex
+         * 位置最靠前的空页, 没有返回 NULL_NUM
+         */
+        fpos_t lowestFree() const {
+            return index.empty() ? NULL_NUM : index.begin()->first;
+        }
+
+        /*
+         * 把空页 pos 从链中间摘下来交给调用者, 只改前一页的链指针 (或链头)
+         */
+        void take(fpos_t pos) {
+            Link link = index[pos];
+            if (link.prev == NULL_NUM) {
+                meta.freeHead = link.next;
+            } else {
+                cache.discard(link.prev, &link.next, sizeof(fpos_t));
+                index[link.prev].next = link.next;
+            }
+            setPrev(link.next, link.prev);
+            index.erase(pos);
+            meta.freeCount--;
+        }
+
+        /*
+         * 高水位处往前连续的空页摘掉, 高水位跟着回退, 返回回退的页数
+         */
+        fpos_t shrink() {
+            fpos_t ret = 0;
+            while (meta.pageCount > 0 && index.count(lastPage())) {
+                take(lastPage());
+                meta.pageCount--, ret++;
+            }
+            return ret;
+        }
+
+        //高水位下最后一页的位置
+        fpos_t lastPage() const {
+            return dataBegin + (meta.pageCount - 1) * pageSize;
+        }
+
+        /*
+         * 从高水位处连续分配 count 页, 返回第一页, 不走空闲链 (批量建树要求页连续)
+         */
+        fpos_t allocRun(fpos_t count) {
+            fpos_t ret = dataBegin + meta.pageCount * pageSize;
+            meta.pageCount += count;
+            allocated += count;
+            return ret;
+        }
+
+        /*
+         * 全部清空, 高水位回到 reserved; 调用者保证已经没有存活的页, 且 cache 里没有这些页
+         */
+        void reset(fpos_t reserved = 0) {
+            meta = Meta(reserved);
+            index.clear();
+        }
+
+        fpos_t pageCount() const {return meta.pageCount;}
+
+        fpos_t freeCount() const {return meta.freeCount;}
+
+        size_t pagesAllocated() const {return allocated;}
+
+        size_t pagesReleased() const {return released;}
+
+        void resetStats() {allocated = released = 0;}
+    };
+}
+
+#endif //DS01_B_TREE_ALLOC_HPP
@@ -0,0 +1,496 @@
+#ifndef DS01_B_TREE_BETREE_HPP
+#define DS01_B_TREE_BETREE_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.hpp"
+#include "pool.hpp"
+#include "keys.hpp"
+#include "alloc.hpp"
+#include "layout.hpp"
+
+namespace Sirius {
+
+    /*
+     * 写优化的 B 树 (B^epsilon 树), 给以插入为主的导入用
+     * 数据只在叶子里, 内部节点除了 pivot 和儿子, 剩下的地方都是消息缓冲: insert / modify / del 只是往根的缓冲里放一条消息
+     * 缓冲满了挑消息最多的那个儿子, 把发往它的消息一批推下去, 到叶子时才真正改 K-V; 一批消息摊掉了一条路径的读写
+     * find 从根往下走, 路上缓冲里的同 key 消息都要算上, 代价仍是一条路径
+     *
+     * 消息是盲写, 插入时不知道 key 在不在, 所以 insert / modify / del 没有返回值, 也没有 size:
+     * 语义在消息落到叶子时才生效, insert 只在不存在时插入, modify 只在存在时修改, 和 BTree 一致; 同一 key 的多条消息在缓冲里合成一条
+     * 节点都是 PAGE 字节, 内部节点至多 FANOUT 个儿子 (取 FANOUT 约为一页能放的消息数的平方根, 即 epsilon = 1/2), 叶子装满一页
+     * 根常驻内存, sync 和析构时写回; 删除不合并节点, 叶子删空了也留着; 只支持单线程, 不支持 WAL 和变长 key
+     */
+    template<class Key, class Val, int FANOUT = 16, int PAGE = 4096, class KeyPolicy = HashKey<Key>, class CachePolicy = LRUPolicy>
+    class BeTree {
+        typedef long long fpos_t;
+        typedef typename KeyPolicy::store_t store_t;
+        static_assert(!KeyPolicy::VARIABLE, "BeTree does not support variable-length keys");
+
+        /*
+         * 一条消息对 key 的作用分两种情况: 原来不存在时 (onAbsent) 和原来存在时 (onPresent)
+         * insert 为 (SET, KEEP), modify 为 (KEEP, SET), del 为 (KEEP, ERASE); 两条消息先后作用仍可以写成这个形式
+         */
+        enum Action : char {KEEP = 0, SET = 1, ERASE = 2};
+
+        struct Message {
+            store_t key;
+            Val absentVal, presentVal;
+            Action onAbsent, onPresent;
+        };
+
+        /*
+         * 节点: 头 + PAGE 字节以内的 body, 全 0 的页是空叶子
+         * 叶子的 body: key[LEAF_CAP] val[LEAF_CAP]
+         * 内部节点的 body: pivot[FANOUT-1] son[FANOUT] msg[BUF], son[i] 下的 key 在 [pivot[i-1], pivot[i]) 里, msg 按 key 排好序, 同一 key 只有一条
+         */
+        struct NodeHead {
+            int siz; //叶子为 K-V 个数, 内部节点为 pivot 个数
+            int msgCnt;
+            int internal;
+            int pad;
+        };
+
+        static const size_t BODY = PAGE - sizeof(NodeHead);
+        static const size_t LEAF_CAP = (BODY - alignof(Val)) / (sizeof(store_t) + sizeof(Val));
+        static const size_t LEAF_VAL_OFF = alignUp(LEAF_CAP * sizeof(store_t), alignof(Val));
+        static const size_t SON_OFF = alignUp((FANOUT - 1) * sizeof(store_t), sizeof(fpos_t));
+        static const size_t MSG_OFF = alignUp(SON_OFF + FANOUT * sizeof(fpos_t), alignof(Message));
+        static const size_t BUF = MSG_OFF < BODY ? (BODY - MSG_OFF) / sizeof(Message) : 0;
+        static_assert(alignof(Message) <= 8 && alignof(Val) <= 8, "BeTree node body is 8-byte aligned");
+        static_assert(FANOUT >= 3 && LEAF_CAP >= 3 && BUF >= FANOUT, "page too small for this FANOUT");
+
+        struct Node {
+            NodeHead head;
+            alignas(8) char body[BODY];
+
+            const store_t *keys() const {return reinterpret_cast<const store_t *>(body);}
+            const Val *vals() const {return reinterpret_cast<const Val *>(body + LEAF_VAL_OFF);}
+            const fpos_t *sons() const {return reinterpret_cast<const fpos_t *>(body + SON_OFF);}
+            const Message *msgs() const {return reinterpret_cast<const Message *>(body + MSG_OFF);}
+        };
+
+        /*
+         * 推消息时节点先展开成变长的样子, 可以暂时超过上限, 推完、分裂以后再写回
+         */
+        struct Fat {
+            bool internal;
+            std::vector<store_t> keys;
+            std::vector<Val> vals;
+            std::vector<fpos_t> sons;
+            std::vector<Message> msgs;
+
+            Fat(): internal(false) {}
+        };
+
+        //cache 的字节数和 BTree 默认的 3000 个 4KiB 页框差不多
+        typedef typename std::conditional<std::is_same<CachePolicy, SharedPoolPolicy>::value, PooledCache<Node>,
+                LRUCache<Node, (3000 * 4096 / PAGE > 16 ? 3000 * 4096 / PAGE : 16), CachePolicy> >::type Cache;
+
+        static const int TREE_VERSION = 1;
+
+        struct TreeBase {
+            char magic[8];
+            int version;
+            int nodeSize;
+            fpos_t rootPos;
+            typename PageAllocator<Cache>::Meta pages;
+
+            explicit TreeBase(fpos_t _rootPos): version(TREE_VERSION), nodeSize(sizeof(Node)), rootPos(_rootPos), pages(1) {
+                memset(magic, 0, sizeof(magic));
+                strcpy(magic, "SRBETRE");
+            }
+
+            bool check() const {
+                return strcmp(magic, "SRBETRE") == 0 && version == TREE_VERSION && nodeSize == sizeof(Node);
+            }
+        } base;
+
+        static const fpos_t NODE_STRIDE = nodeStride(sizeof(Node));
+        static const fpos_t NODE_BEGIN = nodeBegin(sizeof(TreeBase), NODE_STRIDE);
+
+        int data;
+        Pager pager;
+        Cache disk;
+        PageAllocator<Cache> pages;
+        Fat root; //常驻内存的根, 位置为 base.rootPos
+
+        /*
+         * 先 f 后 g 两条消息合成一条
+         */
+        static Message compose(const Message &f, const Message &g) {
+            Message h = f;
+            if (f.onAbsent == KEEP) {
+                h.onAbsent = g.onAbsent, h.absentVal = g.absentVal;
+            } else if (g.onPresent == SET) { //f 插入之后 g 看到的是存在
+                h.absentVal = g.presentVal;
+            } else if (g.onPresent == ERASE) {
+                h.onAbsent = KEEP;
+            }
+            if (f.onPresent == KEEP) {
+                h.onPresent = g.onPresent, h.presentVal = g.presentVal;
+            } else if (f.onPresent == SET) {
+                if (g.onPresent == SET) h.presentVal = g.presentVal;
+                else if (g.onPresent == ERASE) h.onPresent = ERASE;
+            } else if (g.onAbsent == SET) { //f 删掉之后 g 看到的是不存在
+                h.onPresent = SET, h.presentVal = g.absentVal;
+            }
+            return h;
+        }
+
+        /*
+         * 消息作用在一个 key 上, present/val 为原状态, 返回之后是否存在
+         */
+        static bool apply(const Message &m, bool present, Val &val) {
+            if (!present) {
+                if (m.onAbsent == SET) val = m.absentVal;
+                return m.onAbsent == SET;
+            }
+            if (m.onPresent == SET) val = m.presentVal;
+            return m.onPresent != ERASE;
+        }
+
+        static bool keyLess(const Message &m, const store_t &key) {return m.key < key;}
+
+        //key 该去哪个儿子: 第一个比它大的 pivot 的下标
+        static int childIndex(const store_t *keys, int siz, const store_t &key) {
+            return std::upper_bound(keys, keys + siz, key) - keys;
+        }
+
+        void load(fpos_t pos, Fat &fat) {
+            const Node *node = disk.peek(pos);
+            int siz = node->head.siz;
+            fat.internal = node->head.internal != 0;
+            fat.keys.assign(node->keys(), node->keys() + siz);
+            if (fat.internal) {
+                fat.sons.assign(node->sons(), node->sons() + siz + 1);
+                fat.msgs.assign(node->msgs(), node->msgs() + node->head.msgCnt);
+                fat.vals.clear();
+            } else {
+                fat.vals.assign(node->vals(), node->vals() + siz);
+                fat.sons.clear(), fat.msgs.clear();
+            }
+        }
+
+        void store(fpos_t pos, const Fat &fat) {
+            Node node;
+            memset(&node, 0, sizeof(Node));
+            node.head.internal = fat.internal;
+            node.head.siz = fat.keys.size();
+            memcpy(node.body, fat.keys.data(), fat.keys.size() * sizeof(store_t));
+            if (fat.internal) {
+                node.head.msgCnt = fat.msgs.size();
+                memcpy(node.body + SON_OFF, fat.sons.data(), fat.sons.size() * sizeof(fpos_t));
+                memcpy(node.body + MSG_OFF, fat.msgs.data(), fat.msgs.size() * sizeof(Message));
+            } else {
+                memcpy(node.body + LEAF_VAL_OFF, fat.vals.data(), fat.vals.size() * sizeof(Val));
+            }
+            disk.write(pos, node);
+        }
+
+        /*
+         * 两段按 key 排好序的消息合并, newer 比 older 新, 同 key 合成一条
+         */
+        static std::vector<Message> mergeMessages(const std::vector<Message> &older, const Message *newer, size_t cnt) {
+            std::vector<Message> ret;
+            ret.reserve(older.size() + cnt);
+            size_t i = 0, j = 0;
+            while (i < older.size() || j < cnt) {
+                if (j == cnt || (i < older.size() && older[i].key < newer[j].key)) ret.push_back(older[i++]);
+                else if (i == older.size() || newer[j].key < older[i].key) ret.push_back(newer[j++]);
+                else ret.push_back(compose(older[i++], newer[j++]));
+            }
+            return ret;
+        }
+
+        /*
+         * 把 n 个东西切成若干块, 每块不超过 cap 个且尽量平均, 返回每块的起点 (最后补一个 n)
+         */
+        static std::vector<size_t> pieces(size_t n, size_t cap) {
+            size_t k = std::max<size_t>((n + cap - 1) / cap, 1);
+            std::vector<size_t> ret;
+            for (size_t p = 0; p <= k; ++p) ret.push_back(n * p / k);
+            return ret;
+        }
+
+        /*
+         * 一批消息 (按 key 排好序, 都属于这个节点) 推进 fat
+         * 叶子直接改 K-V; 内部节点并进缓冲, 超过 BUF 就挑最重的儿子继续往下推
+         */
+        void absorb(Fat &fat, const Message *msgs, size_t cnt) {
+            if (!fat.internal) {
+                applyToLeaf(fat, msgs, cnt);
+                return;
+            }
+            fat.msgs = mergeMessages(fat.msgs, msgs, cnt);
+            while (fat.msgs.size() > BUF) flushHeaviest(fat);
+        }
+
+        /*
+         * 推进盘上的节点 pos, 装不下时分裂, 第一块留在 pos, 其余的新开页; 返回新块的 (pivot, 位置), 由父亲插到 pos 后面
+         */
+        std::vector<std::pair<store_t, fpos_t> > pushDown(fpos_t pos, const Message *msgs, size_t cnt) {
+            Fat fat;
+            load(pos, fat);
+            absorb(fat, msgs, cnt);
+            std::vector<std::pair<store_t, fpos_t> > splits = split(fat);
+            store(pos, fat);
+            return splits;
+        }
+
+        void applyToLeaf(Fat &leaf, const Message *msgs, size_t cnt) {
+            std::vector<store_t> keys;
+            std::vector<Val> vals;
+            keys.reserve(leaf.keys.size() + cnt), vals.reserve(leaf.keys.size() + cnt);
+            size_t i = 0, j = 0;
+            while (i < leaf.keys.size() || j < cnt) {
+                if (j == cnt || (i < leaf.keys.size() && leaf.keys[i] < msgs[j].key)) {
+                    keys.push_back(leaf.keys[i]), vals.push_back(leaf.vals[i]);
+                    i++;
+                    continue;
+                }
+                Val val;
+                bool present = (i < leaf.keys.size() && leaf.keys[i] == msgs[j].key);
+                if (present) val = leaf.vals[i++];
+                if (apply(msgs[j], present, val)) keys.push_back(msgs[j].key), vals.push_back(val);
+                j++;
+            }
+            leaf.keys.swap(keys), leaf.vals.swap(vals);
+        }
+
+        /*
+         * 缓冲里发往同一个儿子的消息是连续的一段, 挑最长的一段推下去, 儿子分裂出的新块插到它后面
+         */
+        void flushHeaviest(Fat &fat) {
+            size_t best = 0, bestBegin = 0, bestEnd = 0, begin = 0;
+            for (size_t i = 0; i < fat.sons.size(); ++i) {
+                size_t end = (i == fat.keys.size()) ? fat.msgs.size()
+                                                    : std::lower_bound(fat.msgs.begin() + begin, fat.msgs.end(), fat.keys[i], keyLess) - fat.msgs.begin();
+                if (end - begin > bestEnd - bestBegin) best = i, bestBegin = begin, bestEnd = end;
+                begin = end;
+            }
+            std::vector<std::pair<store_t, fpos_t> > splits = pushDown(fat.sons[best], fat.msgs.data() + bestBegin, bestEnd - bestBegin);
+            fat.msgs.erase(fat.msgs.begin() + bestBegin, fat.msgs.begin() + bestEnd);
+            for (size_t p = 0; p < splits.size(); ++p) {
+                fat.keys.insert(fat.keys.begin() + best + p, splits[p].first);
+                fat.sons.insert(fat.sons.begin() + best + 1 + p, splits[p].second);
+            }
+        }
+
+        /*
+         * 超过上限的节点切块: fat 留下第一块, 其余的写到新页, 返回 (pivot, 位置)
+         * 叶子按 K-V 切, pivot 为块的第一个 key; 内部节点按儿子切, 块之间的 pivot 升到父亲, 缓冲按升上去的 pivot 分
+         */
+        std::vector<std::pair<store_t, fpos_t> > split(Fat &fat) {
+            std::vector<std::pair<store_t, fpos_t> > splits;
+            if (!fat.internal) {
+                if (fat.keys.size() <= LEAF_CAP) return splits;
+                std::vector<size_t> cut = pieces(fat.keys.size(), LEAF_CAP);
+                for (size_t p = 1; p + 1 < cut.size(); ++p) {
+                    Fat piece;
+                    piece.keys.assign(fat.keys.begin() + cut[p], fat.keys.begin() + cut[p + 1]);
+                    piece.vals.assign(fat.vals.begin() + cut[p], fat.vals.begin() + cut[p + 1]);
+                    splits.push_back(std::make_pair(piece.keys[0], pages.alloc()));
+                    store(splits.back().second, piece);
+                }
+                fat.keys.resize(cut[1]), fat.vals.resize(cut[1]);
+                return splits;
+            }
+            if (fat.sons.size() <= FANOUT) return splits;
+            std::vector<size_t> cut = pieces(fat.sons.size(), FANOUT);
+            std::vector<size_t> msgCut(1, 0);
+            for (size_t p = 1; p + 1 < cut.size(); ++p) {
+                msgCut.push_back(std::lower_bound(fat.msgs.begin() + msgCut.back(), fat.msgs.end(), fat.keys[cut[p] - 1], keyLess) - fat.msgs.begin());
+            }
+            msgCut.push_back(fat.msgs.size());
+            for (size_t p = 1; p + 1 < cut.size(); ++p) {
+                Fat piece;
+                piece.internal = true;
+                piece.sons.assign(fat.sons.begin() + cut[p], fat.sons.begin() + cut[p + 1]);
+                piece.keys.assign(fat.keys.begin() + cut[p], fat.keys.begin() + cut[p + 1] - 1);
+                piece.msgs.assign(fat.msgs.begin() + msgCut[p], fat.msgs.begin() + msgCut[p + 1]);
+                splits.push_back(std::make_pair(fat.keys[cut[p] - 1], pages.alloc()));
+                store(splits.back().second, piece);
+            }
+            fat.sons.resize(cut[1]), fat.keys.resize(cut[1] - 1), fat.msgs.resize(msgCut[1]);
+            return splits;
+        }
+
+        /*
+         * 新消息进根; 根分裂了, 旧根写回原位, 开一个新根
+         */
+        void upsert(const Message &m) {
+            absorb(root, &m, 1);
+            std::vector<std::pair<store_t, fpos_t> > splits = split(root);
+            if (splits.empty()) return;
+            store(base.rootPos, root);
+            Fat newRoot;
+            newRoot.internal = true;
+            newRoot.sons.push_back(base.rootPos);
+            for (const std::pair<store_t, fpos_t> &piece : splits) {
+                newRoot.keys.push_back(piece.first);
+                newRoot.sons.push_back(piece.second);
+            }
+            root.keys.swap(newRoot.keys), root.vals.swap(newRoot.vals);
+            root.sons.swap(newRoot.sons), root.msgs.swap(newRoot.msgs);
+            root.internal = true;
+            base.rootPos = pages.alloc();
+        }
+
+        static Message makeMessage(const store_t &key, Action onAbsent, Action onPresent, const Val &val) {
+            Message m;
+            memset(&m, 0, sizeof(Message));
+            m.key = key, m.onAbsent = onAbsent, m.onPresent = onPresent;
+            if (onAbsent == SET) m.absentVal = val;
+            if (onPresent == SET) m.presentVal = val;
+            return m;
+        }
+
+        /*
+         * 范围查询的递归: pending 是祖先缓冲里落在这棵子树、且在 [lo, hi] 内的消息 (比这里的新)
+         */
+        template<class Callback>
+        void scanNode(const Fat &fat, const store_t &lo, const store_t &hi, const std::vector<Message> &pending,
+                      Callback &callback, size_t &cnt) {
+            if (!fat.internal) {
+                size_t from = std::lower_bound(fat.keys.begin(), fat.keys.end(), lo) - fat.keys.begin();
+                size_t to = std::upper_bound(fat.keys.begin(), fat.keys.end(), hi) - fat.keys.begin();
+                Fat part;
+                part.keys.assign(fat.keys.begin() + from, fat.keys.begin() + to);
+                part.vals.assign(fat.vals.begin() + from, fat.vals.begin() + to);
+                applyToLeaf(part, pending.data(), pending.size());
+                for (size_t i = 0; i < part.keys.size(); ++i) callback(KeyPolicy::decode(part.keys[i]), part.vals[i]);
+                cnt += part.keys.size();
+                return;
+            }
+            typename std::vector<Message>::const_iterator first = std::lower_bound(fat.msgs.begin(), fat.msgs.end(), lo, keyLess);
+            typename std::vector<Message>::const_iterator last = std::lower_bound(first, fat.msgs.end(), hi, keyLess);
+            if (last != fat.msgs.end() && last->key == hi) ++last;
+            std::vector<Message> merged = mergeMessages(std::vector<Message>(first, last), pending.data(), pending.size());
+            int from = childIndex(fat.keys.data(), fat.keys.size(), lo), to = childIndex(fat.keys.data(), fat.keys.size(), hi);
+            size_t begin = 0;
+            Fat son;
+            for (int i = from; i <= to; ++i) {
+                size_t end = (i == (int)fat.keys.size()) ? merged.size()
+                                                         : std::lower_bound(merged.begin() + begin, merged.end(), fat.keys[i], keyLess) - merged.begin();
+                load(fat.sons[i], son);
+                scanNode(son, lo, hi, std::vector<Message>(merged.begin() + begin, merged.begin() + end), callback, cnt);
+                begin = end;
+            }
+        }
+
+        void writeBack() {
+            store(base.rootPos, root);
+            disk.flush();
+            pager.write(0, &base, sizeof(TreeBase));
+        }
+
+    public:
+        BeTree(const char *dataFileName, PagerType pagerType = PAGER_PIO):
+            base(NODE_BEGIN), pages(base.pages, disk, NODE_BEGIN, NODE_STRIDE) {
+            data = open(dataFileName, O_RDWR | O_CREAT, 0644);
+            if (data < 0) throw "cannot open tree file";
+            struct stat fileStat;
+            fstat(data, &fileStat);
+            pager.open(data, pagerType);
+            if (fileStat.st_size == 0) {
+                pager.write(0, &base, sizeof(TreeBase));
+            } else {
+                pager.read(0, &base, sizeof(TreeBase));
+                if (!base.check()) {
+                    pager.close();
+                    close(data);
+                    throw "bad tree file: magic, version or node size mismatch";
+                }
+            }
+            disk.setPager(&pager);
+            pages.setPager(&pager);
+            load(base.rootPos, root);
+        }
+
+        ~BeTree() {
+            writeBack();
+            pager.close();
+            close(data);
+        }
+
+        void sync() {
+            writeBack();
+            pager.sync();
+        }
+
+        /*
+         * 插入 / 修改 / 删除: 只是往根的缓冲里放一条消息, 语义同 BTree, 但不返回是否成功
+         */
+        void insert(const Key &key, const Val &val) {
+            upsert(makeMessage(KeyPolicy::encode(key), SET, KEEP, val));
+        }
+
+        void modify(const Key &key, const Val &val) {
+            upsert(makeMessage(KeyPolicy::encode(key), KEEP, SET, val));
+        }
+
+        void del(const Key &key) {
+            upsert(makeMessage(KeyPolicy::encode(key), KEEP, ERASE, Val()));
+        }
+
+        /*
+         * 查询: 从根走到叶子, 路上缓冲里的同 key 消息记下来, 从叶子的状态起由深到浅依次作用
+         */
+        bool find(const Key &key, Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            std::vector<Message> path;
+            bool present;
+            if (!root.internal) {
+                size_t i = std::lower_bound(root.keys.begin(), root.keys.end(), storeKey) - root.keys.begin();
+                present = (i < root.keys.size() && root.keys[i] == storeKey);
+                if (present) val = root.vals[i];
+                return present;
+            }
+            typename std::vector<Message>::const_iterator m = std::lower_bound(root.msgs.begin(), root.msgs.end(), storeKey, keyLess);
+            if (m != root.msgs.end() && m->key == storeKey) path.push_back(*m);
+            fpos_t pos = root.sons[childIndex(root.keys.data(), root.keys.size(), storeKey)];
+            while (true) {
+                const Node *node = disk.peek(pos);
+                const NodeHead &head = node->head;
+                if (!head.internal) {
+                    int i = std::lower_bound(node->keys(), node->keys() + head.siz, storeKey) - node->keys();
+                    present = (i < head.siz && node->keys()[i] == storeKey);
+                    if (present) val = node->vals()[i];
+                    break;
+                }
+                const Message *msg = std::lower_bound(node->msgs(), node->msgs() + head.msgCnt, storeKey, keyLess);
+                if (msg != node->msgs() + head.msgCnt && msg->key == storeKey) path.push_back(*msg);
+                pos = node->sons()[childIndex(node->keys(), head.siz, storeKey)];
+            }
+            for (size_t i = path.size(); i > 0; --i) present = apply(path[i - 1], present, val);
+            return present;
+        }
+
+        /*
+         * 范围查询: 对 [lo, hi] 内的每个 K-V 按顺序调用 callback(key, val), 缓冲里的消息边走边合并
+         */
+        template<class Callback>
+        size_t scan(const Key &lo, const Key &hi, Callback callback) {
+            static_assert(KeyPolicy::ORDERED, "scan requires an ordered KeyPolicy");
+            size_t cnt = 0;
+            store_t storeLo = KeyPolicy::encode(lo), storeHi = KeyPolicy::encode(hi);
+            if (storeHi < storeLo) return 0;
+            scanNode(root, storeLo, storeHi, std::vector<Message>(), callback, cnt);
+            return cnt;
+        }
+
+        CacheStats cacheStats() const {return disk.stats();}
+
+        IoStats ioStats() const {return pager.stats();}
+    };
+}
+
+#endif //DS01_B_TREE_BETREE_HPP
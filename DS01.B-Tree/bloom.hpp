@@ -0,0 +1,190 @@
+#ifndef DS01_B_TREE_BLOOM_HPP
+#define DS01_B_TREE_BLOOM_HPP
+
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pager.hpp"
+
+namespace Sirius {
+
+    /*
+     * 任意字节串的 64 位哈希, 给布隆过滤器用: 每 8 字节乘一个奇数再转一下混进去, 最后用 murmur3 的 fmix64 搅匀
+     * 哈希策略的 store_t 只有 31 位, 整数 key 的低位也不均匀, 不能直接拿来选位
+     */
+    inline unsigned long long hashBytes(const void *data, size_t len) {
+        const unsigned char *ptr = reinterpret_cast<const unsigned char *>(data);
+        unsigned long long h = 0x9E3779B97F4A7C15ull ^ (len * 0xC2B2AE3D27D4EB4Full);
+        while (len > 0) {
+            unsigned long long word = 0;
+            size_t n = std::min<size_t>(len, 8);
+            memcpy(&word, ptr, n);
+            h ^= word * 0x87C37B91114253D5ull;
+            h = ((h << 31) | (h >> 33)) * 0x4CF5AD432745937Full;
+            ptr += n, len -= n;
+        }
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /*
+     * 过滤器的计数, 同 IoStats 用 relaxed 原子加 (多线程时读者也会记)
+     */
+    struct FilterStats {
+        size_t checks; //问过过滤器的点查 (find / findBatch 的每个 key / modify / del)
+        size_t negatives; //过滤器说一定没有, 直接返回, 不用从根走到叶子
+        size_t falsePositives; //过滤器说可能有, 走到叶子却没有
+        size_t pagesSaved; //省掉的节点访问, 按当前树高估算 (negatives * 层数)
+
+        FilterStats(): checks(0), negatives(0), falsePositives(0), pagesSaved(0) {}
+
+        //不在树里的 key 被过滤器放过去的比例
+        double falsePositiveRate() const {
+            size_t absent = negatives + falsePositives;
+            return absent == 0 ? 0 : (double)falsePositives / absent;
+        }
+    };
+
+    /*
+     * 分块布隆过滤器: 位数组按 64 字节 (一条 cache line) 分块, 一个 key 的 k 个位都在哈希选中的那一块里
+     * 查一次只碰一条 cache line; 代价是同样的位数误判率比普通布隆过滤器稍高
+     * 位只增不减, 删掉的 key 留下的位只会让误判变多, 多了就整个重建 (见 BTree 的 filterMaybeRebuild)
+     * 置位用原子或, 读用 relaxed 原子读, 一个写者、后台重建线程和多个读者可以同时用
+     *
+     * 盘上: 文件头 + 位数组; 文件头的 clean 为 1 说明和树一致, 保存后第一次置位前先清成 0 并落盘
+     * 打开时 clean 不为 1、参数或保存时的 K-V 个数对不上都不用, 重建
+     */
+    class BloomFilter {
+        static const int BLOCK_WORDS = 8;
+        static const int BLOCK_BITS = 512;
+        static const int FILTER_VERSION = 1;
+
+        struct Header {
+            char magic[8];
+            int version;
+            int bitsPerKey;
+            long long blocks;
+            size_t added, removed;
+            size_t treeSize; //保存时树里的 K-V 个数
+            int clean;
+            int pad;
+        };
+
+        int bitsPerKey, probes;
+        long long blocks;
+        std::unique_ptr<unsigned long long[]> words;
+
+        //高 32 位选块 (乘法取高位代替取模), 低 32 位做双重哈希, 在块里选 probes 个位
+        unsigned long long *block(unsigned long long h) const {
+            return words.get() + (long long)(((h >> 32) * (unsigned long long)blocks) >> 32) * BLOCK_WORDS;
+        }
+
+    public:
+        size_t added, removed; //建好以来加进来、从树里删掉的 key 数, 只有写者改, 决定什么时候重建
+
+        /*
+         * 按每个 key bitsPerKey 位、能装 capacity 个 key 开位数组, k 取 bitsPerKey * ln2
+         */
+        BloomFilter(int _bitsPerKey, size_t capacity): bitsPerKey(_bitsPerKey), added(0), removed(0) {
+            probes = std::max(1, std::min(16, (int)(bitsPerKey * 0.69 + 0.5)));
+            blocks = std::max(1ll, ((long long)capacity * bitsPerKey + BLOCK_BITS - 1) / BLOCK_BITS);
+            if (blocks > (1ll << 32)) throw "bloom filter too large";
+            words.reset(new unsigned long long[blocks * BLOCK_WORDS]());
+        }
+
+        size_t capacity() const {return blocks * BLOCK_BITS / bitsPerKey;}
+
+        size_t bytes() const {return blocks * BLOCK_WORDS * sizeof(unsigned long long);}
+
+        bool sameShape(const BloomFilter &rhs) const {return blocks == rhs.blocks && probes == rhs.probes;}
+
+        void add(unsigned long long h) {
+            unsigned long long *ptr = block(h);
+            unsigned int h1 = h, h2 = (h >> 17) | 1;
+            for (int i = 0; i < probes; ++i, h1 += h2) {
+                __atomic_fetch_or(ptr + ((h1 >> 6) & (BLOCK_WORDS - 1)), 1ull << (h1 & 63), __ATOMIC_RELAXED);
+            }
+        }
+
+        bool mayContain(unsigned long long h) const {
+            const unsigned long long *ptr = block(h);
+            unsigned int h1 = h, h2 = (h >> 17) | 1;
+            for (int i = 0; i < probes; ++i, h1 += h2) {
+                if ((__atomic_load_n(ptr + ((h1 >> 6) & (BLOCK_WORDS - 1)), __ATOMIC_RELAXED) & (1ull << (h1 & 63))) == 0) return false;
+            }
+            return true;
+        }
+
+        /*
+         * 同样大小的过滤器按字覆盖过来, 读者可以同时读
+         * 新旧两份都包含树里现有的 key 的位, 每个字不管读到旧的还是新的, 都不会把现有的 key 判成没有
+         */
+        void copyFrom(const BloomFilter &rhs) {
+            for (long long i = 0; i < blocks * BLOCK_WORDS; ++i) {
+                __atomic_store_n(&words[i], __atomic_load_n(&rhs.words[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+            }
+            added = rhs.added, removed = rhs.removed;
+        }
+
+        /*
+         * 写到 fd 里: 文件头先标脏落盘, 再写位数组落盘, 最后标成 clean 落盘
+         */
+        void save(int fd, size_t treeSize) const {
+            Header head;
+            memset(&head, 0, sizeof(Header));
+            strcpy(head.magic, "SRBLOOM");
+            head.version = FILTER_VERSION;
+            head.bitsPerKey = bitsPerKey;
+            head.blocks = blocks;
+            head.added = added, head.removed = removed;
+            head.treeSize = treeSize;
+            diskWrite(fd, 0, &head, sizeof(Header)); //先标脏, 写到一半崩溃不会留下 clean 的半份
+            fdatasync(fd);
+            diskWrite(fd, sizeof(Header), words.get(), bytes());
+            if (ftruncate(fd, sizeof(Header) + bytes()) != 0) throw "bloom filter truncate failed";
+            fdatasync(fd);
+            head.clean = 1;
+            diskWrite(fd, 0, &head, sizeof(Header));
+            fdatasync(fd);
+        }
+
+        /*
+         * 保存后第一次改动之前调用, 之后崩溃的话下次打开会重建
+         */
+        static void markDirty(int fd) {
+            int clean = 0;
+            diskWrite(fd, offsetof(Header, clean), &clean, sizeof(int));
+            fdatasync(fd);
+        }
+
+        /*
+         * 从 fd 读回, 不可用 (没有、不干净、参数或 K-V 个数对不上) 返回空
+         */
+        static std::unique_ptr<BloomFilter> load(int fd, int bitsPerKey, size_t treeSize) {
+            std::unique_ptr<BloomFilter> ret;
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            Header head;
+            if ((size_t)fileStat.st_size < sizeof(Header)) return ret;
+            diskRead(fd, 0, &head, sizeof(Header));
+            if (memcmp(head.magic, "SRBLOOM", 8) != 0 || head.version != FILTER_VERSION || head.clean != 1 ||
+                head.bitsPerKey != bitsPerKey || head.treeSize != treeSize || head.blocks <= 0 || head.blocks > (1ll << 32) ||
+                (size_t)fileStat.st_size != sizeof(Header) + head.blocks * BLOCK_WORDS * sizeof(unsigned long long)) return ret;
+            ret.reset(new BloomFilter(bitsPerKey, 0));
+            ret->blocks = head.blocks;
+            ret->words.reset(new unsigned long long[head.blocks * BLOCK_WORDS]);
+            diskRead(fd, sizeof(Header), ret->words.get(), ret->bytes());
+            ret->added = head.added, ret->removed = head.removed;
+            return ret;
+        }
+    };
+}
+
+#endif //DS01_B_TREE_BLOOM_HPP
@@ -6,155 +6,967 @@
 #define DS01_B_TREE_CACHE_HPP
 
 #include <iostream>
-#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <memory>
+#include <unordered_set>
+#include "pager.hpp"
+#include "warmup.hpp"
+#include "flusher.hpp"
 
 namespace Sirius {
     #define BOMB printf("bomb\n");
     #define DEBUG(_x) //std::cout << _x << '\n';
 
-    template <class Val, int LEN = 10>
+    /*
+     * 页表: 文件位置 -> 下标, 开放寻址 + 线性探测
+     * 删除用 backward shift, 不留墓碑, 探测长度不会随删改变长
+     * 容量为 2 的幂且至少两倍于元素上限, 构造后不再分配内存;
+     * 元素超过容量一半时翻倍重排 (只有页框数不固定的 BufferPool 会走到)
+     */
+    class PageTable {
+        typedef long long fpos_t;
+        static const fpos_t EMPTY = -1;
+
+        struct Slot {
+            fpos_t key;
+            int val;
+        };
+
+        std::vector<Slot> slots;
+        size_t mask, cnt;
+
+        size_t home(fpos_t key) const {
+            unsigned long long h = (unsigned long long)key * 0x9E3779B97F4A7C15ULL;
+            return (h ^ (h >> 29)) & mask;
+        }
+
+        void grow() {
+            std::vector<Slot> old(slots.size() * 2, Slot{EMPTY, -1});
+            old.swap(slots);
+            mask = slots.size() - 1;
+            for (const Slot &slot : old) {
+                if (slot.key == EMPTY) continue;
+                size_t i = home(slot.key);
+                while (slots[i].key != EMPTY) i = (i + 1) & mask;
+                slots[i] = slot;
+            }
+        }
+
+    public:
+        explicit PageTable(size_t maxSize): cnt(0) {
+            size_t cap = 4;
+            while (cap < maxSize * 2) cap <<= 1;
+            slots.assign(cap, Slot{EMPTY, -1});
+            mask = cap - 1;
+        }
+
+        /*
+         * 找不到返回 -1
+         */
+        int find(fpos_t key) const {
+            for (size_t i = home(key); ; i = (i + 1) & mask) {
+                if (slots[i].key == key) return slots[i].val;
+                if (slots[i].key == EMPTY) return -1;
+            }
+        }
+
+        /*
+         * 调用者保证 key 不在表中
+         */
+        void insert(fpos_t key, int val) {
+            if ((++cnt) * 2 > slots.size()) grow();
+            size_t i = home(key);
+            while (slots[i].key != EMPTY) i = (i + 1) & mask;
+            slots[i].key = key, slots[i].val = val;
+        }
+
+        void erase(fpos_t key) {
+            size_t i = home(key);
+            while (slots[i].key != key) {
+                if (slots[i].key == EMPTY) return;
+                i = (i + 1) & mask;
+            }
+            cnt--;
+            //后面同一簇里的元素, 如果它的 home 不在 (i, j] 之间, 就可以挪到空出来的 i
+            for (size_t j = (i + 1) & mask; slots[j].key != EMPTY; j = (j + 1) & mask) {
+                size_t h = home(slots[j].key);
+                bool between = (i <= j) ? (i < h && h <= j) : (i < h || h <= j);
+                if (!between) {
+                    slots[i] = slots[j];
+                    i = j;
+                }
+            }
+            slots[i].key = EMPTY;
+        }
+    };
+
+    /*
+     * 用下标串起来的双向链表, 链接信息放在外部数组里 (下标即页框/影子页编号)
+     * 各个替换策略都用它, 不分配内存
+     */
+    struct ListLink {
+        int pre, nxt;
+    };
+
+    class IndexList {
+        static const int NIL = -1;
+        int headIdx, tailIdx, cnt;
+
+    public:
+        IndexList(): headIdx(NIL), tailIdx(NIL), cnt(0) {}
+
+        void pushFront(std::vector<ListLink> &link, int idx) {
+            link[idx].pre = NIL;
+            link[idx].nxt = headIdx;
+            if (headIdx != NIL) link[headIdx].pre = idx;
+            headIdx = idx;
+            if (tailIdx == NIL) tailIdx = idx;
+            cnt++;
+        }
+
+        void unlink(std::vector<ListLink> &link, int idx) {
+            if (link[idx].pre != NIL) link[link[idx].pre].nxt = link[idx].nxt;
+            else headIdx = link[idx].nxt;
+            if (link[idx].nxt != NIL) link[link[idx].nxt].pre = link[idx].pre;
+            else tailIdx = link[idx].pre;
+            cnt--;
+        }
+
+        void moveToFront(std::vector<ListLink> &link, int idx) {
+            if (idx == headIdx) return;
+            unlink(link, idx);
+            pushFront(link, idx);
+        }
+
+        int front() const {return headIdx;}
+        int back() const {return tailIdx;}
+        int size() const {return cnt;}
+    };
+
+    /*
+     * 替换策略, 作为 LRUCache 的模板参数, 只管页框的顺序, 不碰数据
+     * 接口:
+     *   touch(frame)        命中
+     *   prepare(key)        未命中, 在选淘汰页之前调用 (需要影子页的策略在这里查影子页、调参数)
+     *   victim() -> frame   cache 满时选一个页框淘汰, 并把它移出策略
+     *   admit(frame, key)   新页装进页框
+     *   remove(frame)       页被 discard
+     *   forEach(func)       按策略顺序遍历 (从最想保留到最想淘汰), display 用
+     *   forEachCold(func)   反过来从最想淘汰的一头遍历, func 返回 false 就停, 提前写回冷脏页用
+     */
+
+    /*
+     * LRU: 一条链表, 命中移到链头, 淘汰链尾
+     */
+    class LRUPolicy {
+        std::vector<ListLink> link;
+        IndexList lru;
+
+    public:
+        static const char *name() {return "LRU";}
+
+        explicit LRUPolicy(int capacity): link(capacity) {}
+
+        void touch(int frame) {lru.moveToFront(link, frame);}
+        void prepare(long long) {}
+
+        int victim() {
+            int frame = lru.back();
+            lru.unlink(link, frame);
+            return frame;
+        }
+
+        void admit(int frame, long long) {lru.pushFront(link, frame);}
+        void remove(int frame) {lru.unlink(link, frame);}
+
+        template<class Func>
+        void forEach(Func func) const {
+            for (int idx = lru.front(); idx != -1; idx = link[idx].nxt) func(idx);
+        }
+
+        template<class Func>
+        void forEachCold(Func func) const {
+            for (int idx = lru.back(); idx != -1; idx = link[idx].pre) if (!func(idx)) return;
+        }
+    };
+
+    /*
+     * CLOCK: 页框排成一圈, 命中只置引用位, 指针转一圈清引用位, 遇到没被引用的就淘汰
+     * 新页不置引用位, 只被扫过一次的页很快被淘汰
+     */
+    class ClockPolicy {
+        std::vector<char> ref, resident;
+        int hand;
+
+    public:
+        static const char *name() {return "CLOCK";}
+
+        explicit ClockPolicy(int capacity): ref(capacity, 0), resident(capacity, 0), hand(0) {}
+
+        void touch(int frame) {ref[frame] = 1;}
+        void prepare(long long) {}
+
+        int victim() {
+            while (true) {
+                int frame = hand;
+                hand = (hand + 1) % (int)ref.size();
+                if (!resident[frame]) continue;
+                if (ref[frame]) {
+                    ref[frame] = 0;
+                    continue;
+                }
+                resident[frame] = 0;
+                return frame;
+            }
+        }
+
+        void admit(int frame, long long) {
+            resident[frame] = 1;
+            ref[frame] = 0;
+        }
+
+        void remove(int frame) {resident[frame] = 0;}
+
+        template<class Func>
+        void forEach(Func func) const {
+            for (int i = 0; i < (int)ref.size(); ++i) {
+                int frame = (hand + i) % (int)ref.size();
+                if (resident[frame]) func(frame);
+            }
+        }
+
+        //指针接下来扫到的先被淘汰, 没被引用的更先
+        template<class Func>
+        void forEachCold(Func func) const {
+            for (int pass = 0; pass < 2; ++pass) {
+                for (int i = 0; i < (int)ref.size(); ++i) {
+                    int frame = (hand + i) % (int)ref.size();
+                    if (resident[frame] && ref[frame] == pass && !func(frame)) return;
+                }
+            }
+        }
+    };
+
+    /*
+     * 影子页: 只记文件位置, 不占页框, 2Q 和 ARC 用来记住刚被淘汰的页
+     * 编号池和页表都在构造时开好
+     */
+    class GhostPool {
+        std::vector<long long> keys;
+        std::vector<int> freeIds;
+        PageTable table;
+
+    public:
+        std::vector<ListLink> link;
+
+        explicit GhostPool(int capacity): keys(capacity), table(capacity), link(capacity) {
+            for (int i = capacity - 1; i >= 0; --i) freeIds.push_back(i);
+        }
+
+        bool full() const {return freeIds.empty();}
+
+        int find(long long key) const {return table.find(key);}
+
+        int add(long long key) {
+            int id = freeIds.back();
+            freeIds.pop_back();
+            keys[id] = key;
+            table.insert(key, id);
+            return id;
+        }
+
+        void drop(int id) {
+            table.erase(keys[id]);
+            freeIds.push_back(id);
+        }
+    };
+
+    /*
+     * 2Q: 新页进 A1in (FIFO), 从 A1in 淘汰的页记进影子队列 A1out,
+     * 在 A1out 里的页再被访问才进 Am (LRU), 只访问一次的扫描页进不了 Am
+     * 参数按论文推荐: Kin = 容量 / 4, Kout = 容量 / 2
+     */
+    class TwoQPolicy {
+        enum Where {NONE, A1IN, AM};
+
+        std::vector<ListLink> link;
+        std::vector<char> where;
+        std::vector<long long> keyOf;
+        IndexList a1in, am, a1out;
+        GhostPool ghost;
+        int kin;
+        bool ghostHit;
+
+        void forget(int id) {
+            a1out.unlink(ghost.link, id);
+            ghost.drop(id);
+        }
+
+    public:
+        static const char *name() {return "2Q";}
+
+        explicit TwoQPolicy(int capacity): link(capacity), where(capacity, NONE), keyOf(capacity),
+                                           ghost(capacity / 2 + 1), kin(std::max(1, capacity / 4)), ghostHit(false) {}
+
+        void touch(int frame) {
+            if (where[frame] == AM) am.moveToFront(link, frame); //A1in 里的页命中不动, 保持 FIFO
+        }
+
+        void prepare(long long key) {
+            int id = ghost.find(key);
+            ghostHit = (id != -1);
+            if (ghostHit) forget(id);
+        }
+
+        int victim() {
+            int frame;
+            if (a1in.size() > kin || am.size() == 0) {
+                frame = a1in.back();
+                a1in.unlink(link, frame);
+                if (ghost.full()) forget(a1out.back());
+                a1out.pushFront(ghost.link, ghost.add(keyOf[frame]));
+            } else {
+                frame = am.back();
+                am.unlink(link, frame);
+            }
+            where[frame] = NONE;
+            return frame;
+        }
+
+        void admit(int frame, long long key) {
+            keyOf[frame] = key;
+            if (ghostHit) {
+                am.pushFront(link, frame);
+                where[frame] = AM;
+            } else {
+                a1in.pushFront(link, frame);
+                where[frame] = A1IN;
+            }
+        }
+
+        void remove(int frame) {
+            if (where[frame] == AM) am.unlink(link, frame);
+            else if (where[frame] == A1IN) a1in.unlink(link, frame);
+            where[frame] = NONE;
+        }
+
+        template<class Func>
+        void forEach(Func func) const {
+            for (int idx = am.front(); idx != -1; idx = link[idx].nxt) func(idx);
+            for (int idx = a1in.front(); idx != -1; idx = link[idx].nxt) func(idx);
+        }
+
+        template<class Func>
+        void forEachCold(Func func) const {
+            for (int idx = a1in.back(); idx != -1; idx = link[idx].pre) if (!func(idx)) return;
+            for (int idx = am.back(); idx != -1; idx = link[idx].pre) if (!func(idx)) return;
+        }
+    };
+
+    /*
+     * ARC: T1 为只访问过一次的页, T2 为访问过至少两次的页, B1/B2 为它们各自的影子页
+     * 目标值 p 是 T1 应占的页框数, 命中 B1 说明 T1 太小, p 增大; 命中 B2 则 p 减小
+     * 按论文 (Megiddo & Modha, FAST'03) 的 REPLACE 与目录裁剪规则实现
+     */
+    class ARCPolicy {
+        enum Where {NONE, T1, T2};
+
+        std::vector<ListLink> link;
+        std::vector<char> where;
+        std::vector<long long> keyOf;
+        IndexList t1, t2, b1, b2;
+        GhostPool ghost;
+        std::vector<char> ghostIn; //影子页在 B1 还是 B2
+        int capacity, p;
+        bool ghostHit, hitB2, dropT1; //本次未命中的情况, 由 prepare 记下给 victim/admit 用
+
+        void forget(IndexList &list, int id) {
+            list.unlink(ghost.link, id);
+            ghost.drop(id);
+        }
+
+        void evictTo(IndexList &from, IndexList &ghostList, char ghostWhere, int frame) {
+            from.unlink(link, frame);
+            where[frame] = NONE;
+            if (ghost.full()) { //防御, 正常情况下目录裁剪保证 |B1| + |B2| <= c
+                if (b1.size() > 0) forget(b1, b1.back());
+                else forget(b2, b2.back());
+            }
+            int id = ghost.add(keyOf[frame]);
+            ghostIn[id] = ghostWhere;
+            ghostList.pushFront(ghost.link, id);
+        }
+
+    public:
+        static const char *name() {return "ARC";}
+
+        explicit ARCPolicy(int _capacity): link(_capacity), where(_capacity, NONE), keyOf(_capacity),
+                                           ghost(_capacity + 1), ghostIn(_capacity + 1, NONE), capacity(_capacity), p(0),
+                                           ghostHit(false), hitB2(false), dropT1(false) {}
+
+        void touch(int frame) {
+            if (where[frame] == T1) {
+                t1.unlink(link, frame);
+                t2.pushFront(link, frame);
+                where[frame] = T2;
+            } else {
+                t2.moveToFront(link, frame);
+            }
+        }
+
+        void prepare(long long key) {
+            int id = ghost.find(key);
+            ghostHit = (id != -1);
+            hitB2 = false;
+            dropT1 = false;
+            if (ghostHit) {
+                if (ghostIn[id] == T1) {
+                    p = std::min(capacity, p + std::max(b2.size() / std::max(b1.size(), 1), 1));
+                    forget(b1, id);
+                } else {
+                    p = std::max(0, p - std::max(b1.size() / std::max(b2.size(), 1), 1));
+                    forget(b2, id);
+                    hitB2 = true;
+                }
+                return;
+            }
+            //完全未命中, 目录裁剪
+            if (t1.size() + b1.size() >= capacity) {
+                if (t1.size() < capacity) forget(b1, b1.back());
+                else dropT1 = true; //B1 为空且 T1 占满, 直接淘汰 T1 的页且不记影子
+            } else if (t1.size() + t2.size() + b1.size() + b2.size() >= 2 * capacity && b2.size() > 0) {
+                forget(b2, b2.back());
+            }
+        }
+
+        int victim() {
+            int frame;
+            if (dropT1) {
+                frame = t1.back();
+                t1.unlink(link, frame);
+                where[frame] = NONE;
+            } else if (t1.size() > 0 && (t1.size() > p || (hitB2 && t1.size() == p) || t2.size() == 0)) {
+                frame = t1.back();
+                evictTo(t1, b1, T1, frame);
+            } else {
+                frame = t2.back();
+                evictTo(t2, b2, T2, frame);
+            }
+            return frame;
+        }
+
+        void admit(int frame, long long key) {
+            keyOf[frame] = key;
+            if (ghostHit) {
+                t2.pushFront(link, frame);
+                where[frame] = T2;
+            } else {
+                t1.pushFront(link, frame);
+                where[frame] = T1;
+            }
+        }
+
+        void remove(int frame) {
+            if (where[frame] == T1) t1.unlink(link, frame);
+            else if (where[frame] == T2) t2.unlink(link, frame);
+            where[frame] = NONE;
+        }
+
+        template<class Func>
+        void forEach(Func func) const {
+            for (int idx = t2.front(); idx != -1; idx = link[idx].nxt) func(idx);
+            for (int idx = t1.front(); idx != -1; idx = link[idx].nxt) func(idx);
+        }
+
+        template<class Func>
+        void forEachCold(Func func) const {
+            for (int idx = t1.back(); idx != -1; idx = link[idx].pre) if (!func(idx)) return;
+            for (int idx = t2.back(); idx != -1; idx = link[idx].pre) if (!func(idx)) return;
+        }
+    };
+
+    /*
+     * cache 计数器
+     */
+    struct CacheStats {
+        size_t hits, misses;
+        size_t evictions;
+        size_t writeBacks; //淘汰或 flush 时真正写回的脏页
+        size_t backgroundWriteBacks; //其中交给后台写回线程的, 前台不等写盘
+        size_t writeBacksSkipped; //淘汰时因为页是干净的而省掉的写回
+        size_t mappedReads; //mmap 后端 peek 未命中时直接读映射, 不算 miss
+        size_t directWrites; //不经过页框直接写盘, 如释放页时写空闲链指针
+        size_t resident; //此刻占着的页框数, 不是累计值
+        size_t prefetched; //预热时装进空闲页框的页, 不算 miss
+
+        CacheStats(): hits(0), misses(0), evictions(0), writeBacks(0), backgroundWriteBacks(0), writeBacksSkipped(0), mappedReads(0),
+                      directWrites(0), resident(0), prefetched(0) {}
+
+        double hitRate() const {
+            return hits + misses == 0 ? 0 : (double)hits / (hits + misses);
+        }
+
+        CacheStats &operator+=(const CacheStats &rhs) {
+            hits += rhs.hits, misses += rhs.misses;
+            evictions += rhs.evictions;
+            writeBacks += rhs.writeBacks, writeBacksSkipped += rhs.writeBacksSkipped;
+            backgroundWriteBacks += rhs.backgroundWriteBacks;
+            mappedReads += rhs.mappedReads, directWrites += rhs.directWrites;
+            resident += rhs.resident, prefetched += rhs.prefetched;
+            return *this;
+        }
+    };
+
+    /*
+     * 页框与盘上的页之间的转换, cache 的模板参数 Codec
+     * 默认原样按字节读写 (RAW), mmap 后端可以直接看映射; 变长 key 的槽页见 page.hpp
+     */
+    template<class Val>
+    struct RawCodec {
+        static const bool RAW = true;
+        static const size_t BYTES = sizeof(Val);
+
+        static void encode(const Val &val, char *page) {memcpy(page, &val, sizeof(Val));}
+
+        static void decode(const char *page, Val &val) {memcpy(&val, page, sizeof(Val));}
+
+        static void load(Pager &pager, long long pos, Val &val) {pager.read(pos, &val, sizeof(Val));}
+
+        static void store(Pager &pager, long long pos, const Val &val) {pager.write(pos, &val, sizeof(Val));}
+    };
+
+    /*
+     * 文件上的 cache (buffer pool), 替换策略由模板参数 Policy 决定, 默认 LRU (见上面的各个 Policy)
+     * LEN 个页框在构造时一次开好, 页表为开放寻址哈希, 命中时只查一次页表, 不分配内存
+     * 每个页框有脏位, write 置位, 淘汰和 flush 只写回脏页
+     */
+    template <class Val, int LEN = 10, class Policy = LRUPolicy, class Codec = RawCodec<Val> >
     class LRUCache {
-        typedef int fpos_t; //约定文件上的位置均用 int32 表示
+        typedef long long fpos_t; //约定文件上的位置均用 int64 表示
+        static const int NIL = -1;
 
-        struct Node {
+        struct Frame {
             fpos_t key;
+            bool dirty;
             Val val;
-            Node *pre;
-            Node *nxt;
-
-            Node(const fpos_t& _key, const Val& _val):key(_key), val(_val), pre(nullptr), nxt(nullptr) {}
         };
 
     private:
-        FILE* file;
+        Pager ownPager; //setFile 时自己开一个 pread/pwrite 的后端
+        Pager *pager;
 
         size_t siz;
-        std::map<fpos_t, Node*> table;
-        Node *head, *tail;
-
-        Node *pushFront(const fpos_t& key, const Val& val) {
-            Node *newNode = new Node(key, val);
-            if (siz == 0) {
-                head = tail = newNode;
-                siz++;
-                return newNode;
-            }
-            newNode->nxt = head;
-            if (newNode->nxt != nullptr) newNode->nxt->pre = newNode;
-            head = newNode;
-            siz++;
-            return newNode;
+        std::vector<Frame> frames;
+        std::vector<int> freeFrames;
+        PageTable table;
+        Policy policy;
+        CacheStats counter;
+        WarmLoader *warmer; //预热中, 见 warmup.hpp; 读完并装完后置空
+        bool tracking; //预热中: 记下 write / discard 过的位置, 后台读到的这些页已经旧了
+        std::unordered_set<fpos_t> touched;
+        Flusher *flusher; //后台写回, 见 flusher.hpp; 为空时照旧自己写盘
+        size_t dirtyCount, dirtyLimit, dirtyTarget; //脏页超过 dirtyLimit 时把最冷的脏页交出去, 直到不超过 dirtyTarget
+
+        //wait 为 false 时后台队列满了就不交, 返回 false, 页还是脏的
+        bool writeBack(Frame &frame, bool wait = true) {
+            if (frame.dirty) {
+                if (flusher != nullptr) {
+                    if (!flusher->push(frame.key, [&frame](char *page) {Codec::encode(frame.val, page);}, wait)) return false;
+                    counter.backgroundWriteBacks++;
+                } else {
+                    Codec::store(*pager, frame.key, frame.val);
+                }
+                frame.dirty = false;
+                dirtyCount--;
+                counter.writeBacks++;
+            } else {
+                counter.writeBacksSkipped++;
+            }
+            return true;
         }
 
-        void popBack() {
-            Node *tmpTail = tail;
+        //未命中读盘; 交给后台还没写下去的页从那里拷
+        void load(fpos_t diskPos, Val &val) {
+            if (flusher == nullptr || !flusher->lookup(diskPos, [&val](const char *page) {Codec::decode(page, val);})) {
+                Codec::load(*pager, diskPos, val);
+            }
+        }
 
-            table.erase(tail->key); //remove from table
-            fseek(file, tail->key, SEEK_SET);
-            fwrite(reinterpret_cast<char *>(&tail->val), sizeof(Val), 1, file); //write back
-            tail = tail->pre;
-            if (tail != nullptr) tail->nxt = nullptr;
-            if (tmpTail != nullptr) delete tmpTail;
-            siz--;
-            if (siz == 0) head = nullptr;
+        /*
+         * 脏页太多了: 从最想淘汰的一头起把脏页交给后台写, 让之后淘汰到的页框多半是干净的
+         * 降到 dirtyTarget 就停, 只走冷的一头; 后台队列满了也停, 提前清理不让前台等
+         */
+        void cleanCold() {
+            policy.forEachCold([this](int idx) {
+                if (frames[idx].dirty && !writeBack(frames[idx], false)) return false;
+                return dirtyCount > dirtyTarget;
+            });
+            flusher->kick();
         }
 
-        void moveToFront(Node *node) {
-            if (node == head) return;
-            if (node->pre != nullptr)
-                node->pre->nxt = node->nxt;
-            if (node->nxt != nullptr)
-                node->nxt->pre = node->pre;
-            else
-                tail = tail->pre;
-            node->nxt = head;
-            node->nxt->pre = node;
-            node->pre = nullptr;
-            head = node;
+        /*
+         * 未命中时取一个页框并登记到页表, 满了先让策略选一个淘汰, 脏页写回
+         */
+        int grabFrame(fpos_t key) {
+            counter.misses++;
+            policy.prepare(key);
+            if (freeFrames.empty()) {
+                int victim = policy.victim();
+                table.erase(frames[victim].key);
+                writeBack(frames[victim]);
+                freeFrames.push_back(victim);
+                siz--;
+                counter.evictions++;
+            }
+            int idx = freeFrames.back();
+            freeFrames.pop_back();
+            frames[idx].key = key;
+            frames[idx].dirty = false;
+            policy.admit(idx, key);
+            table.insert(key, idx);
+            siz++;
+            return idx;
         }
 
         /*
-         * 有则覆盖
+         * 预热读好的页装进空闲页框; 全部装完就不再记改过的位置
          */
-        void set(const fpos_t& key, const Val& val) {
-            if (table.find(key) != table.end()) {
-                moveToFront(table[key]);
-                head->val = val;
-                return;
+        void warmDrain() {
+            if (!warmer->pending()) return;
+            warmer->take([this](fpos_t pos, const char *page) {warm(pos, page);});
+            if (warmer->finish()) {
+                warmTrack(false);
+                warmer = nullptr;
             }
-            table[key] = pushFront(key, val);
-            if (siz > LEN) popBack();
         }
 
-        bool get(const fpos_t& key, Val& val) {
-            if (table.find(key) != table.end()) {
-                moveToFront(table[key]);
-                val = table[key]->val;
-                return true;
+        int lookup(fpos_t key) {
+            if (warmer != nullptr) warmDrain();
+            int idx = table.find(key);
+            if (idx != NIL) {
+                counter.hits++;
+                policy.touch(idx);
             }
-            return false;
+            return idx;
         }
 
     public:
 
-        LRUCache(): siz(0), head(nullptr), tail(nullptr) {}
+        LRUCache(): pager(&ownPager), siz(0), frames(LEN), table(LEN), policy(LEN), warmer(nullptr), tracking(false),
+                    flusher(nullptr), dirtyCount(0), dirtyLimit(LEN), dirtyTarget(LEN) {
+            freeFrames.reserve(LEN);
+            for (int i = LEN - 1; i >= 0; --i) freeFrames.push_back(i);
+        }
+
         ~LRUCache() {
-            std::cout << "destruct\n";
-            while (siz > 0) {
-                popBack();
+            flush();
+        }
+
+        void setFile(int _file) {
+            ownPager.open(_file, PAGER_PIO);
+            pager = &ownPager;
+        }
+
+        void setPager(Pager *_pager) {
+            pager = _pager;
+        }
+
+        /*
+         * 脏页全部写回, 页框仍留在 cache 里; 文件关闭前必须调用
+         * 有后台写回时全部交出去, 等它写完 (相邻的页正好连成一段写)
+         */
+        void flush() {
+            for (int idx = 0; idx < LEN; ++idx) {
+                if (frames[idx].dirty) writeBack(frames[idx]);
             }
+            if (flusher != nullptr) flusher->drain();
+        }
+
+        /*
+         * 开启后台写回: 淘汰和 flush 的脏页都交给 _flusher 写; 脏页占到 highWater (0 ~ 1) 以上时提前把最冷的交出去
+         * 传空为关闭, 关闭前先 flush (脏页写完、交出去的等后台写完)
+         */
+        void flushWith(Flusher *_flusher, double highWater = 1) {
+            if (flusher != nullptr && _flusher == nullptr) flush();
+            flusher = _flusher;
+            dirtyLimit = std::max((size_t)1, std::min((size_t)LEN, (size_t)(highWater * LEN)));
+            dirtyTarget = dirtyLimit * 7 / 8;
         }
 
-        void setFile(FILE *_file) {
-            file = _file;
+        /*
+         * 对每个脏页的位置调用 func, 写回之前要先做点什么时用 (WAL 一次记下所有前像)
+         */
+        template<class Func>
+        void forEachDirty(Func func) const {
+            for (int idx = 0; idx < LEN; ++idx) {
+                if (frames[idx].dirty) func(frames[idx].key);
+            }
         }
 
         void read(fpos_t diskPos, Val& val) {
             //DEBUG("read...")
             if (diskPos < 0) return; //invalid pos
-            bool found = get(diskPos, val);
-            if (!found) {
-                fseek(file, diskPos, SEEK_SET);
-                fread(reinterpret_cast<char *>(&val), sizeof(Val), 1, file);
-                set(diskPos, val);
-            } else {
-                get(diskPos, val);
+            int idx = lookup(diskPos);
+            if (idx == NIL) {
+                idx = grabFrame(diskPos);
+                load(diskPos, frames[idx].val);
             }
+            val = frames[idx].val;
         }
 
-        void write(fpos_t diskPos, Val& val) {
+        /*
+         * 只读地看一个页, 不拷贝: 命中返回页框里的指针; mmap 后端未命中直接返回映射里的指针, 不占页框 (要编解码的页除外)
+         * 指针只在下一次调用 cache 之前有效; 有后台写回时不看映射 (后台写可能扩文件重新映射)
+         */
+        const Val *peek(fpos_t diskPos) {
+            int idx = lookup(diskPos);
+            if (idx != NIL) return &frames[idx].val;
+            const char *mapped = Codec::RAW && flusher == nullptr ? pager->view(diskPos, sizeof(Val)) : nullptr;
+            if (mapped != nullptr) {
+                counter.mappedReads++;
+                return reinterpret_cast<const Val *>(mapped);
+            }
+            idx = grabFrame(diskPos);
+            load(diskPos, frames[idx].val);
+            return &frames[idx].val;
+        }
+
+        /*
+         * 有则覆盖
+         */
+        void write(fpos_t diskPos, const Val& val) {
             //DEBUG("write...")
             if (diskPos < 0) return; //invalid pos
-            set(diskPos, val);
-            /*fseek(file, diskPos, SEEK_SET);
-            fwrite(reinterpret_cast<char *>(&val), sizeof(val), 1, file);*/
+            int idx = lookup(diskPos);
+            if (idx == NIL) idx = grabFrame(diskPos);
+            frames[idx].val = val;
+            if (!frames[idx].dirty) {
+                frames[idx].dirty = true;
+                dirtyCount++;
+            }
+            if (tracking) touched.insert(diskPos);
+            if (flusher != nullptr && dirtyCount > dirtyLimit) cleanCold();
         }
 
-        void writeParent(fpos_t diskPos, fpos_t parent) {
-            if (table.find(diskPos) != table.end()) {
-                table[diskPos]->val.parent = parent;
-                return;
+        /*
+         * 丢弃 (不写回), 用于页被释放; raw 非空时再把这 len 字节直接写到盘上该位置 (空闲链指针)
+         */
+        void discard(fpos_t diskPos, const void *raw = nullptr, size_t len = 0) {
+            if (flusher != nullptr) flusher->forget(diskPos);
+            if (raw != nullptr) {
+                pager->write(diskPos, raw, len);
+                counter.directWrites++;
             }
-            if (diskPos < 0) return; //invalid pos
-            fseek(file, diskPos, SEEK_SET);
-            fwrite(reinterpret_cast<char *>(&parent), sizeof(fpos_t), 1, file);
-            /*Val tmpVal;
-            fread(reinterpret_cast<char *>(&tmpVal), sizeof(Val), 1, file);
-            tmpVal.parent = parent;
-            fseek(file, diskPos, SEEK_SET);
-            fwrite(reinterpret_cast<char *>(&tmpVal), sizeof(Val), 1, file);*/
+            if (tracking) touched.insert(diskPos);
+            int idx = table.find(diskPos);
+            if (idx == NIL) return;
+            policy.remove(idx);
+            table.erase(diskPos);
+            if (frames[idx].dirty) dirtyCount--;
+            frames[idx].dirty = false;
+            freeFrames.push_back(idx);
+            siz--;
         }
 
+        /*
+         * 预热: 之后每次访问 cache 时把 loader 读好的页装进来, 直到它读完; 传空为不再预热
+         */
+        void warmFrom(WarmLoader *loader) {
+            warmer = loader;
+            warmTrack(loader != nullptr);
+        }
+
+        /*
+         * 开始 / 停止记下 write / discard 过的位置 (分片 cache 由外面统一装页, 各片只管记)
+         */
+        void warmTrack(bool on) {
+            tracking = on;
+            if (!on) std::unordered_set<fpos_t>().swap(touched);
+        }
+
+        /*
+         * 把预热读到的一页 (盘上的字节) 装进空闲页框, 不淘汰别的页; 已经在 cache 里或预热开始后改过的页不装
+         */
+        bool warm(fpos_t diskPos, const char *page) {
+            if (freeFrames.empty() || table.find(diskPos) != NIL || touched.count(diskPos)) return false;
+            policy.prepare(diskPos);
+            int idx = freeFrames.back();
+            freeFrames.pop_back();
+            frames[idx].key = diskPos;
+            frames[idx].dirty = false;
+            Codec::decode(page, frames[idx].val);
+            policy.admit(idx, diskPos);
+            table.insert(diskPos, idx);
+            siz++;
+            counter.prefetched++;
+            return true;
+        }
+
+        /*
+         * 按策略顺序 (从最想保留到最想淘汰) 对每个常驻页的位置调用 func, 预热存页表用
+         */
+        template<class Func>
+        void forEachResident(Func func) const {
+            policy.forEach([&](int idx) {func(frames[idx].key);});
+        }
+
+        CacheStats stats() const {
+            CacheStats ret = counter;
+            ret.resident = siz;
+            return ret;
+        }
+
+        void resetStats() {counter = CacheStats();}
+
         void display() {
-            Node *nowNode = head;
-            std::cout << "* Cache *\n";
+            std::cout << "* Cache (" << Policy::name() << ") *\n";
             std::cout << "size: " << siz << '\n';
-            std::cout << "head: " << head << '\n';
-            std::cout << "tail: " << tail << '\n';
+            std::cout << "hits: " << counter.hits << " misses: " << counter.misses
+                      << " hit rate: " << counter.hitRate() << " evictions: " << counter.evictions << '\n';
+            std::cout << "write backs: " << counter.writeBacks << " (skipped " << counter.writeBacksSkipped << ")"
+                      << " direct writes: " << counter.directWrites << '\n';
+
+            policy.forEach([this](int idx) {
+                std::cout << "[Frame " << idx << "] key: " << frames[idx].key << (frames[idx].dirty ? " dirty" : "") << '\n';
+            });
+        }
+    };
+
+    /*
+     * 多线程用的 cache: 按页位置哈希分成 SHARDS 个分片, 每片是一个独立的 LRUCache 加一把锁
+     * 不同分片的页互不影响, 读写只锁所在的分片; 总容量仍为 LEN 页
+     * 没有 peek: 锁放开后页框随时可能被别的线程换掉, 只能拷贝出来
+     */
+    template <class Val, int LEN = 10, class Policy = LRUPolicy, class Codec = RawCodec<Val>, int SHARDS = 16>
+    class ShardedCache {
+        typedef long long fpos_t;
+
+        struct Shard {
+            mutable std::mutex lock;
+            LRUCache<Val, (LEN + SHARDS - 1) / SHARDS, Policy, Codec> cache;
+        };
+
+        Shard shards[SHARDS];
+        WarmLoader *warmer; //只在构造、析构树时 (单线程) 改
+
+        Shard &shardOf(fpos_t diskPos) {
+            unsigned long long h = (unsigned long long)diskPos * 0x9E3779B97F4A7C15ull;
+            return shards[(h >> 32) % SHARDS];
+        }
+
+        /*
+         * 预热读好的页由碰上的线程装, 每页只锁它所在的分片
+         */
+        void warmDrain() {
+            if (warmer == nullptr || !warmer->pending()) return;
+            warmer->take([this](fpos_t pos, const char *page) {
+                Shard &shard = shardOf(pos);
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.warm(pos, page);
+            });
+            if (warmer->finish()) {
+                for (Shard &shard : shards) {
+                    std::lock_guard<std::mutex> guard(shard.lock);
+                    shard.cache.warmTrack(false);
+                }
+            }
+        }
+
+    public:
+        ShardedCache(): warmer(nullptr) {}
+
+        void setPager(Pager *_pager) {
+            for (Shard &shard : shards) shard.cache.setPager(_pager);
+        }
+
+        void flush() {
+            for (Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.flush();
+            }
+        }
+
+        template<class Func>
+        void forEachDirty(Func func) {
+            for (Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.forEachDirty(func);
+            }
+        }
+
+        void read(fpos_t diskPos, Val& val) {
+            warmDrain();
+            Shard &shard = shardOf(diskPos);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.cache.read(diskPos, val);
+        }
+
+        void write(fpos_t diskPos, const Val& val) {
+            warmDrain();
+            Shard &shard = shardOf(diskPos);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.cache.write(diskPos, val);
+        }
+
+        //写盘也放在分片锁里, 和乐观读者未命中时的读盘错开
+        void discard(fpos_t diskPos, const void *raw = nullptr, size_t len = 0) {
+            Shard &shard = shardOf(diskPos);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.cache.discard(diskPos, raw, len);
+        }
+
+        //各片的脏页按各自的页框数算比例
+        void flushWith(Flusher *flusher, double highWater = 1) {
+            for (Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.flushWith(flusher, highWater);
+            }
+        }
+
+        void warmFrom(WarmLoader *loader) {
+            warmer = loader;
+            for (Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.warmTrack(loader != nullptr);
+            }
+        }
 
-            while (nowNode != nullptr) {
-                std::cout << "[Node] key: " << nowNode->key << '\n';
-                nowNode = nowNode->nxt;
+        //逐片从热到冷, 片与片之间没有先后
+        template<class Func>
+        void forEachResident(Func func) {
+            for (Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.forEachResident(func);
+            }
+        }
+
+        /*
+         * 各分片计数之和, 逐片加锁读, 只是个快照
+         */
+        CacheStats stats() const {
+            CacheStats total;
+            for (const Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                total += shard.cache.stats();
+            }
+            return total;
+        }
+
+        void resetStats() {
+            for (Shard &shard : shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.cache.resetStats();
+            }
+        }
+
+        void display() {
+            for (int i = 0; i < SHARDS; ++i) {
+                std::lock_guard<std::mutex> guard(shards[i].lock);
+                std::cout << "* Shard " << i << " *\n";
+                shards[i].cache.display();
             }
         }
     };
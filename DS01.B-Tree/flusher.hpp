@@ -0,0 +1,226 @@
+#ifndef DS01_B_TREE_FLUSHER_HPP
+#define DS01_B_TREE_FLUSHER_HPP
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include "pager.hpp"
+
+namespace Sirius {
+
+    /*
+     * 后台写回: cache 要写回脏页时不自己写盘, 把页编码好交给这里 (拷一次), 页框马上算干净, 可以直接淘汰复用
+     * 后台线程按位置排好序, 槽位相邻的连成一段一次写下去; 攒够 KICK_PAGES 页、有人在等或被 kick 时才写, 让相邻的页有机会凑到一起
+     *
+     * 交出去还没写完的页, 盘上还是旧的:
+     *   cache 未命中时先问 lookup, 在这里就从这里拷, 不读盘
+     *   页被释放 (discard) 时先 forget: 还没开始写的直接扔掉, 正在写的等它写完, 之后才能往那个位置直接写空闲链指针
+     *   flush / sync 之前 drain, 等全部写完
+     * 队列里至多 QUEUE_PAGES 页, 满了交页的线程要等 (foregroundStalls 计数), 平时前台不等写盘
+     */
+    class Flusher {
+        typedef long long fpos_t;
+        static const int QUEUE_PAGES = 1024;
+        static const int KICK_PAGES = 32;
+
+        Pager &pager;
+        size_t pageBytes;
+        fpos_t stride;
+        std::vector<char> slab; //QUEUE_PAGES 个页的缓冲
+        std::vector<int> freeSlots;
+        std::map<fpos_t, int> queued, writing; //位置 -> 缓冲里的槽; writing 是后台线程正在写的那一批
+        std::atomic<int> inQueue; //queued + writing 的页数, 为 0 时 lookup / forget 不用加锁
+        std::mutex lock;
+        std::condition_variable wake, done;
+        int waiting; //在等后台写完的前台线程数, 不为 0 时有多少写多少
+        bool kicked, stop, failed;
+        size_t writes, pages, stalls;
+        std::thread worker;
+
+        char *slot(int idx) {return slab.data() + (size_t)idx * pageBytes;}
+
+        //等后台线程写完一批, 调用时拿着 lock
+        void waitRound(std::unique_lock<std::mutex> &guard) {
+            waiting++;
+            wake.notify_one();
+            done.wait(guard);
+            waiting--;
+        }
+
+        /*
+         * 一批按位置顺序写: 相邻槽位连成一段 (槽位里节点之后补 0), 一段至多 1MiB
+         */
+        size_t writeBatch(std::vector<char> &buf) {
+            size_t calls = 0;
+            auto it = writing.begin();
+            while (it != writing.end()) {
+                fpos_t first = it->first, next = first;
+                buf.clear();
+                while (it != writing.end() && it->first == next && buf.size() < (1u << 20)) {
+                    buf.resize((next - first) + stride, 0);
+                    memcpy(buf.data() + (next - first), slot(it->second), pageBytes);
+                    next += stride, ++it;
+                }
+                pager.write(first, buf.data(), buf.size() - (stride - pageBytes)); //最后一页后面的补齐不用写
+                calls++;
+            }
+            return calls;
+        }
+
+        void run() {
+            std::vector<char> buf;
+            std::unique_lock<std::mutex> guard(lock);
+            for (;;) {
+                wake.wait(guard, [this] {
+                    return stop || (!queued.empty() && (kicked || waiting > 0 || queued.size() >= (size_t)KICK_PAGES));
+                });
+                if (queued.empty()) break; //stop 且没有要写的了
+                writing.swap(queued);
+                kicked = false;
+                guard.unlock();
+                size_t calls = 0;
+                bool ok = true;
+                try {
+                    calls = writeBatch(buf);
+                } catch (...) {
+                    ok = false; //由下一次 drain 报告
+                }
+                guard.lock();
+                writes += calls;
+                if (!ok) failed = true;
+                pages += writing.size();
+                for (auto &entry : writing) freeSlots.push_back(entry.second);
+                inQueue.fetch_sub(writing.size(), std::memory_order_release); //写下去的内容先于计数对别的线程可见
+                writing.clear();
+                done.notify_all();
+            }
+        }
+
+    public:
+        /*
+         * 页 pageBytes 字节, 槽位间隔 stride (见 layout.hpp); pager 要先设成 shared, 后台线程和前台会同时用
+         */
+        Flusher(Pager &_pager, size_t _pageBytes, fpos_t _stride):
+                pager(_pager), pageBytes(_pageBytes), stride(_stride), slab(QUEUE_PAGES * _pageBytes), inQueue(0),
+                waiting(0), kicked(false), stop(false), failed(false), writes(0), pages(0), stalls(0) {
+            for (int i = QUEUE_PAGES - 1; i >= 0; --i) freeSlots.push_back(i);
+            worker = std::thread(&Flusher::run, this);
+        }
+
+        Flusher(const Flusher &) = delete;
+        Flusher &operator=(const Flusher &) = delete;
+
+        //剩下的页写完再退出
+        ~Flusher() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+
+        /*
+         * 交一页: encode(char *page) 把页编码到给它的缓冲里; 同一位置还没开始写的话直接覆盖那份
+         * 队列满了 wait 为 false 时不交, 返回 false (提前清理用, 不算前台等)
+         */
+        template<class Encode>
+        bool push(fpos_t pos, Encode encode, bool wait = true) {
+            std::unique_lock<std::mutex> guard(lock);
+            auto it = queued.find(pos);
+            if (it == queued.end()) {
+                if (freeSlots.empty() && !wait) return false;
+                if (freeSlots.empty()) stalls++;
+                while (freeSlots.empty()) waitRound(guard);
+                it = queued.emplace(pos, freeSlots.back()).first;
+                freeSlots.pop_back();
+                inQueue.fetch_add(1, std::memory_order_relaxed);
+            }
+            encode(slot(it->second));
+            if (queued.size() >= (size_t)KICK_PAGES) wake.notify_one();
+            return true;
+        }
+
+        //交完一批后让后台线程马上写, 不用攒够
+        void kick() {
+            std::lock_guard<std::mutex> guard(lock);
+            if (queued.empty()) return;
+            kicked = true;
+            wake.notify_one();
+        }
+
+        /*
+         * pos 还没写到盘上的话对那份 (最新的) 调用 decode(const char *page) 并返回 true
+         */
+        template<class Decode>
+        bool lookup(fpos_t pos, Decode decode) {
+            if (inQueue.load(std::memory_order_acquire) == 0) return false;
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = queued.find(pos);
+            if (it == queued.end()) {
+                it = writing.find(pos);
+                if (it == writing.end()) return false;
+            }
+            decode(slot(it->second));
+            return true;
+        }
+
+        bool contains(fpos_t pos) {
+            return lookup(pos, [](const char *) {});
+        }
+
+        /*
+         * 页被释放了: 没开始写的扔掉, 正在写的等写完
+         */
+        void forget(fpos_t pos) {
+            if (inQueue.load(std::memory_order_acquire) == 0) return;
+            std::unique_lock<std::mutex> guard(lock);
+            auto it = queued.find(pos);
+            if (it != queued.end()) {
+                freeSlots.push_back(it->second);
+                queued.erase(it);
+                inQueue.fetch_sub(1, std::memory_order_relaxed);
+            }
+            while (writing.count(pos)) waitRound(guard);
+        }
+
+        /*
+         * 等交出去的页全部写完; 后台写失败过则抛出
+         */
+        void drain() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!queued.empty() || !writing.empty()) waitRound(guard);
+            if (failed) {
+                failed = false;
+                throw "background write back failed";
+            }
+        }
+
+        //后台写盘次数、写下去的页数、前台因为队列满而等的次数
+        size_t backgroundWrites() {
+            std::lock_guard<std::mutex> guard(lock);
+            return writes;
+        }
+
+        size_t backgroundPages() {
+            std::lock_guard<std::mutex> guard(lock);
+            return pages;
+        }
+
+        size_t foregroundStalls() {
+            std::lock_guard<std::mutex> guard(lock);
+            return stalls;
+        }
+
+        void resetStats() {
+            std::lock_guard<std::mutex> guard(lock);
+            writes = pages = stalls = 0;
+        }
+    };
+}
+
+#endif //DS01_B_TREE_FLUSHER_HPP
@@ -0,0 +1,367 @@
+#ifndef DS01_B_TREE_HASHINDEX_HPP
+#define DS01_B_TREE_HASHINDEX_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.hpp"
+#include "pool.hpp"
+#include "keys.hpp"
+#include "alloc.hpp"
+#include "layout.hpp"
+#include "bloom.hpp"
+
+namespace Sirius {
+
+    /*
+     * 盘上的可扩展哈希 (extendible hashing) 索引, 只做点操作, 接口同 BTree 的 insert / find / modify / del / size
+     * 目录有 2^depth 项, 常驻内存, 用 key 的 64 位哈希的低 depth 位选项, 每项指向一个桶 (一页); 查一次只读一页
+     * 桶满时分裂成局部深度 +1 的两个桶, 按哈希的下一位分开, 局部深度等于全局深度时目录先翻倍
+     * 删除后桶不到 1/4 时和兄弟桶 (局部深度相同、只差最高那位) 合并, 合起来不超过半满才合; 目录两半完全相同时减半
+     * 桶里的 key 按 store_t 排好序, 桶内二分; key 的存法同 BTree (KeyPolicy), 哈希策略冲突同样会被当成重复 key
+     *
+     * 桶和目录页都从页分配器取, 经过同一个 Pager; 桶走 cache, 目录在 sync / 析构时整个写到新分配的页上,
+     * 文件头改指新目录以后才释放旧目录的页, 中途崩溃只会漏几页
+     * 只支持单线程, 不支持 WAL 和变长 key
+     */
+    template<class Key, class Val, int PAGE = 4096, class KeyPolicy = HashKey<Key>, class CachePolicy = LRUPolicy>
+    class HashIndex {
+        typedef long long fpos_t;
+        typedef typename KeyPolicy::store_t store_t;
+        static_assert(!KeyPolicy::VARIABLE, "HashIndex does not support variable-length keys");
+
+        static const fpos_t NULL_NUM = -1;
+        static const int MAX_DEPTH = 32;
+
+        /*
+         * 桶: 头 + body, body 为 key[CAP] val[CAP]
+         */
+        struct BucketHead {
+            int siz;
+            int depth; //局部深度, 目录里低 depth 位相同的项都指向这个桶
+        };
+
+        static const size_t BODY = PAGE - sizeof(BucketHead);
+        static const size_t CAP = (BODY - alignof(Val)) / (sizeof(store_t) + sizeof(Val));
+        static const size_t VAL_OFF = alignUp(CAP * sizeof(store_t), alignof(Val));
+        static_assert(alignof(store_t) <= 8 && alignof(Val) <= 8, "HashIndex bucket body is 8-byte aligned");
+        static_assert(CAP >= 4, "page too small for a bucket");
+
+        struct Bucket {
+            BucketHead head;
+            alignas(8) char body[BODY];
+
+            store_t *keys() {return reinterpret_cast<store_t *>(body);}
+            Val *vals() {return reinterpret_cast<Val *>(body + VAL_OFF);}
+            const store_t *keys() const {return reinterpret_cast<const store_t *>(body);}
+            const Val *vals() const {return reinterpret_cast<const Val *>(body + VAL_OFF);}
+        };
+
+        //目录页和桶一样大: 第一项为链上的下一页, 后面是目录项
+        static const size_t DIR_CAP = sizeof(Bucket) / sizeof(fpos_t) - 1;
+
+        //cache 的字节数和 BTree 默认的 3000 个 4KiB 页框差不多
+        typedef typename std::conditional<std::is_same<CachePolicy, SharedPoolPolicy>::value, PooledCache<Bucket>,
+                LRUCache<Bucket, (3000 * 4096 / PAGE > 16 ? 3000 * 4096 / PAGE : 16), CachePolicy> >::type Cache;
+
+        static const int INDEX_VERSION = 1;
+
+        struct IndexBase {
+            char magic[8];
+            int version;
+            int bucketSize;
+            int depth; //全局深度
+            int pad;
+            size_t siz;
+            fpos_t buckets;
+            fpos_t dirHead; //目录页链
+            typename PageAllocator<Cache>::Meta pages;
+
+            IndexBase(): version(INDEX_VERSION), bucketSize(sizeof(Bucket)), depth(0), pad(0), siz(0), buckets(0),
+                         dirHead(NULL_NUM), pages(0) {
+                memset(magic, 0, sizeof(magic));
+                strcpy(magic, "SRHASHX");
+            }
+
+            bool check() const {
+                return strcmp(magic, "SRHASHX") == 0 && version == INDEX_VERSION && bucketSize == sizeof(Bucket) &&
+                       depth >= 0 && depth <= MAX_DEPTH;
+            }
+        } base;
+
+        static const fpos_t NODE_STRIDE = nodeStride(sizeof(Bucket));
+        static const fpos_t NODE_BEGIN = nodeBegin(sizeof(IndexBase), NODE_STRIDE);
+
+        int data;
+        Pager pager;
+        Cache disk;
+        PageAllocator<Cache> pages;
+        std::vector<fpos_t> dir;
+        std::vector<fpos_t> dirPages; //盘上现在这份目录占的页
+        bool dirDirty;
+
+        static unsigned long long hashOf(const store_t &key) {return hashBytes(&key, sizeof(store_t));}
+
+        size_t slotOf(const store_t &key) const {return hashOf(key) & (dir.size() - 1);}
+
+        static int searchBucket(const Bucket &bucket, const store_t &key) {
+            return std::lower_bound(bucket.keys(), bucket.keys() + bucket.head.siz, key) - bucket.keys();
+        }
+
+        static bool hit(const Bucket &bucket, int i, const store_t &key) {
+            return i < bucket.head.siz && bucket.keys()[i] == key;
+        }
+
+        static void emptyBucket(Bucket &bucket, int depth) {
+            memset(&bucket, 0, sizeof(Bucket));
+            bucket.head.depth = depth;
+        }
+
+        static void append(Bucket &bucket, const store_t &key, const Val &val) {
+            bucket.keys()[bucket.head.siz] = key;
+            bucket.vals()[bucket.head.siz] = val;
+            bucket.head.siz++;
+        }
+
+        /*
+         * 满了的桶 (目录项 slot 指向它) 按哈希的第 depth 位分成两个, 局部深度等于全局深度时目录先翻倍
+         * 分裂后指向新桶的是低 depth + 1 位为 (原来的低位 | 1 << depth) 的那些项
+         */
+        void split(size_t slot, fpos_t pos, const Bucket &full) {
+            int depth = full.head.depth;
+            if (depth == base.depth) {
+                if (base.depth == MAX_DEPTH) throw "hash index directory too deep";
+                size_t n = dir.size();
+                dir.resize(2 * n);
+                std::copy(dir.begin(), dir.begin() + n, dir.begin() + n);
+                base.depth++;
+            }
+            size_t bit = (size_t)1 << depth;
+            Bucket low, high;
+            emptyBucket(low, depth + 1);
+            emptyBucket(high, depth + 1);
+            for (int i = 0; i < full.head.siz; ++i) { //按顺序分到两边, 两边仍有序
+                append((hashOf(full.keys()[i]) & bit) ? high : low, full.keys()[i], full.vals()[i]);
+            }
+            fpos_t highPos = pages.alloc();
+            disk.write(pos, low);
+            disk.write(highPos, high);
+            for (size_t j = (slot & (bit - 1)) | bit; j < dir.size(); j += bit << 1) dir[j] = highPos;
+            base.buckets++;
+            dirDirty = true;
+        }
+
+        /*
+         * 删完后桶太空就和兄弟桶合并到 pos 上, 能合就一直往上合
+         */
+        void tryMerge(size_t slot, fpos_t pos, Bucket &bucket) {
+            while (bucket.head.depth > 0 && bucket.head.siz <= (int)CAP / 4) {
+                size_t bit = (size_t)1 << (bucket.head.depth - 1);
+                fpos_t buddyPos = dir[slot ^ bit];
+                Bucket buddy;
+                disk.read(buddyPos, buddy);
+                if (buddy.head.depth != bucket.head.depth || bucket.head.siz + buddy.head.siz > (int)CAP / 2) return;
+                Bucket merged;
+                emptyBucket(merged, bucket.head.depth - 1);
+                int i = 0, j = 0;
+                while (i < bucket.head.siz || j < buddy.head.siz) {
+                    if (j == buddy.head.siz || (i < bucket.head.siz && bucket.keys()[i] < buddy.keys()[j])) {
+                        append(merged, bucket.keys()[i], bucket.vals()[i]);
+                        i++;
+                    } else {
+                        append(merged, buddy.keys()[j], buddy.vals()[j]);
+                        j++;
+                    }
+                }
+                bucket = merged;
+                disk.write(pos, bucket);
+                for (size_t k = slot & (bit - 1); k < dir.size(); k += bit) dir[k] = pos;
+                pages.free(buddyPos);
+                base.buckets--;
+                dirDirty = true;
+                //所有桶的局部深度都小于全局深度时, 目录两半完全一样, 减半
+                while (base.depth > 0 && std::equal(dir.begin(), dir.begin() + dir.size() / 2, dir.begin() + dir.size() / 2)) {
+                    dir.resize(dir.size() / 2);
+                    base.depth--;
+                }
+                slot &= dir.size() - 1;
+            }
+        }
+
+        /*
+         * 目录整个写到新分配的页上, 返回旧目录的页, 等文件头写好后再释放
+         */
+        std::vector<fpos_t> storeDirectory() {
+            std::vector<fpos_t> stale;
+            stale.swap(dirPages);
+            size_t count = (dir.size() + DIR_CAP - 1) / DIR_CAP;
+            for (size_t i = 0; i < count; ++i) dirPages.push_back(pages.alloc());
+            std::vector<fpos_t> page(DIR_CAP + 1);
+            for (size_t i = 0; i < count; ++i) {
+                page[0] = (i + 1 < count) ? dirPages[i + 1] : NULL_NUM;
+                size_t n = std::min((size_t)DIR_CAP, dir.size() - i * DIR_CAP);
+                std::copy(dir.begin() + i * DIR_CAP, dir.begin() + i * DIR_CAP + n, page.begin() + 1);
+                pager.write(dirPages[i], page.data(), page.size() * sizeof(fpos_t));
+            }
+            base.dirHead = dirPages[0];
+            dirDirty = false;
+            return stale;
+        }
+
+        void loadDirectory() {
+            dir.resize((size_t)1 << base.depth);
+            std::vector<fpos_t> page(DIR_CAP + 1);
+            size_t done = 0;
+            for (fpos_t pos = base.dirHead; done < dir.size(); pos = page[0]) {
+                if (pos == NULL_NUM) throw "bad hash index file: directory truncated";
+                pager.read(pos, page.data(), page.size() * sizeof(fpos_t));
+                dirPages.push_back(pos);
+                size_t n = std::min((size_t)DIR_CAP, dir.size() - done);
+                std::copy(page.begin() + 1, page.begin() + 1 + n, dir.begin() + done);
+                done += n;
+            }
+        }
+
+        void writeBack() {
+            std::vector<fpos_t> stale;
+            if (dirDirty) stale = storeDirectory();
+            disk.flush();
+            pager.write(0, &base, sizeof(IndexBase));
+            if (stale.empty()) return;
+            for (fpos_t pos : stale) pages.free(pos);
+            pager.write(0, &base, sizeof(IndexBase));
+        }
+
+    public:
+        HashIndex(const char *dataFileName, PagerType pagerType = PAGER_PIO):
+            pages(base.pages, disk, NODE_BEGIN, NODE_STRIDE), dirDirty(false) {
+            data = open(dataFileName, O_RDWR | O_CREAT, 0644);
+            if (data < 0) throw "cannot open hash index file";
+            struct stat fileStat;
+            fstat(data, &fileStat);
+            pager.open(data, pagerType);
+            disk.setPager(&pager);
+            pages.setPager(&pager);
+            if (fileStat.st_size == 0) {
+                Bucket first;
+                emptyBucket(first, 0);
+                dir.push_back(pages.alloc());
+                disk.write(dir[0], first);
+                base.buckets = 1;
+                dirDirty = true;
+                writeBack();
+            } else {
+                pager.read(0, &base, sizeof(IndexBase));
+                if (!base.check()) {
+                    pager.close();
+                    close(data);
+                    throw "bad hash index file: magic, version or bucket size mismatch";
+                }
+                loadDirectory();
+            }
+        }
+
+        ~HashIndex() {
+            writeBack();
+            pager.close();
+            close(data);
+        }
+
+        /*
+         * 同 BTree: 已存在返回 false, 不覆盖
+         */
+        bool insert(const Key &key, const Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            Bucket bucket;
+            while (true) {
+                size_t slot = slotOf(storeKey);
+                fpos_t pos = dir[slot];
+                disk.read(pos, bucket);
+                int i = searchBucket(bucket, storeKey);
+                if (hit(bucket, i, storeKey)) return false;
+                if (bucket.head.siz < (int)CAP) {
+                    int n = bucket.head.siz;
+                    memmove(bucket.keys() + i + 1, bucket.keys() + i, (n - i) * sizeof(store_t));
+                    memmove(bucket.vals() + i + 1, bucket.vals() + i, (n - i) * sizeof(Val));
+                    bucket.keys()[i] = storeKey;
+                    bucket.vals()[i] = val;
+                    bucket.head.siz++;
+                    disk.write(pos, bucket);
+                    base.siz++;
+                    return true;
+                }
+                split(slot, pos, bucket); //分完不一定有空位 (全分到一边), 再来
+            }
+        }
+
+        bool find(const Key &key, Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            const Bucket *bucket = disk.peek(dir[slotOf(storeKey)]);
+            int i = searchBucket(*bucket, storeKey);
+            if (!hit(*bucket, i, storeKey)) return false;
+            val = bucket->vals()[i];
+            return true;
+        }
+
+        bool modify(const Key &key, const Val &val) {
+            store_t storeKey = KeyPolicy::encode(key);
+            fpos_t pos = dir[slotOf(storeKey)];
+            Bucket bucket;
+            disk.read(pos, bucket);
+            int i = searchBucket(bucket, storeKey);
+            if (!hit(bucket, i, storeKey)) return false;
+            bucket.vals()[i] = val;
+            disk.write(pos, bucket);
+            return true;
+        }
+
+        bool del(const Key &key) {
+            store_t storeKey = KeyPolicy::encode(key);
+            size_t slot = slotOf(storeKey);
+            fpos_t pos = dir[slot];
+            Bucket bucket;
+            disk.read(pos, bucket);
+            int i = searchBucket(bucket, storeKey);
+            if (!hit(bucket, i, storeKey)) return false;
+            int n = --bucket.head.siz;
+            memmove(bucket.keys() + i, bucket.keys() + i + 1, (n - i) * sizeof(store_t));
+            memmove(bucket.vals() + i, bucket.vals() + i + 1, (n - i) * sizeof(Val));
+            disk.write(pos, bucket);
+            base.siz--;
+            tryMerge(slot, pos, bucket);
+            return true;
+        }
+
+        size_t size() const {return base.siz;}
+
+        /*
+         * 检查点: 目录、cache 脏页和文件头写回并落盘
+         */
+        void sync() {
+            writeBack();
+            pager.sync();
+        }
+
+        void display() {
+            printf("hash index: %lu K-V, global depth %d, %lld buckets (%lu slots each), load factor %.4lf\n",
+                   base.siz, base.depth, base.buckets, CAP, (double)base.siz / (base.buckets * CAP));
+        }
+
+        CacheStats cacheStats() const {return disk.stats();}
+
+        IoStats ioStats() const {return pager.stats();}
+
+        void resetStats() {
+            disk.resetStats();
+            pager.resetStats();
+            pages.resetStats();
+        }
+    };
+}
+
+#endif //DS01_B_TREE_HASHINDEX_HPP
@@ -0,0 +1,129 @@
+#ifndef DS01_B_TREE_KEYS_HPP
+#define DS01_B_TREE_KEYS_HPP
+
+#include <cstring>
+#include <string>
+#include <functional>
+#include <type_traits>
+
+namespace Sirius {
+
+    /*
+     * Key 的储存策略, BTree 节点里只存 store_t, 比较 (operator< / operator==) 也只在 store_t 上做
+     * encode: Key -> store_t
+     * decode: store_t -> Key, 只有 ORDERED 的策略可以还原 (游标取 key 时要用)
+     * VARIABLE: 节点在盘上是否按变长的槽页存 (见 page.hpp), 否则整个节点原样按字节存
+     */
+
+    /*
+     * 哈希策略 (默认), 即原来的做法: std::hash 后取模, 比较快但没有顺序
+     * 注意哈希冲突会被当成 "key duplicate" 拒绝插入
+     */
+    template<class Key>
+    struct HashKey {
+        typedef int store_t;
+        static const bool ORDERED = false;
+        static const bool VARIABLE = false;
+        static const int HASH_MOD = (2147483647);
+
+        static store_t encode(const Key &key) {
+            return std::hash<Key>{}(key) % HASH_MOD;
+        }
+    };
+
+    /*
+     * 原样储存策略: 节点里直接存 Key, 要求 Key 可以直接按字节读写文件 (int, double, 定长结构体等)
+     */
+    template<class Key>
+    struct OrderedKey {
+        static_assert(std::is_trivially_copyable<Key>::value, "OrderedKey requires a trivially copyable Key");
+
+        typedef Key store_t;
+        static const bool ORDERED = true;
+        static const bool VARIABLE = false;
+
+        static store_t encode(const Key &key) {return key;}
+        static Key decode(const store_t &key) {return key;}
+    };
+
+    /*
+     * 定长字符串策略: std::string 补 '\0' 到 LEN 字节储存, memcmp 比较, 与 std::string 的字典序一致
+     * 超过 LEN 的串无法保序, 直接抛出
+     */
+    template<int LEN>
+    struct FixedStringKey {
+        struct store_t {
+            char str[LEN];
+
+            bool operator<(const store_t &rhs) const {return memcmp(str, rhs.str, LEN) < 0;}
+            bool operator==(const store_t &rhs) const {return memcmp(str, rhs.str, LEN) == 0;}
+        };
+        static const bool ORDERED = true;
+        static const bool VARIABLE = false;
+
+        static store_t encode(const std::string &key) {
+            if (key.size() > LEN) throw "key too long";
+            store_t ret;
+            memset(ret.str, 0, LEN);
+            memcpy(ret.str, key.data(), key.size());
+            return ret;
+        }
+
+        static std::string decode(const store_t &key) {
+            size_t len = 0;
+            while (len < LEN && key.str[len] != '\0') len++;
+            return std::string(key.str, len);
+        }
+    };
+
+    /*
+     * 变长字符串策略: 盘上的节点是 PAGE 字节的槽页, key 按实际长度存, 同一节点的公共前缀只存一份 (见 page.hpp)
+     * cache 里的节点还是定长的, 一个 key 最长 MAXLEN 字节, 超过直接抛出; 比较为字典序, 与 std::string 一致
+     * 节点满不满按编码后的字节数算, 阶数 M 只是内存里的个数上限, 用 PageFanout 算 (见 layout.hpp)
+     */
+    template<int MAXLEN = 64, int PAGE = 4096>
+    struct VarStringKey {
+        static_assert(MAXLEN > 0 && MAXLEN < 65536 && PAGE <= 65536, "key length and page offsets are 16-bit");
+
+        struct store_t {
+            unsigned short len;
+            char str[MAXLEN];
+
+            bool operator<(const store_t &rhs) const {
+                int cmp = memcmp(str, rhs.str, len < rhs.len ? len : rhs.len);
+                return cmp < 0 || (cmp == 0 && len < rhs.len);
+            }
+            bool operator==(const store_t &rhs) const {return len == rhs.len && memcmp(str, rhs.str, len) == 0;}
+        };
+        static const bool ORDERED = true;
+        static const bool VARIABLE = true;
+        static const int MAX_LEN = MAXLEN;
+        static const int PAGE_BYTES = PAGE;
+
+        static store_t encode(const std::string &key) {
+            if (key.size() > MAXLEN) throw "key too long";
+            store_t ret;
+            memset(&ret, 0, sizeof(store_t)); //尾巴清零, 整个 store_t 会原样进 WAL
+            ret.len = key.size();
+            memcpy(ret.str, key.data(), key.size());
+            return ret;
+        }
+
+        static std::string decode(const store_t &key) {
+            return std::string(key.str, key.len);
+        }
+
+        //槽页编解码用: key 的字节, 以及由前缀 + 后缀拼回一个 key
+        static size_t length(const store_t &key) {return key.len;}
+
+        static const char *data(const store_t &key) {return key.str;}
+
+        static void assign(store_t &key, const char *prefix, size_t prefixLen, const char *suffix, size_t suffixLen) {
+            key.len = prefixLen + suffixLen;
+            memcpy(key.str, prefix, prefixLen);
+            memcpy(key.str + prefixLen, suffix, suffixLen);
+        }
+    };
+}
+
+#endif //DS01_B_TREE_KEYS_HPP
@@ -0,0 +1,339 @@
+#ifndef DS01_B_TREE_LATCH_HPP
+#define DS01_B_TREE_LATCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sirius {
+
+    /*
+     * 页闩, BTree 的模板参数 CONCURRENT 决定用哪个
+     * 单线程版本全部是空函数, 编译后什么都不剩
+     */
+    template<bool CONCURRENT>
+    class PageLatches {
+        typedef long long fpos_t;
+
+    public:
+        typedef unsigned long long version_t;
+
+        struct Writer {};
+
+        void beginWrite(Writer &) {}
+        void endWrite(Writer &) {}
+        void beginCrab(Writer &) {}
+        void endCrab(Writer &) {}
+        bool gaveUp(const Writer &) const {return false;}
+        bool crabbing() const {return false;}
+        void giveUp() {}
+        void acquire(fpos_t) {}
+        void release(fpos_t) {}
+        void releaseAbove(fpos_t) {}
+        void lock(fpos_t) {}
+        void lockAlloc() {}
+        void unlockAlloc() {}
+        version_t readBegin(fpos_t) const {return 0;}
+        bool validate(fpos_t, version_t) const {return true;}
+    };
+
+    /*
+     * 多线程版本
+     * 读者: 乐观锁耦合 (optimistic lock coupling)
+     *   每页一个版本号 (按页位置哈希到 STRIPES 个槽上, 撞槽只会让读者多等、多重试)
+     *   低 16 位是正在改这个槽的写者数, 写者改一页前 +1, 操作结束时 -1 并把高位的轮数 +1
+     *   读者不加锁: 等到没有写者时记下版本号, 拷贝节点, 再核对版本号没变; 下到孩子前先记下孩子的版本号, 再核对一次父亲
+     *   核对失败说明读的过程中有写者改过, 从根重来
+     * 写者: 闩耦合 (latch crabbing), insert / modify / del 之间可以同时进行
+     *   每页一把写者闩 (按位置区分, 不按槽), 从根指针 (位置 0) 开始, 先闩孩子再读它
+     *   孩子 "安全" (插入不会分裂、删除不会合并) 就放开上面闩着的, 分裂合并最多改到这里
+     *   删除时拿着父亲再闩兄弟; 新分配的页别人走不到, 直接闩上
+     *   释放的页马上放开闩 (版本号留到操作结束), 别的写者分配到它时不用等
+     *   闩只会从上往下、或拿着父亲闩兄弟, 不会互相等成环
+     * 其余写操作 (批量、快照、整理、sync, 以及开了 WAL、过滤器或有快照时的所有写) 独占整棵树:
+     *   等进行中的闩耦合写者都出去, 期间不让新的进来 (写者优先, 独占的不会饿死), 独占时不闩页
+     */
+    template<>
+    class PageLatches<true> {
+        typedef long long fpos_t;
+        static const int STRIPES = 1 << 14;
+        static const int SHARDS = 64;
+
+    public:
+        typedef unsigned long long version_t;
+
+        /*
+         * 一次写操作的状态, 放在作用域对象里
+         * 本线程正在进行的写操作用 thread_local 指针找到, outer 是它外面那层 (如 scan 的回调里写另一棵树)
+         */
+        struct Writer {
+            PageLatches *owner = nullptr;
+            Writer *outer = nullptr;
+            bool exclusive = false, gaveUp = false;
+            std::vector<fpos_t> latched; //闩着的页, 按闩上的顺序
+            std::vector<int> marked; //改过的槽
+        };
+
+    private:
+        static const version_t ACTIVE = (1 << 16) - 1, ROUND = 1 << 16;
+
+        struct Shard {
+            std::mutex lock;
+            std::condition_variable freed;
+            std::vector<fpos_t> held;
+        };
+
+        std::atomic<version_t> version[STRIPES];
+        std::vector<char> held; //独占写者已经改过的槽
+        Shard shards[SHARDS];
+        std::mutex gate;
+        std::condition_variable gateOpen;
+        int crabbers, exclusiveWaiting;
+        bool exclusive;
+        std::mutex alloc; //闩耦合的写者同时分配、释放页
+
+        static int stripe(fpos_t pos) {
+            unsigned long long h = (unsigned long long)pos * 0x9E3779B97F4A7C15ull;
+            return h >> (64 - 14);
+        }
+
+        static Writer *&current() {
+            static thread_local Writer *writer = nullptr;
+            return writer;
+        }
+
+        //本线程在这棵树上的写操作, 没有返回空 (析构时回收页不在任何作用域里)
+        Writer *mine() const {
+            Writer *w = current();
+            return w != nullptr && w->owner == this ? w : nullptr;
+        }
+
+        void enter(Writer &w, bool excl) {
+            w.owner = this;
+            w.exclusive = excl;
+            w.outer = current();
+            current() = &w;
+        }
+
+        void leave(Writer &w) {
+            for (int s : w.marked) {
+                version[s].fetch_add(ROUND - 1, std::memory_order_release);
+                if (w.exclusive) held[s] = 0;
+            }
+            w.marked.clear();
+            for (fpos_t pos : w.latched) unlatch(pos);
+            w.latched.clear();
+            current() = w.outer;
+        }
+
+        void unlatch(fpos_t pos) {
+            Shard &shard = shards[stripe(pos) % SHARDS];
+            {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.held.erase(std::find(shard.held.begin(), shard.held.end(), pos));
+            }
+            shard.freed.notify_all();
+        }
+
+    public:
+        PageLatches(): held(STRIPES, 0), crabbers(0), exclusiveWaiting(0), exclusive(false) {
+            for (int i = 0; i < STRIPES; ++i) version[i].store(0, std::memory_order_relaxed);
+        }
+
+        void beginWrite(Writer &w) {
+            std::unique_lock<std::mutex> guard(gate);
+            exclusiveWaiting++;
+            gateOpen.wait(guard, [this] {return !exclusive && crabbers == 0;});
+            exclusiveWaiting--;
+            exclusive = true;
+            guard.unlock();
+            enter(w, true);
+        }
+
+        void endWrite(Writer &w) {
+            leave(w);
+            {
+                std::lock_guard<std::mutex> guard(gate);
+                exclusive = false;
+            }
+            gateOpen.notify_all();
+        }
+
+        void beginCrab(Writer &w) {
+            std::unique_lock<std::mutex> guard(gate);
+            gateOpen.wait(guard, [this] {return !exclusive && exclusiveWaiting == 0;});
+            crabbers++;
+            guard.unlock();
+            enter(w, false);
+        }
+
+        void endCrab(Writer &w) {
+            leave(w);
+            bool last;
+            {
+                std::lock_guard<std::mutex> guard(gate);
+                last = --crabbers == 0 && exclusiveWaiting > 0;
+            }
+            if (last) gateOpen.notify_all();
+        }
+
+        bool gaveUp(const Writer &w) const {
+            return w.gaveUp;
+        }
+
+        bool crabbing() const {
+            Writer *w = mine();
+            return w != nullptr && !w->exclusive;
+        }
+
+        /*
+         * 闩耦合的写者发现这次操作要独占 (还没改任何页), 出了作用域后改用独占重做
+         */
+        void giveUp() {
+            Writer *w = mine();
+            if (w != nullptr) w->gaveUp = true;
+        }
+
+        /*
+         * 闩上一页, 已经闩着的不再闩; 独占时什么都不做
+         */
+        void acquire(fpos_t pos) {
+            Writer *w = mine();
+            if (w == nullptr || w->exclusive) return;
+            if (std::find(w->latched.begin(), w->latched.end(), pos) != w->latched.end()) return;
+            Shard &shard = shards[stripe(pos) % SHARDS];
+            std::unique_lock<std::mutex> guard(shard.lock);
+            shard.freed.wait(guard, [&] {return std::find(shard.held.begin(), shard.held.end(), pos) == shard.held.end();});
+            shard.held.push_back(pos);
+            guard.unlock();
+            w->latched.push_back(pos);
+        }
+
+        void release(fpos_t pos) {
+            Writer *w = mine();
+            if (w == nullptr || w->exclusive) return;
+            auto it = std::find(w->latched.begin(), w->latched.end(), pos);
+            if (it == w->latched.end()) return;
+            w->latched.erase(it);
+            unlatch(pos);
+        }
+
+        /*
+         * pos 是安全的孩子: 放开除它以外闩着的页 (都是它的祖先)
+         */
+        void releaseAbove(fpos_t pos) {
+            Writer *w = mine();
+            if (w == nullptr || w->exclusive) return;
+            for (fpos_t p : w->latched)
+                if (p != pos) unlatch(p);
+            w->latched.assign(1, pos);
+        }
+
+        /*
+         * 写者在页被改动之前调用, 同一个操作里重复调用只记一次
+         * 闩耦合时顺带闩上 (新分配的页在这里闩)
+         */
+        void lock(fpos_t pos) {
+            Writer *w = mine();
+            if (w == nullptr) return;
+            int s = stripe(pos);
+            if (w->exclusive) {
+                if (held[s]) return;
+                held[s] = 1;
+            }
+            else {
+                acquire(pos);
+                if (std::find(w->marked.begin(), w->marked.end(), s) != w->marked.end()) return;
+            }
+            w->marked.push_back(s);
+            version[s].fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        void lockAlloc() {
+            alloc.lock();
+        }
+
+        void unlockAlloc() {
+            alloc.unlock();
+        }
+
+        /*
+         * 读者: 等到没有写者时返回当前版本号
+         */
+        version_t readBegin(fpos_t pos) const {
+            const std::atomic<version_t> &v = version[stripe(pos)];
+            while (true) {
+                version_t ret = v.load(std::memory_order_acquire);
+                if ((ret & ACTIVE) == 0) return ret;
+                std::this_thread::yield();
+            }
+        }
+
+        bool validate(fpos_t pos, version_t ver) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return version[stripe(pos)].load(std::memory_order_relaxed) == ver;
+        }
+    };
+
+    /*
+     * 独占写者的作用域: 构造时等到整棵树只有自己在写, 析构时放开这次改过的所有页 (异常退出也会放)
+     */
+    template<bool CONCURRENT>
+    class WriteScope {
+        PageLatches<CONCURRENT> &latches;
+        typename PageLatches<CONCURRENT>::Writer writer;
+
+    public:
+        explicit WriteScope(PageLatches<CONCURRENT> &_latches): latches(_latches) {
+            latches.beginWrite(writer);
+        }
+
+        ~WriteScope() {
+            latches.endWrite(writer);
+        }
+    };
+
+    /*
+     * 闩耦合写者的作用域: 构造时进门 (有独占写者在里面或在等时先等), 析构时放开还闩着的页和改过的版本号
+     */
+    template<bool CONCURRENT>
+    class CrabScope {
+        PageLatches<CONCURRENT> &latches;
+        typename PageLatches<CONCURRENT>::Writer writer;
+
+    public:
+        explicit CrabScope(PageLatches<CONCURRENT> &_latches): latches(_latches) {
+            latches.beginCrab(writer);
+        }
+
+        ~CrabScope() {
+            latches.endCrab(writer);
+        }
+
+        bool gaveUp() const {
+            return latches.gaveUp(writer);
+        }
+    };
+
+    /*
+     * 分配器 (空闲链表) 的作用域
+     */
+    template<bool CONCURRENT>
+    class AllocScope {
+        PageLatches<CONCURRENT> &latches;
+
+    public:
+        explicit AllocScope(PageLatches<CONCURRENT> &_latches): latches(_latches) {
+            latches.lockAlloc();
+        }
+
+        ~AllocScope() {
+            latches.unlockAlloc();
+        }
+    };
+}
+
+#endif //DS01_B_TREE_LATCH_HPP
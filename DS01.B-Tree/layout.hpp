@@ -0,0 +1,84 @@
+#ifndef DS01_B_TREE_LAYOUT_HPP
+#define DS01_B_TREE_LAYOUT_HPP
+
+#include <cstddef>
+#include "keys.hpp"
+#include "page.hpp"
+
+namespace Sirius {
+
+    /*
+     * 文件里节点的排布
+     * 节点槽位 (stride) 不小于一页时补齐到页的整数倍, 小于一页时补齐到 2 的幂, 这样一页里正好放下整数个槽
+     * 第一个槽从文件头之后按 min(stride, 页) 对齐的位置开始, 任何节点都不会跨页
+     */
+    static const long long DISK_PAGE = 4096;
+
+    constexpr long long alignUp(long long x, long long a) {
+        return (x + a - 1) / a * a;
+    }
+
+    //不小于 x 的 2 的幂, 最多到一页
+    constexpr long long pow2Up(long long x, long long p = 1) {
+        return p < x && p < DISK_PAGE ? pow2Up(x, p << 1) : p;
+    }
+
+    constexpr long long nodeStride(long long nodeSize) {
+        return nodeSize >= DISK_PAGE ? alignUp(nodeSize, DISK_PAGE) : pow2Up(nodeSize);
+    }
+
+    constexpr long long nodeBegin(long long headerSize, long long stride) {
+        return alignUp(headerSize, stride < DISK_PAGE ? stride : DISK_PAGE);
+    }
+
+    /*
+     * 一页 (PAGE 字节) 能放下的最大阶数 M, 用法 BTree<Key, Val, PageFanout<Key, Val, 4096>::value>
+     * 按 BTreeNode 的成员顺序模拟对齐算出节点大小: siz, key[M+1], val[M+1], son[M+2]
+     * KeyPolicy 决定节点里实际存的 key 类型, 要和 BTree 的模板参数一致
+     * 变长 key 的节点按槽页存 (页大小由 KeyPolicy 定), M 只是个数上限: 取内部节点 key 只有 1 字节时一页能放下的个数
+     */
+    template<class Key, class Val, int PAGE = 4096, class KeyPolicy = HashKey<Key> >
+    class PageFanout {
+        typedef typename KeyPolicy::store_t store_t;
+        typedef long long fpos_t;
+
+        static constexpr size_t maxAlign() {
+            return alignof(store_t) > alignof(Val) ? (alignof(store_t) > alignof(fpos_t) ? alignof(store_t) : alignof(fpos_t))
+                                                   : (alignof(Val) > alignof(fpos_t) ? alignof(Val) : alignof(fpos_t));
+        }
+
+        static constexpr long long nodeSize(long long m) {
+            return alignUp(alignUp(alignUp(alignUp((long long)sizeof(size_t), alignof(store_t)) + (m + 1) * sizeof(store_t),
+                                           alignof(Val)) + (m + 1) * sizeof(Val),
+                                   alignof(fpos_t)) + (m + 2) * sizeof(fpos_t),
+                           maxAlign());
+        }
+
+        //二分: nodeSize(lo) 放得下, nodeSize(hi) 放不下 (C++11 的 constexpr 只能递归, 逐个试会太深)
+        static constexpr int search(int lo = 3, int hi = PAGE) {
+            return hi - lo <= 1 ? lo
+                 : nodeSize((lo + hi) / 2) <= PAGE ? search((lo + hi) / 2, hi) : search(lo, (lo + hi) / 2);
+        }
+
+        template<class P>
+        static constexpr int slotted(std::true_type) {
+            return (P::PAGE_BYTES - SLOTTED_HEAD - sizeof(fpos_t)) / (SLOTTED_SLOT + sizeof(Val) + sizeof(fpos_t) + 1) + 1;
+        }
+
+        template<class P>
+        static constexpr int slotted(std::false_type) {return search();}
+
+    public:
+        static constexpr int value = slotted<KeyPolicy>(std::integral_constant<bool, KeyPolicy::VARIABLE>());
+        static constexpr long long bytes = KeyPolicy::VARIABLE ? 0 : nodeSize(value);
+        static_assert(KeyPolicy::VARIABLE || nodeSize(3) <= PAGE, "page too small for a node of order 3");
+    };
+
+    template<class Key, class Val, int PAGE, class KeyPolicy>
+    constexpr int PageFanout<Key, Val, PAGE, KeyPolicy>::value;
+
+    template<class Key, class Val, int PAGE, class KeyPolicy>
+    constexpr long long PageFanout<Key, Val, PAGE, KeyPolicy>::bytes;
+}
+
+#endif //DS01_B_TREE_LAYOUT_HPP
@@ -0,0 +1,163 @@
+#ifndef DS01_B_TREE_PAGE_HPP
+#define DS01_B_TREE_PAGE_HPP
+
+#include <algorithm>
+#include <cstring>
+#include "pager.hpp"
+
+namespace Sirius {
+
+    /*
+     * 槽页 (slotted page), 变长 key 的节点在盘上的格式, cache 里仍是解开的定长节点, 读进来解码、写回时编码
+     * | 页头 | 公共前缀 | 槽 x siz | val x siz | son x (siz+1) | ...空闲... | key 后缀堆 (从页尾往前长) |
+     * - 页头: siz, 前缀长度, 是否内部节点 (全 0 的页解出来是空叶子)
+     * - 公共前缀: 节点里 key 有序, 所有 key 的公共前缀就是首尾两个 key 的公共前缀, 只存一份
+     * - 槽: 后缀在页内的偏移和长度
+     * - 叶子不存 son
+     * 内部节点的 key 带着 val, 是真正的数据而不是分隔, 所以只做前缀压缩, 不能做后缀截断
+     */
+    static const size_t SLOTTED_HEAD = 8;
+    static const size_t SLOTTED_SLOT = 4;
+
+    template<class Node, class KeyPolicy, class Val>
+    struct SlottedCodec {
+        typedef long long fpos_t;
+        typedef typename KeyPolicy::store_t store_t;
+
+        struct Head {
+            unsigned short siz, prefixLen;
+            unsigned char internal, pad[3];
+        };
+
+        struct Slot {
+            unsigned short off, len;
+        };
+
+        static_assert(sizeof(Head) == SLOTTED_HEAD && sizeof(Slot) == SLOTTED_SLOT, "unexpected page header layout");
+
+        static const bool RAW = false;
+        static const size_t BYTES = KeyPolicy::PAGE_BYTES;
+        static const size_t MAX_ENTRY = SLOTTED_SLOT + KeyPolicy::MAX_LEN + sizeof(Val) + sizeof(fpos_t); //最长的一个 K-V (带 son)
+        static const int SAFE_ENTRIES = (BYTES - SLOTTED_HEAD - sizeof(fpos_t)) / MAX_ENTRY; //key 全是最长也放得下的个数
+
+        //分裂和批量切块都按字节估计, 要给一个最长的 K-V 留余量
+        static_assert(SAFE_ENTRIES >= 8, "page too small: it must hold at least 8 of the longest entries");
+
+        static size_t prefixOf(const Node &node) {
+            if (node.siz == 0) return 0;
+            const store_t &first = node.key[0], &last = node.key[node.siz - 1];
+            size_t len = std::min(KeyPolicy::length(first), KeyPolicy::length(last)), ret = 0;
+            const char *a = KeyPolicy::data(first), *b = KeyPolicy::data(last);
+            while (ret < len && a[ret] == b[ret]) ret++;
+            return ret;
+        }
+
+        static bool internal(const Node &node) {
+            return node.son[0] >= 0;
+        }
+
+        /*
+         * 一个 K-V 不算前缀压缩时占的字节, 是实际占用的上界
+         */
+        static size_t entryBytes(const store_t &key, bool internal) {
+            return SLOTTED_SLOT + KeyPolicy::length(key) + sizeof(Val) + (internal ? sizeof(fpos_t) : 0);
+        }
+
+        static size_t bytes(const Node &node) {
+            size_t prefix = prefixOf(node), ret = SLOTTED_HEAD + prefix;
+            bool inner = internal(node);
+            for (size_t i = 0; i < node.siz; ++i) ret += entryBytes(node.key[i], inner) - prefix;
+            return ret + (inner ? sizeof(fpos_t) : 0);
+        }
+
+        static bool fits(const Node &node) {
+            return bytes(node) <= BYTES;
+        }
+
+        /*
+         * 分裂点: 按字节对半分, 上提的 K-V 两边都至少留一个
+         */
+        static int splitPoint(const Node &node) {
+            size_t total = 0, half = 0;
+            bool inner = internal(node);
+            for (size_t i = 0; i < node.siz; ++i) total += entryBytes(node.key[i], inner);
+            int mid = 0;
+            while (mid + 2 < (int)node.siz && (half += entryBytes(node.key[mid], inner)) < total / 2) mid++;
+            return std::max(mid, 1);
+        }
+
+        static void encode(const Node &node, char *page) {
+            Head head;
+            memset(&head, 0, sizeof(Head));
+            head.siz = node.siz;
+            head.prefixLen = prefixOf(node);
+            head.internal = internal(node);
+            memcpy(page, &head, sizeof(Head));
+
+            char *ptr = page + SLOTTED_HEAD;
+            if (node.siz > 0) memcpy(ptr, KeyPolicy::data(node.key[0]), head.prefixLen);
+            ptr += head.prefixLen;
+            char *slots = ptr, *heap = page + BYTES;
+            ptr += node.siz * SLOTTED_SLOT;
+            memcpy(ptr, node.val, node.siz * sizeof(Val));
+            ptr += node.siz * sizeof(Val);
+            if (head.internal) {
+                memcpy(ptr, node.son, (node.siz + 1) * sizeof(fpos_t));
+                ptr += (node.siz + 1) * sizeof(fpos_t);
+            }
+            for (size_t i = 0; i < node.siz; ++i) {
+                Slot slot;
+                slot.len = KeyPolicy::length(node.key[i]) - head.prefixLen;
+                heap -= slot.len;
+                slot.off = heap - page;
+                memcpy(heap, KeyPolicy::data(node.key[i]) + head.prefixLen, slot.len);
+                memcpy(slots + i * SLOTTED_SLOT, &slot, sizeof(Slot));
+            }
+            memset(ptr, 0, heap - ptr);
+        }
+
+        /*
+         * 多线程时乐观读可能读到正在被改的页, 版本号事后会发现并重试, 但解码本身不能越界
+         * 所以页头和槽都先查一遍, 不对就当空叶子
+         */
+        static void decode(const char *page, Node &node) {
+            Head head;
+            memcpy(&head, page, sizeof(Head));
+            for (size_t i = 0; i < sizeof(node.son) / sizeof(fpos_t); ++i) node.son[i] = -1;
+            size_t fixed = SLOTTED_HEAD + head.prefixLen + head.siz * (SLOTTED_SLOT + sizeof(Val))
+                           + (head.internal ? (head.siz + 1) * sizeof(fpos_t) : 0);
+            if (head.siz >= sizeof(node.key) / sizeof(store_t) || head.prefixLen > KeyPolicy::MAX_LEN || fixed > BYTES) {
+                node.siz = 0;
+                return;
+            }
+            node.siz = head.siz;
+
+            const char *prefix = page + SLOTTED_HEAD;
+            const char *ptr = prefix + head.prefixLen, *slots = ptr;
+            ptr += node.siz * SLOTTED_SLOT;
+            memcpy(node.val, ptr, node.siz * sizeof(Val));
+            ptr += node.siz * sizeof(Val);
+            if (head.internal) memcpy(node.son, ptr, (node.siz + 1) * sizeof(fpos_t));
+            for (size_t i = 0; i < node.siz; ++i) {
+                Slot slot;
+                memcpy(&slot, slots + i * SLOTTED_SLOT, sizeof(Slot));
+                if (slot.off + slot.len > BYTES || head.prefixLen + slot.len > KeyPolicy::MAX_LEN) slot.len = 0;
+                KeyPolicy::assign(node.key[i], prefix, head.prefixLen, page + std::min<size_t>(slot.off, (size_t)BYTES), slot.len);
+            }
+        }
+
+        static void load(Pager &pager, fpos_t pos, Node &node) {
+            char page[BYTES];
+            pager.read(pos, page, BYTES);
+            decode(page, node);
+        }
+
+        static void store(Pager &pager, fpos_t pos, const Node &node) {
+            char page[BYTES];
+            encode(node, page);
+            pager.write(pos, page, BYTES);
+        }
+    };
+}
+
+#endif //DS01_B_TREE_PAGE_HPP
@@ -0,0 +1,357 @@
+#ifndef DS01_B_TREE_PAGER_HPP
+#define DS01_B_TREE_PAGER_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <memory>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Sirius {
+
+    static_assert(sizeof(off_t) >= 8, "64-bit file offsets required, compile with -D_FILE_OFFSET_BITS=64");
+
+    /*
+     * 定位读写, 不用 fseek + fread/fwrite, 避免共享文件指针, 也没有 stdio 缓冲的拷贝
+     * 读到文件末尾以外的部分补 0 (新分配还没写过的节点)
+     */
+    inline void diskRead(int fd, long long pos, void *buf, size_t len) {
+        char *ptr = reinterpret_cast<char *>(buf);
+        while (len > 0) {
+            ssize_t ret = pread(fd, ptr, len, pos);
+            if (ret < 0) throw "disk read failed";
+            if (ret == 0) {
+                std::fill(ptr, ptr + len, 0);
+                return;
+            }
+            ptr += ret, pos += ret, len -= ret;
+        }
+    }
+
+    inline void diskWrite(int fd, long long pos, const void *buf, size_t len) {
+        const char *ptr = reinterpret_cast<const char *>(buf);
+        while (len > 0) {
+            ssize_t ret = pwrite(fd, ptr, len, pos);
+            if (ret <= 0) throw "disk write failed";
+            ptr += ret, pos += ret, len -= ret;
+        }
+    }
+
+    enum PagerType {
+        PAGER_PIO, //pread/pwrite
+        PAGER_MMAP, //整个文件映射到内存, 按大块增长
+        PAGER_DIRECT //O_DIRECT, 绕过页缓存, 读写都按 DIRECT_ALIGN 对齐
+    };
+
+    /*
+     * 写之前的钩子, 每次 Pager::write 真正落到文件 (或映射) 之前调用, 如 WAL 在这里先记下前像
+     */
+    struct PagerHook {
+        virtual void beforeWrite(long long pos, size_t len) = 0;
+        virtual ~PagerHook() {}
+    };
+
+    /*
+     * 数据文件的读写计数, 每次 Pager::read/write/sync 记一次
+     * 多线程时读者未命中也会读盘, 所以用原子加 (relaxed, 不保证几个计数之间一致)
+     */
+    struct IoStats {
+        size_t reads, writes;
+        size_t bytesRead, bytesWritten;
+        size_t syncs;
+
+        IoStats(): reads(0), writes(0), bytesRead(0), bytesWritten(0), syncs(0) {}
+    };
+
+    /*
+     * mmap 重新映射用的读写锁: 读写映射的拿共享, 重新映射的拿独占; 有独占的在等时不再放新的共享进来
+     * lock / unlock 可以直接配 std::unique_lock, 共享的用 SharedGuard
+     */
+    class RemapLock {
+        std::mutex mtx;
+        std::condition_variable cond;
+        int readers, writersWaiting;
+        bool writing;
+
+    public:
+        RemapLock(): readers(0), writersWaiting(0), writing(false) {}
+
+        void lockShared() {
+            std::unique_lock<std::mutex> guard(mtx);
+            cond.wait(guard, [this] {return !writing && writersWaiting == 0;});
+            ++readers;
+        }
+
+        void unlockShared() {
+            std::lock_guard<std::mutex> guard(mtx);
+            if (--readers == 0) cond.notify_all();
+        }
+
+        void lock() {
+            std::unique_lock<std::mutex> guard(mtx);
+            ++writersWaiting;
+            cond.wait(guard, [this] {return !writing && readers == 0;});
+            --writersWaiting;
+            writing = true;
+        }
+
+        void unlock() {
+            std::lock_guard<std::mutex> guard(mtx);
+            writing = false;
+            cond.notify_all();
+        }
+
+        /*
+         * 共享锁的作用域, on 为假时什么都不做 (单线程模式)
+         */
+        class SharedGuard {
+            RemapLock *owner;
+
+        public:
+            SharedGuard(RemapLock &_owner, bool on): owner(on ? &_owner : nullptr) {
+                if (owner != nullptr) owner->lockShared();
+            }
+
+            ~SharedGuard() {
+                if (owner != nullptr) owner->unlockShared();
+            }
+
+            SharedGuard(const SharedGuard &) = delete;
+            SharedGuard &operator=(const SharedGuard &) = delete;
+        };
+    };
+
+    /*
+     * 页读写后端, cache 未命中和写回、页分配器、文件头都经过它
+     * mmap 模式下读就是 memcpy, view() 可以直接拿到映射里的指针, 写回落到页缓存, sync() 时 msync
+     */
+    class Pager {
+        typedef long long fpos_t;
+        static const fpos_t EXTENT = 64ll << 20; //mmap 模式每次至少增长 64MiB
+        static const fpos_t DIRECT_ALIGN = 4096; //O_DIRECT 要求地址、位置、长度都按逻辑块对齐, 取 4KiB 最保险
+
+        int fd;
+        PagerType type;
+        char *map;
+        fpos_t mapSize;
+        PagerHook *hook;
+        bool shared; //多线程模式: mmap 的读写拿共享锁, 重新映射拿独占锁
+        RemapLock remapLock;
+        std::mutex directLock; //多线程模式下 O_DIRECT 的写互斥: 读-改-写同一块的两个写不能交错
+        IoStats counter;
+
+        static void count(size_t &field, size_t n) {
+            __atomic_fetch_add(&field, n, __ATOMIC_RELAXED);
+        }
+
+        /*
+         * 保证 [0, end) 都在映射里, 不够则 ftruncate 扩文件再 mremap
+         */
+        void reserve(fpos_t end) {
+            if (end <= mapSize) return;
+            fpos_t newSize = std::max(mapSize * 2, (end + EXTENT - 1) / EXTENT * EXTENT);
+            if (ftruncate(fd, newSize) != 0) throw "pager grow failed";
+            void *newMap = (map == nullptr) ? mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                            : mremap(map, mapSize, newSize, MREMAP_MAYMOVE);
+            if (newMap == MAP_FAILED) throw "pager mmap failed";
+            map = reinterpret_cast<char *>(newMap);
+            mapSize = newSize;
+        }
+
+        /*
+         * O_DIRECT 模式: [pos, pos + len) 扩到对齐的范围, 经过一块对齐的中转缓冲读写
+         * 写的头尾不满一块时先把那块读上来再改 (读-改-写); 中转缓冲每次现开, 多线程下不用加锁
+         */
+        typedef std::unique_ptr<char, void (*)(void *)> AlignedBuf;
+
+        static AlignedBuf alignedAlloc(size_t len) {
+            void *ptr = nullptr;
+            if (posix_memalign(&ptr, DIRECT_ALIGN, len) != 0) throw "aligned alloc failed";
+            return AlignedBuf(reinterpret_cast<char *>(ptr), free);
+        }
+
+        //文件末尾之后读出来补 0; O_DIRECT 下短读只会发生在文件末尾
+        void directRead(fpos_t begin, char *buf, size_t len) {
+            ssize_t ret = pread(fd, buf, len, begin);
+            if (ret < 0) throw "disk read failed";
+            memset(buf + ret, 0, len - ret);
+        }
+
+        void directIO(fpos_t pos, void *buf, size_t len, bool isWrite) {
+            fpos_t begin = pos / DIRECT_ALIGN * DIRECT_ALIGN;
+            fpos_t end = (pos + (fpos_t)len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+            AlignedBuf block = alignedAlloc(end - begin);
+            if (!isWrite) {
+                directRead(begin, block.get(), end - begin);
+                memcpy(buf, block.get() + (pos - begin), len);
+                return;
+            }
+            if (pos != begin) directRead(begin, block.get(), DIRECT_ALIGN);
+            if (pos + (fpos_t)len != end && (end - begin > DIRECT_ALIGN || pos == begin))
+                directRead(end - DIRECT_ALIGN, block.get() + (end - DIRECT_ALIGN - begin), DIRECT_ALIGN);
+            memcpy(block.get() + (pos - begin), buf, len);
+            for (fpos_t off = 0; off < end - begin; ) {
+                ssize_t ret = pwrite(fd, block.get() + off, end - begin - off, begin + off);
+                if (ret <= 0) throw "disk write failed";
+                off += ret;
+            }
+        }
+
+    public:
+        Pager(): fd(-1), type(PAGER_PIO), map(nullptr), mapSize(0), hook(nullptr), shared(false) {}
+
+        ~Pager() {
+            close();
+        }
+
+        void open(int _fd, PagerType _type) {
+            fd = _fd;
+            type = _type;
+            if (type == PAGER_MMAP) {
+                struct stat fileStat;
+                fstat(fd, &fileStat);
+                reserve(std::max((fpos_t)fileStat.st_size, (fpos_t)1));
+            } else if (type == PAGER_DIRECT) {
+                if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) != 0) throw "O_DIRECT not supported";
+            }
+        }
+
+        /*
+         * 只解除映射, 文件描述符由打开者自己关
+         */
+        void close() {
+            if (type == PAGER_DIRECT && fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            if (map != nullptr) {
+                munmap(map, mapSize);
+                map = nullptr;
+                mapSize = 0;
+            }
+            fd = -1;
+        }
+
+        PagerType pagerType() const {return type;}
+
+        void setHook(PagerHook *_hook) {
+            hook = _hook;
+        }
+
+        void setShared(bool _shared) {
+            shared = _shared;
+        }
+
+        void read(fpos_t pos, void *buf, size_t len) {
+            count(counter.reads, 1), count(counter.bytesRead, len);
+            if (type == PAGER_PIO) {
+                diskRead(fd, pos, buf, len);
+                return;
+            }
+            if (type == PAGER_DIRECT) {
+                directIO(pos, buf, len, false);
+                return;
+            }
+            RemapLock::SharedGuard guard(remapLock, shared);
+            if (pos + (fpos_t)len > mapSize) { //映射以外都是没写过的部分
+                memset(buf, 0, len);
+                return;
+            }
+            memcpy(buf, map + pos, len);
+        }
+
+        void write(fpos_t pos, const void *buf, size_t len) {
+            if (hook != nullptr) hook->beforeWrite(pos, len);
+            count(counter.writes, 1), count(counter.bytesWritten, len);
+            if (type == PAGER_PIO) {
+                diskWrite(fd, pos, buf, len);
+                return;
+            }
+            if (type == PAGER_DIRECT) {
+                std::unique_lock<std::mutex> guard(directLock, std::defer_lock);
+                if (shared) guard.lock();
+                directIO(pos, const_cast<void *>(buf), len, true);
+                return;
+            }
+            if (shared) { //大多数写不用扩, 共享锁下直接写; 要扩时换独占锁
+                RemapLock::SharedGuard guard(remapLock, true);
+                if (pos + (fpos_t)len <= mapSize) {
+                    memcpy(map + pos, buf, len);
+                    return;
+                }
+            }
+            std::unique_lock<RemapLock> guard(remapLock, std::defer_lock);
+            if (shared) guard.lock();
+            reserve(pos + len);
+            memcpy(map + pos, buf, len);
+        }
+
+        /*
+         * 映射里 [pos, pos + len) 的指针, 不是 mmap 模式或超出映射返回 nullptr
+         * 下一次 write 可能触发重新映射, 指针只在那之前有效
+         */
+        const char *view(fpos_t pos, size_t len) const {
+            if (type != PAGER_MMAP || pos + (fpos_t)len > mapSize) return nullptr;
+            return map + pos;
+        }
+
+        /*
+         * 文件截到 size 字节, 调用者保证截掉的部分不会再被读写 (cache 里也没有)
+         * mmap 模式的文件长度始终等于映射长度, 只按 EXTENT 收缩, 映射跟着缩小
+         */
+        fpos_t truncatedSize(fpos_t size) const {
+            return type == PAGER_MMAP ? std::max((size + EXTENT - 1) / EXTENT * EXTENT, (fpos_t)EXTENT) : size;
+        }
+
+        void truncate(fpos_t size) {
+            std::unique_lock<RemapLock> guard(remapLock, std::defer_lock);
+            if (shared) guard.lock();
+            if (type == PAGER_MMAP) {
+                fpos_t newSize = truncatedSize(size);
+                if (newSize >= mapSize) return;
+                void *newMap = mremap(map, mapSize, newSize, MREMAP_MAYMOVE);
+                if (newMap == MAP_FAILED) throw "pager mmap failed";
+                map = reinterpret_cast<char *>(newMap);
+                mapSize = newSize;
+                size = newSize;
+            }
+            if (ftruncate(fd, size) != 0) throw "pager truncate failed";
+        }
+
+        IoStats stats() const {
+            IoStats ret;
+            ret.reads = __atomic_load_n(&counter.reads, __ATOMIC_RELAXED);
+            ret.writes = __atomic_load_n(&counter.writes, __ATOMIC_RELAXED);
+            ret.bytesRead = __atomic_load_n(&counter.bytesRead, __ATOMIC_RELAXED);
+            ret.bytesWritten = __atomic_load_n(&counter.bytesWritten, __ATOMIC_RELAXED);
+            ret.syncs = __atomic_load_n(&counter.syncs, __ATOMIC_RELAXED);
+            return ret;
+        }
+
+        void resetStats() {
+            __atomic_store_n(&counter.reads, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&counter.writes, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&counter.bytesRead, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&counter.bytesWritten, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&counter.syncs, 0, __ATOMIC_RELAXED);
+        }
+
+        /*
+         * 落盘: mmap 模式 msync, 否则 fdatasync (O_DIRECT 也要, 文件长度等元数据和设备缓存还没落)
+         */
+        void sync() {
+            count(counter.syncs, 1);
+            if (type == PAGER_MMAP) {
+                RemapLock::SharedGuard guard(remapLock, shared);
+                msync(map, mapSize, MS_SYNC);
+            } else {
+                fdatasync(fd);
+            }
+        }
+    };
+}
+
+#endif //DS01_B_TREE_PAGER_HPP
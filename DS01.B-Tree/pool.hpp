@@ -0,0 +1,482 @@
+#ifndef DS01_B_TREE_POOL_HPP
+#define DS01_B_TREE_POOL_HPP
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <unordered_set>
+#include "cache.hpp"
+
+namespace Sirius {
+
+    /*
+     * 进程级的共享 buffer pool: 同一进程里开的所有树 (用 SharedPoolPolicy) 共用一个字节预算
+     * 页框按 (文件, 页) 编号, 全局一条 LRU, 谁冷淘汰谁, 热的树自然占到更多内存
+     * 各个文件的节点大小可以不同, 页框按文件的节点大小单独分配, 预算按字节算; 淘汰出来的同样大小的页框直接复用
+     *
+     * 别的文件的脏页不替它写回: 它的 WAL 钩子、mmap 映射只能在它自己的线程里动
+     * 轮到淘汰时是脏的就挂到它自己的待写回链上, 等它下一次用 pool 时自己写回淘汰; 期间可能暂时超出预算
+     * 一把锁管全部, 未命中的读盘也在锁里
+     */
+    class BufferPool {
+        typedef long long fpos_t;
+        static const int NIL = -1;
+        static const int POS_BITS = 48; //页表的 key 为 (文件编号 << 48) | 文件位置
+        static const int MAX_FILES = 1 << 14;
+
+        typedef void (*LoadFunc)(Pager &, fpos_t, char *);
+        typedef void (*StoreFunc)(Pager &, fpos_t, const char *);
+
+        struct Frame {
+            fpos_t pos;
+            int file; //NIL 为空闲页框
+            bool dirty, pending;
+            size_t bytes;
+            std::unique_ptr<char[]> data;
+
+            Frame(): pos(0), file(NIL), dirty(false), pending(false), bytes(0) {}
+        };
+
+        struct File {
+            Pager *pager;
+            size_t bytes; //这个文件的页框大小
+            bool raw; //页框和盘上字节一样, mmap 后端 peek 可以直接看映射
+            LoadFunc load;
+            StoreFunc store;
+            CacheStats counter;
+            IndexList pending; //轮到淘汰时是脏的页, 链接信息和 LRU 共用 link
+            bool tracking; //预热中, 记下 write / discard 过的位置, 见 LRUCache::warmTrack
+            std::unordered_set<fpos_t> touched;
+        };
+
+        mutable std::mutex lock;
+        size_t budget, used;
+        std::vector<Frame> frames;
+        std::vector<int> freeFrames;
+        std::vector<ListLink> link;
+        IndexList lru;
+        PageTable table;
+        std::vector<File> files;
+        std::vector<int> freeFiles;
+
+        static fpos_t keyOf(int file, fpos_t pos) {return ((fpos_t)file << POS_BITS) | pos;}
+
+        void writeBack(Frame &frame) {
+            File &owner = files[frame.file];
+            if (frame.dirty) {
+                owner.store(*owner.pager, frame.pos, frame.data.get());
+                frame.dirty = false;
+                owner.counter.writeBacks++;
+            } else {
+                owner.counter.writeBacksSkipped++;
+            }
+        }
+
+        /*
+         * 页框已经从 LRU 或待写回链上摘下, 写回 (调用者保证是自己的或干净的) 后还给空闲表
+         * keep 非空且还没留过时, 把同样大小的内存留给调用者复用
+         */
+        void release(int idx, std::unique_ptr<char[]> *keep = nullptr, size_t need = 0) {
+            Frame &frame = frames[idx];
+            File &owner = files[frame.file];
+            writeBack(frame);
+            if (keep != nullptr && !*keep && frame.bytes == need) *keep = std::move(frame.data);
+            table.erase(keyOf(frame.file, frame.pos));
+            owner.counter.evictions++;
+            owner.counter.resident--;
+            used -= frame.bytes;
+            frame.file = NIL;
+            frame.data.reset();
+            freeFrames.push_back(idx);
+        }
+
+        /*
+         * 从 LRU 尾淘汰到再放得下 need 字节为止; 淘汰出来的页框如果正好是 need 字节就留着复用
+         * file 为发起的文件, 它自己的脏页可以写回, 别人的脏页挂到别人的待写回链上
+         */
+        std::unique_ptr<char[]> makeRoom(int file, size_t need) {
+            std::unique_ptr<char[]> spare;
+            while (used + need > budget && lru.size() > 0) {
+                int victim = lru.back();
+                lru.unlink(link, victim);
+                Frame &frame = frames[victim];
+                if (frame.dirty && frame.file != file) {
+                    frame.pending = true;
+                    files[frame.file].pending.pushFront(link, victim);
+                    continue;
+                }
+                release(victim, &spare, need);
+            }
+            return spare;
+        }
+
+        /*
+         * 每次操作前先把自己待写回的页写回淘汰掉
+         */
+        void drain(int file) {
+            IndexList &pending = files[file].pending;
+            while (pending.size() > 0) {
+                int idx = pending.back();
+                pending.unlink(link, idx);
+                frames[idx].pending = false;
+                release(idx);
+            }
+        }
+
+        int lookup(int file, fpos_t pos) {
+            drain(file);
+            int idx = table.find(keyOf(file, pos));
+            if (idx != NIL) {
+                files[file].counter.hits++;
+                lru.moveToFront(link, idx);
+            }
+            return idx;
+        }
+
+        /*
+         * 未命中时取一个页框登记到页表, 放不下先淘汰
+         */
+        int grabFrame(int file, fpos_t pos) {
+            files[file].counter.misses++;
+            return place(file, pos, makeRoom(file, files[file].bytes));
+        }
+
+        /*
+         * 页框放到 LRU 头上并登记, data 为空时新开一块
+         */
+        int place(int file, fpos_t pos, std::unique_ptr<char[]> data) {
+            File &owner = files[file];
+            if (!data) data.reset(new char[owner.bytes]);
+            int idx;
+            if (freeFrames.empty()) {
+                idx = frames.size();
+                frames.emplace_back();
+                link.emplace_back();
+            } else {
+                idx = freeFrames.back();
+                freeFrames.pop_back();
+            }
+            Frame &frame = frames[idx];
+            frame.pos = pos, frame.file = file;
+            frame.dirty = false, frame.pending = false;
+            frame.bytes = owner.bytes;
+            frame.data = std::move(data);
+            used += owner.bytes;
+            owner.counter.resident++;
+            lru.pushFront(link, idx);
+            table.insert(keyOf(file, pos), idx);
+            return idx;
+        }
+
+    public:
+        explicit BufferPool(size_t _budget): budget(_budget), used(0), table(1024) {}
+
+        BufferPool(const BufferPool &) = delete;
+        BufferPool &operator=(const BufferPool &) = delete;
+
+        /*
+         * 进程里默认的那个 pool, 预算 64MiB, 运行时用 setBudget 改
+         */
+        static BufferPool &global() {
+            static BufferPool pool(64 << 20);
+            return pool;
+        }
+
+        /*
+         * 改预算, 变小时马上淘汰到预算以内 (别的文件的脏页除外, 它们下次访问时自己写回)
+         */
+        void setBudget(size_t bytes) {
+            std::lock_guard<std::mutex> guard(lock);
+            budget = bytes;
+            makeRoom(NIL, 0);
+        }
+
+        size_t budgetBytes() const {
+            std::lock_guard<std::mutex> guard(lock);
+            return budget;
+        }
+
+        size_t usedBytes() const {
+            std::lock_guard<std::mutex> guard(lock);
+            return used;
+        }
+
+        /*
+         * 登记一个文件, 返回它在 pool 里的编号; 页框 bytes 字节, 读写盘用 load / store
+         */
+        int attach(size_t bytes, bool raw, LoadFunc load, StoreFunc store) {
+            std::lock_guard<std::mutex> guard(lock);
+            int file;
+            if (freeFiles.empty()) {
+                if (files.size() >= (size_t)MAX_FILES) throw "too many files in buffer pool";
+                file = files.size();
+                files.emplace_back();
+            } else {
+                file = freeFiles.back();
+                freeFiles.pop_back();
+            }
+            File &entry = files[file];
+            entry.pager = nullptr;
+            entry.bytes = bytes, entry.raw = raw;
+            entry.load = load, entry.store = store;
+            entry.counter = CacheStats();
+            entry.tracking = false;
+            return file;
+        }
+
+        /*
+         * 文件关闭: 脏页写回, 页框全部还给 pool, 编号回收
+         */
+        void detach(int file) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (int idx = 0; idx < (int)frames.size(); ++idx) {
+                if (frames[idx].file != file) continue;
+                if (frames[idx].pending) {
+                    files[file].pending.unlink(link, idx);
+                    frames[idx].pending = false;
+                } else {
+                    lru.unlink(link, idx);
+                }
+                release(idx);
+            }
+            files[file].pager = nullptr;
+            files[file].tracking = false;
+            std::unordered_set<fpos_t>().swap(files[file].touched);
+            freeFiles.push_back(file);
+        }
+
+        void setPager(int file, Pager *pager) {
+            std::lock_guard<std::mutex> guard(lock);
+            files[file].pager = pager;
+        }
+
+        /*
+         * 这个文件的脏页全部写回, 页框仍留在 pool 里; 要扫一遍所有页框
+         */
+        void flush(int file) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (Frame &frame : frames) {
+                if (frame.file == file && frame.dirty) writeBack(frame);
+            }
+        }
+
+        template<class Func>
+        void forEachDirty(int file, Func func) const {
+            std::lock_guard<std::mutex> guard(lock);
+            for (const Frame &frame : frames) {
+                if (frame.file == file && frame.dirty) func(frame.pos);
+            }
+        }
+
+        void read(int file, fpos_t pos, void *out) {
+            std::lock_guard<std::mutex> guard(lock);
+            int idx = lookup(file, pos);
+            if (idx == NIL) {
+                idx = grabFrame(file, pos);
+                files[file].load(*files[file].pager, pos, frames[idx].data.get());
+            }
+            memcpy(out, frames[idx].data.get(), frames[idx].bytes);
+        }
+
+        /*
+         * 同 read, 但 mmap 后端未命中时不占页框, 直接返回映射里的指针; 否则拷到 out 里返回 out
+         */
+        const void *peek(int file, fpos_t pos, void *out) {
+            std::lock_guard<std::mutex> guard(lock);
+            File &owner = files[file];
+            int idx = lookup(file, pos);
+            if (idx == NIL) {
+                const char *mapped = owner.raw ? owner.pager->view(pos, owner.bytes) : nullptr;
+                if (mapped != nullptr) {
+                    owner.counter.mappedReads++;
+                    return mapped;
+                }
+                idx = grabFrame(file, pos);
+                owner.load(*owner.pager, pos, frames[idx].data.get());
+            }
+            memcpy(out, frames[idx].data.get(), frames[idx].bytes);
+            return out;
+        }
+
+        void write(int file, fpos_t pos, const void *in) {
+            std::lock_guard<std::mutex> guard(lock);
+            int idx = lookup(file, pos);
+            if (idx == NIL) idx = grabFrame(file, pos);
+            memcpy(frames[idx].data.get(), in, frames[idx].bytes);
+            frames[idx].dirty = true;
+            if (files[file].tracking) files[file].touched.insert(pos);
+        }
+
+        void discard(int file, fpos_t pos, const void *raw, size_t len) {
+            std::lock_guard<std::mutex> guard(lock);
+            File &owner = files[file];
+            if (raw != nullptr) {
+                owner.pager->write(pos, raw, len);
+                owner.counter.directWrites++;
+            }
+            if (owner.tracking) owner.touched.insert(pos);
+            int idx = table.find(keyOf(file, pos));
+            if (idx == NIL) return;
+            Frame &frame = frames[idx];
+            if (frame.pending) owner.pending.unlink(link, idx);
+            else lru.unlink(link, idx);
+            frame.dirty = frame.pending = false;
+            table.erase(keyOf(file, pos));
+            owner.counter.resident--;
+            used -= frame.bytes;
+            frame.file = NIL;
+            frame.data.reset();
+            freeFrames.push_back(idx);
+        }
+
+        void warmTrack(int file, bool on) {
+            std::lock_guard<std::mutex> guard(lock);
+            files[file].tracking = on;
+            if (!on) std::unordered_set<fpos_t>().swap(files[file].touched);
+        }
+
+        /*
+         * 预热读到的一页 (已解码成页框的样子) 装进来, 只在预算还放得下时装, 不淘汰别的页
+         */
+        bool warm(int file, fpos_t pos, const void *in) {
+            std::lock_guard<std::mutex> guard(lock);
+            File &owner = files[file];
+            if (used + owner.bytes > budget || table.find(keyOf(file, pos)) != NIL || owner.touched.count(pos)) return false;
+            int idx = place(file, pos, nullptr);
+            memcpy(frames[idx].data.get(), in, owner.bytes);
+            owner.counter.prefetched++;
+            return true;
+        }
+
+        //这个文件在 LRU 上的页, 从热到冷 (待写回的不算)
+        template<class Func>
+        void forEachResident(int file, Func func) const {
+            std::lock_guard<std::mutex> guard(lock);
+            for (int idx = lru.front(); idx != NIL; idx = link[idx].nxt) {
+                if (frames[idx].file == file) func(frames[idx].pos);
+            }
+        }
+
+        CacheStats stats(int file) const {
+            std::lock_guard<std::mutex> guard(lock);
+            return files[file].counter;
+        }
+
+        void resetStats(int file) {
+            std::lock_guard<std::mutex> guard(lock);
+            size_t resident = files[file].counter.resident;
+            files[file].counter = CacheStats();
+            files[file].counter.resident = resident;
+        }
+
+        void display() const {
+            std::lock_guard<std::mutex> guard(lock);
+            std::cout << "* Buffer Pool *\n";
+            std::cout << "budget: " << budget << " used: " << used << " frames: " << frames.size() - freeFrames.size() << '\n';
+            for (int file = 0; file < (int)files.size(); ++file) {
+                const CacheStats &counter = files[file].counter;
+                if (files[file].pager == nullptr) continue;
+                std::cout << "[File " << file << "] frames: " << counter.resident << " (" << files[file].bytes << " bytes each)"
+                          << " hit rate: " << counter.hitRate() << " pending: " << files[file].pending.size() << '\n';
+            }
+        }
+    };
+
+    /*
+     * 树的 CachePolicy 选它时, 节点 cache 不再是私有的 LRUCache, 而是进程共享的 BufferPool::global()
+     * 只是个标记, 本身不是替换策略; pool 里统一按 LRU 淘汰
+     */
+    struct SharedPoolPolicy {
+        static const char *name() {return "shared pool";}
+    };
+
+    /*
+     * BufferPool 上的一个文件, 接口同 LRUCache, 树里直接当 Cache 用
+     * peek 拷到自己的 scratch 里: pool 里的页框随时可能被别的树换掉, 不能把页框指针交出去
+     */
+    template <class Val, class Codec = RawCodec<Val> >
+    class PooledCache {
+        typedef long long fpos_t;
+
+        BufferPool *pool;
+        int file;
+        Val scratch;
+        WarmLoader *warmer; //只在构造、析构树时改
+
+        //预热读好的页解码后交给 pool, 同 ShardedCache 可以多个线程一起装
+        void warmDrain() {
+            if (warmer == nullptr || !warmer->pending()) return;
+            std::unique_ptr<Val> val(new Val);
+            warmer->take([&](fpos_t pos, const char *page) {
+                Codec::decode(page, *val);
+                pool->warm(file, pos, val.get());
+            });
+            if (warmer->finish()) pool->warmTrack(file, false);
+        }
+
+        static void load(Pager &pager, fpos_t pos, char *frame) {Codec::load(pager, pos, *reinterpret_cast<Val *>(frame));}
+
+        static void store(Pager &pager, fpos_t pos, const char *frame) {
+            Codec::store(pager, pos, *reinterpret_cast<const Val *>(frame));
+        }
+
+    public:
+        explicit PooledCache(BufferPool &_pool = BufferPool::global()):
+                pool(&_pool), file(_pool.attach(sizeof(Val), Codec::RAW, load, store)), warmer(nullptr) {}
+
+        PooledCache(const PooledCache &) = delete;
+        PooledCache &operator=(const PooledCache &) = delete;
+
+        ~PooledCache() {
+            pool->detach(file);
+        }
+
+        void setPager(Pager *_pager) {pool->setPager(file, _pager);}
+
+        void flush() {pool->flush(file);}
+
+        template<class Func>
+        void forEachDirty(Func func) const {pool->forEachDirty(file, func);}
+
+        void read(fpos_t diskPos, Val &val) {
+            if (diskPos < 0) return; //invalid pos
+            warmDrain();
+            pool->read(file, diskPos, &val);
+        }
+
+        //指针只在下一次调用这个 cache 之前有效
+        const Val *peek(fpos_t diskPos) {
+            warmDrain();
+            return reinterpret_cast<const Val *>(pool->peek(file, diskPos, &scratch));
+        }
+
+        void write(fpos_t diskPos, const Val &val) {
+            if (diskPos < 0) return; //invalid pos
+            warmDrain();
+            pool->write(file, diskPos, &val);
+        }
+
+        void discard(fpos_t diskPos, const void *raw = nullptr, size_t len = 0) {pool->discard(file, diskPos, raw, len);}
+
+        void warmFrom(WarmLoader *loader) {
+            warmer = loader;
+            pool->warmTrack(file, loader != nullptr);
+        }
+
+        template<class Func>
+        void forEachResident(Func func) const {pool->forEachResident(file, func);}
+
+        //pool 不用后台写回: 别的树的脏页本来就不在淘汰它的线程里写
+        void flushWith(Flusher *, double = 1) {}
+
+        CacheStats stats() const {return pool->stats(file);}
+
+        void resetStats() {pool->resetStats(file);}
+
+        void display() {pool->display();}
+    };
+}
+
+#endif //DS01_B_TREE_POOL_HPP
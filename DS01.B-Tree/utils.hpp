@@ -6,11 +6,20 @@
 #define DS01_B_TREE_UTILS_HPP
 
 #include "BTree.hpp"
+#include "vlog.hpp"
+#include "betree.hpp"
+#include "hashindex.hpp"
 #include <iostream>
 #include <cstdlib>
+#include <climits>
 #include <string>
 #include <map>
+#include <set>
 #include <ctime>
+#include <sys/wait.h>
+#include <atomic>
+#include <thread>
+#include <random>
 
 #define INS(_x) btree.insert(_x, _x);
 
@@ -22,8 +31,15 @@ inline int randInt(int l, int r) {
     return rand()%(r-l+1)+l;
 }
 
+//从 st 到现在的墙钟秒数
+double elapsed(const struct timespec &st) {
+    struct timespec ed;
+    clock_gettime(CLOCK_MONOTONIC, &ed);
+    return (ed.tv_sec - st.tv_sec) + (ed.tv_nsec - st.tv_nsec) / 1e9;
+}
+
 void cache_write_test() {
-    FILE *file = fopen("test.db", "rb+");
+    int file = open("test.db", O_RDWR | O_CREAT, 0644);
     Sirius::LRUCache<int, 5> cache;
     cache.setFile(file);
 
@@ -39,7 +55,7 @@ void cache_write_test() {
 }
 
 void cache_read_test() {
-    FILE *file = fopen("test.db", "rb+");
+    int file = open("test.db", O_RDWR | O_CREAT, 0644);
     Sirius::LRUCache<int, 5> cache;
     cache.setFile(file);
 
@@ -194,4 +210,1295 @@ void string_test() {
     btree.display();
 }
 
+void scan_test() {
+    Sirius::BTree<int, int, 5, Sirius::OrderedKey<int> > btree("data.db");
+    std::map<int, int> std_map;
+
+    for (int i = 1; i <= 30000; i++) {
+        int key = randInt(-100000, 100000);
+        bool inserted = btree.insert(key, i);
+        assert(inserted == std_map.insert(std::make_pair(key, i)).second);
+    }
+
+    auto it = std_map.begin();
+    for (auto cursor = btree.begin(); cursor.valid(); cursor.next(), it++) {
+        assert(it != std_map.end() && cursor.key() == it->first && cursor.val() == it->second);
+    }
+    assert(it == std_map.end());
+
+    //从最后一个往回走到头, 和正向反过来一致
+    auto rit = std_map.rbegin();
+    for (auto cursor = btree.lowerBound(std_map.rbegin()->first); cursor.valid(); cursor.prev(), rit++) {
+        assert(rit != std_map.rend() && cursor.key() == rit->first && cursor.val() == rit->second);
+    }
+    assert(rit == std_map.rend());
+
+    //从 lowerBound 的位置往回走一段, 再走回来
+    for (int i = 1; i <= 1000; i++) {
+        int lo = randInt(-100000, 100000), steps = randInt(0, 200);
+        auto cursor = btree.lowerBound(lo);
+        auto expect = std_map.lower_bound(lo);
+        assert(cursor.valid() == (expect != std_map.end()));
+        if (!cursor.valid()) continue;
+        int back = 0;
+        for (; back < steps && expect != std_map.begin(); back++) {
+            assert(cursor.prev());
+            expect--;
+            assert(cursor.key() == expect->first && cursor.val() == expect->second);
+        }
+        if (expect == std_map.begin()) {
+            auto first = cursor;
+            assert(!first.prev());
+        }
+        for (; back > 0; back--) {
+            assert(cursor.next());
+            expect++;
+            assert(cursor.key() == expect->first);
+        }
+    }
+
+    for (int i = 1; i <= 1000; i++) {
+        int lo = randInt(-100000, 100000), hi = lo + randInt(0, 1000);
+        auto expect = std_map.lower_bound(lo);
+        btree.scan(lo, hi, [&](int key, int) {
+            assert(expect != std_map.end() && expect->first == key);
+            expect++;
+        });
+        assert(expect == std_map.end() || expect->first > hi);
+    }
+    std::cout << "scan test passed\n";
+}
+
+template<class Policy>
+void policy_run() {
+    remove("data.db");
+    Sirius::BTree<int, int, 5, Sirius::OrderedKey<int>, Policy> btree("data.db");
+    const int TOTAL = 200000, HOT = TOTAL / 20;
+    srand(2021);
+    for (int i = 1; i <= TOTAL; i++) INS(i)
+
+    //点查九成落在热点区间, 每两万次点查插一次大范围扫描
+    Sirius::CacheStats before = btree.cacheStats();
+    int result;
+    for (int i = 1; i <= 200000; i++) {
+        if (randInt(1, 10) <= 9) btree.find(randInt(1, HOT), result);
+        else btree.find(randInt(1, TOTAL), result);
+        if (i % 20000 == 0) {
+            int lo = randInt(1, TOTAL / 2);
+            btree.scan(lo, lo + TOTAL / 4, [](int, int) {});
+        }
+    }
+    Sirius::CacheStats after = btree.cacheStats();
+    size_t hits = after.hits - before.hits, misses = after.misses - before.misses;
+    printf("%-6s hit rate: %.4lf evictions: %lu\n", Policy::name(),
+           (double)hits / (hits + misses), after.evictions - before.evictions);
+}
+
+void policy_test() {
+    policy_run<Sirius::LRUPolicy>();
+    policy_run<Sirius::ClockPolicy>();
+    policy_run<Sirius::TwoQPolicy>();
+    policy_run<Sirius::ARCPolicy>();
+}
+
+void pager_run(Sirius::PagerType pagerType, const char *name) {
+    remove("data.db");
+    Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db", pagerType);
+    const int TOTAL = 1000000;
+    srand(2021);
+
+    CLOCKINIT()
+    printf("[%s]\n", name);
+    STANDINGBY()
+    for (int i = 1; i <= TOTAL; i++) {
+        int key = randInt(1, TOTAL * 10);
+        btree.insert(key, key);
+    }
+    COMPLETE("insert")
+
+    int result;
+    STANDINGBY()
+    for (int i = 1; i <= TOTAL; i++) btree.find(randInt(1, TOTAL * 10), result);
+    COMPLETE("find")
+
+    STANDINGBY()
+    btree.sync();
+    COMPLETE("sync")
+}
+
+void pager_test() {
+    pager_run(Sirius::PAGER_PIO, "pread/pwrite");
+    pager_run(Sirius::PAGER_MMAP, "mmap");
+}
+
+/*
+ * 阶数对比: 百万随机 int 插入后随机点查, 计墙钟时间 (O_DIRECT 的时间花在等盘上, clock() 看不出来)
+ */
+template<int M>
+void fanout_run(Sirius::PagerType pagerType, const char *name) {
+    const int TOTAL = 1000000;
+    srand(2021);
+    remove("data.db");
+    Sirius::BTree<int, int, M, Sirius::OrderedKey<int> > btree("data.db", pagerType);
+    struct timespec st;
+
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 1; i <= TOTAL; i++) {
+        int x = randInt(1, TOTAL * 10);
+        INS(x)
+    }
+    btree.sync();
+    double insertSec = elapsed(st);
+
+    int result;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 1; i <= TOTAL; i++) btree.find(randInt(1, TOTAL * 10), result);
+    double findSec = elapsed(st);
+
+    printf("%s (M = %d): insert %.6lfs, find %.6lfs, miss rate %.4lf\n", name, M, insertSec, findSec,
+           1 - btree.cacheStats().hitRate());
+}
+
+void fanout_test() {
+    fanout_run<4>(Sirius::PAGER_PIO, "default");
+    fanout_run<64>(Sirius::PAGER_PIO, "fixed");
+    fanout_run<Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value>(Sirius::PAGER_PIO, "4KiB page");
+    fanout_run<Sirius::PageFanout<int, int, 16384, Sirius::OrderedKey<int> >::value>(Sirius::PAGER_PIO, "16KiB page");
+    fanout_run<Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value>(Sirius::PAGER_DIRECT, "4KiB page, O_DIRECT");
+}
+
+/*
+ * 节点内查找对比: 16MiB 的 key 切成一个个大小为 n 的有序节点, 随机挑节点随机查, 每次查询平均 ns
+ * 每种内核的结果都和 std::lower_bound 核对
+ * 三列都经过 NodeSearch (SEARCH_SCALAR 即 std::lower_bound), 小节点上三列走的是同一条路, 应该一样快
+ * 各内核轮流跑 ROUNDS 轮, 取中位数: 机器抖动对每种内核的影响差不多, 单次的快慢不算数
+ */
+template<class T>
+void search_run(const char *name) {
+    const int QUERIES = 1000000, ROUNDS = 21;
+    const long long TOTAL = (16 << 20) / sizeof(T);
+    std::mt19937_64 rng(2021);
+    std::vector<T> keys(TOTAL);
+    for (T &key : keys) key = (T)rng();
+
+    printf("[%s]\n%6s %12s %12s %12s\n", name, "n", "lower_bound", "sse", "avx2");
+    for (int n = 4; n <= 1024; n *= 2) {
+        long long nodes = TOTAL / n;
+        for (long long b = 0; b < nodes; ++b) std::sort(keys.begin() + b * n, keys.begin() + (b + 1) * n);
+        std::vector<long long> node(QUERIES);
+        std::vector<T> query(QUERIES);
+        std::vector<int> expect(QUERIES), got(QUERIES);
+        for (int q = 0; q < QUERIES; ++q) {
+            node[q] = rng() % nodes * n;
+            query[q] = rng() % 2 ? keys[node[q] + rng() % n] : (T)rng();
+        }
+
+        std::vector<double> ns[Sirius::SEARCH_AVX2 + 1];
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int level = Sirius::SEARCH_SCALAR; level <= Sirius::SEARCH_AVX2; ++level) {
+                struct timespec st;
+                clock_gettime(CLOCK_MONOTONIC, &st);
+                for (int q = 0; q < QUERIES; ++q) {
+                    const T *key = keys.data() + node[q];
+                    got[q] = Sirius::NodeSearch<T>::lowerBound(key, n, query[q], (Sirius::SearchLevel)level);
+                }
+                ns[level].push_back(elapsed(st) * 1e9 / QUERIES);
+                if (level == Sirius::SEARCH_SCALAR) expect = got;
+                else assert(got == expect);
+            }
+        }
+        printf("%6d", n);
+        for (std::vector<double> &v : ns) {
+            std::nth_element(v.begin(), v.begin() + ROUNDS / 2, v.end());
+            printf(" %12.2lf", v[ROUNDS / 2]);
+        }
+        printf("\n");
+    }
+}
+
+void search_test() {
+    search_run<int>("int32");
+    search_run<unsigned long long>("uint64");
+}
+
+/*
+ * 字符串 key 的存法对比: 五十万个带公共前缀、长度不一的 key (类似 URL), 随机插入后点查, 同步后看文件大小
+ * 定长 key 每个都占满 64 字节; 变长 key 按槽页存, 同一节点的公共前缀只存一次
+ */
+std::string urlKey(std::mt19937 &rng) {
+    static const char *host[] = {"https://github.com/", "https://github.com/SiriusNEO/", "https://acm.sjtu.edu.cn/OnlineJudge/problem/"};
+    std::string ret = host[rng() % 3] + std::to_string(rng() % 100000000);
+    return ret + std::string(rng() % 12, '/');
+}
+
+template<class KeyPolicy, int M>
+void varkey_run(const char *name) {
+    const int TOTAL = 500000;
+    std::mt19937 rng(2021);
+    std::map<std::string, int> std_map;
+    for (int i = 1; i <= TOTAL; i++) std_map[urlKey(rng)] = i;
+    std::vector<std::pair<std::string, int> > kvs(std_map.begin(), std_map.end());
+    std::shuffle(kvs.begin(), kvs.end(), rng);
+
+    remove("data.db");
+    Sirius::BTree<std::string, int, M, KeyPolicy> btree("data.db");
+    struct timespec st;
+
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (auto &kv : kvs) btree.insert(kv.first, kv.second);
+    btree.sync();
+    double insertSec = elapsed(st);
+
+    int lost = 0; //哈希冲突被拒绝插入的 key
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (auto &kv : kvs) {
+        int result = -1;
+        bool found = btree.find(kv.first, result) && result == kv.second;
+        assert(found || !KeyPolicy::ORDERED);
+        lost += !found;
+    }
+    double findSec = elapsed(st);
+
+    struct stat fileStat;
+    stat("data.db", &fileStat);
+    printf("%s (M = %d): insert %.6lfs, find %.6lfs, file %.1lfMiB, lost %d\n", name, M, insertSec, findSec,
+           fileStat.st_size / 1048576.0, lost);
+}
+
+void varkey_test() {
+    typedef Sirius::FixedStringKey<64> Fixed;
+    typedef Sirius::VarStringKey<64> Var;
+    varkey_run<Sirius::HashKey<std::string>, Sirius::PageFanout<std::string, int, 4096>::value>("hash (unordered)");
+    varkey_run<Fixed, Sirius::PageFanout<std::string, int, 4096, Fixed>::value>("fixed 64 bytes");
+    varkey_run<Var, Sirius::PageFanout<std::string, int, 4096, Var>::value>("variable, prefix compressed");
+}
+
+/*
+ * K-V 分离对比: 二十万个 int key, 值 512 字节, 随机插入、点查, 再把每个值改一遍后回收, 墙钟时间
+ * 值放在节点里时一页只放得下 6 个, 分离后树只存 16 字节的指针
+ * 分离的树在插入、改写、回收之后以及重开后都核对 find 拿到的是最新的值
+ */
+struct Blob512 {
+    char data[512];
+};
+
+long long fileBytes(const char *fileName) {
+    struct stat fileStat;
+    return stat(fileName, &fileStat) == 0 ? fileStat.st_blocks * 512 : 0;
+}
+
+//分离时的值: key 加版本号补到 512 字节, 指针指错或拿到旧值都看得出来
+std::string vlogValue(int key, char version) {
+    std::string val = std::to_string(key) + ':';
+    return val + std::string(512 - val.size(), version);
+}
+
+void vlog_test() {
+    const int TOTAL = 200000;
+    std::vector<int> keys(TOTAL);
+    for (int i = 0; i < TOTAL; i++) keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(2021));
+    Blob512 blob;
+    memset(blob.data, 'v', sizeof(blob.data));
+    struct timespec st;
+
+    remove("data.db");
+    {
+        const int M = Sirius::PageFanout<int, Blob512, 4096, Sirius::OrderedKey<int> >::value;
+        Sirius::BTree<int, Blob512, M, Sirius::OrderedKey<int> > btree("data.db");
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        for (int key : keys) btree.insert(key, blob);
+        btree.sync();
+        double insertSec = elapsed(st);
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        Blob512 result;
+        for (int key : keys) btree.find(key, result);
+        printf("inline (M = %d): insert %.6lfs, find %.6lfs, file %.1lfMiB\n", M, insertSec, elapsed(st),
+               fileBytes("data.db") / 1048576.0);
+    }
+    remove("data.db");
+    remove("data.db.vlog");
+    {
+        Sirius::SeparatedBTree<int, std::string, 0, Sirius::OrderedKey<int> > btree("data.db");
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        for (int key : keys) btree.insert(key, vlogValue(key, 'v'));
+        btree.sync();
+        double insertSec = elapsed(st);
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        std::string result;
+        for (int key : keys) {
+            bool found = btree.find(key, result);
+            assert(found && result == vlogValue(key, 'v'));
+        }
+        printf("separated: insert %.6lfs, find %.6lfs, tree %.1lfMiB, log %.1lfMiB\n", insertSec, elapsed(st),
+               fileBytes("data.db") / 1048576.0, btree.logDiskBytes() / 1048576.0);
+
+        for (int key : keys) btree.modify(key, vlogValue(key, 'w'));
+        btree.sync();
+        for (int key : keys) {
+            bool found = btree.find(key, result);
+            assert(found && result == vlogValue(key, 'w'));
+        }
+        printf("after modify all: log %.1lfMiB, garbage %.3lf\n", btree.logDiskBytes() / 1048576.0, btree.garbageRatio());
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        long long reclaimed = btree.gc(btree.logBytes() / 2);
+        printf("gc: reclaimed %.1lfMiB in %.6lfs, log %.1lfMiB, garbage %.3lf\n", reclaimed / 1048576.0, elapsed(st),
+               btree.logDiskBytes() / 1048576.0, btree.garbageRatio());
+        assert(reclaimed > 0);
+        for (int key : keys) {
+            bool found = btree.find(key, result);
+            assert(found && result == vlogValue(key, 'w'));
+        }
+    }
+    {
+        Sirius::SeparatedBTree<int, std::string, 0, Sirius::OrderedKey<int> > btree("data.db");
+        std::string result;
+        for (int key : keys) {
+            bool found = btree.find(key, result);
+            assert(found && result == vlogValue(key, 'w'));
+        }
+    }
+    std::cout << "vlog test passed\n";
+}
+
+void bulk_test() {
+    const int TOTAL = 1000000;
+    std::vector<std::pair<int, int> > sorted;
+    for (int i = 1; i <= TOTAL; i++) sorted.push_back(std::make_pair(i, i));
+
+    CLOCKINIT()
+    remove("data.db");
+    {
+        Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db");
+        STANDINGBY()
+        for (int i = 1; i <= TOTAL; i++) INS(i)
+        COMPLETE("insert one by one")
+    }
+    remove("data.db");
+    {
+        Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db");
+        STANDINGBY()
+        btree.bulkLoad(sorted.begin(), sorted.end());
+        COMPLETE("bulkLoad")
+
+        int result;
+        for (int i = 1; i <= TOTAL; i++) {
+            assert(btree.find(i, result) && result == i);
+        }
+    }
+    std::cout << "bulk test passed\n";
+}
+
+void batch_test() {
+    const int TOTAL = 200000, BATCH = 1000;
+    std::map<int, int> mp;
+
+    CLOCKINIT()
+    remove("data.db");
+    {
+        Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db");
+        STANDINGBY()
+        for (int b = 0; b < TOTAL / BATCH; b++) {
+            std::vector<std::pair<int, int> > kvs;
+            for (int i = 0; i < BATCH; i++) {
+                int x = randInt(1, TOTAL * 4);
+                kvs.push_back(std::make_pair(x, i));
+                mp.insert(std::make_pair(x, i)); //批内重复的 key 留第一个, 同 std::map
+            }
+            btree.insertBatch(kvs);
+        }
+        COMPLETE("insertBatch")
+        assert(btree.size() == mp.size());
+
+        std::vector<int> keys;
+        for (int i = 1; i <= TOTAL * 4; i++) keys.push_back(i);
+        std::random_shuffle(keys.begin(), keys.end());
+        std::vector<int> vals;
+        std::vector<bool> found;
+        STANDINGBY()
+        btree.findBatch(keys, vals, found);
+        COMPLETE("findBatch")
+        for (size_t i = 0; i < keys.size(); i++) {
+            auto it = mp.find(keys[i]);
+            assert(found[i] == (it != mp.end()));
+            assert(!found[i] || vals[i] == it->second);
+        }
+
+        STANDINGBY()
+        for (size_t i = 0; i < keys.size(); i += BATCH) {
+            std::vector<int> dels(keys.begin() + i, keys.begin() + std::min(keys.size(), i + BATCH / 2));
+            btree.delBatch(dels);
+            for (int x : dels) mp.erase(x);
+        }
+        COMPLETE("delBatch")
+        assert(btree.size() == mp.size());
+        for (auto &kv : mp) {
+            int result;
+            assert(btree.find(kv.first, result) && result == kv.second);
+        }
+    }
+    std::cout << "batch test passed\n";
+}
+
+/*
+ * WAL 吞吐: 不开 WAL / 每条都 fsync / 组提交, 同样的随机插入
+ */
+void wal_run(int walGroup, const char *name) {
+    const int TOTAL = 100000;
+    srand(2021);
+    remove("data.db");
+    remove("data.db.wal");
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    {
+        Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db", Sirius::PAGER_PIO, walGroup);
+        for (int i = 1; i <= TOTAL; i++) {
+            int x = randInt(1, TOTAL * 10);
+            INS(x)
+        }
+        btree.commit();
+    }
+    double sec = elapsed(st);
+    printf("%s: %.6lfs, %.0lf ops/s\n", name, sec, TOTAL / sec);
+}
+
+/*
+ * WAL 崩溃恢复: 子进程里先插十万个 key 做检查点, 再随机插删改两万次并 commit, 然后不提交地再插十万个新 key、改写前面的值
+ * 后一批会把 cache 挤满, 检查点之前就有的页被淘汰写回数据文件 (要靠前像退回); 写到一半直接 _exit, 不析构
+ * 父进程重开树: commit 过的都在且值对, 没提交的一个都没有
+ */
+void wal_crash_test() {
+    const int TOTAL = 100000, OPS = 20000;
+    const int GROUP = 1 << 30; //不自动提交, 只有显式 commit
+    typedef Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > Tree;
+    std::mt19937 rng(2021);
+    std::map<int, int> committed;
+    for (int i = 1; i <= TOTAL; i++) committed[rng() % (TOTAL * 10) + 1] = i;
+    std::vector<int> keys;
+    for (auto &kv : committed) keys.push_back(kv.first);
+    std::vector<std::pair<int, int> > ops; //second > 0 插入或改成 second, 否则删
+    for (int i = 0; i < OPS; i++) {
+        int x = rng() % 3 == 0 ? keys[rng() % keys.size()] : (int)(rng() % (TOTAL * 10)) + 1;
+        ops.push_back(std::make_pair(x, rng() % 2 ? TOTAL + i + 1 : 0));
+    }
+    remove("data.db");
+    remove("data.db.wal");
+    pid_t pid = fork();
+    if (pid == 0) {
+        Tree *btree = new Tree("data.db", Sirius::PAGER_PIO, GROUP);
+        for (auto &kv : committed) btree->insert(kv.first, kv.second);
+        btree->sync();
+        for (auto &op : ops) {
+            if (op.second == 0) btree->del(op.first);
+            else if (!btree->insert(op.first, op.second)) btree->modify(op.first, op.second);
+        }
+        btree->commit();
+        for (int i = 1; i <= TOTAL; i++) {
+            btree->insert(TOTAL * 10 + i, i);
+            btree->modify(keys[rng() % keys.size()], -i);
+        }
+        _exit(0); //崩溃: 不提交, 不写回, 不析构
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    for (auto &op : ops) {
+        if (op.second == 0) committed.erase(op.first);
+        else committed[op.first] = op.second;
+    }
+    {
+        Tree btree("data.db", Sirius::PAGER_PIO, GROUP);
+        assert(btree.size() == committed.size());
+        for (auto &kv : committed) {
+            int result;
+            bool found = btree.find(kv.first, result);
+            assert(found && result == kv.second);
+        }
+        for (int i = 1; i <= TOTAL; i++) {
+            int result;
+            assert(!btree.find(TOTAL * 10 + i, result));
+        }
+    }
+    remove("data.db");
+    remove("data.db.wal");
+    std::cout << "wal crash test passed\n";
+}
+
+void wal_test() {
+    wal_crash_test();
+    wal_run(0, "no wal");
+    wal_run(1, "wal, group 1");
+    wal_run(16, "wal, group 16");
+    wal_run(256, "wal, group 256");
+}
+
+/*
+ * 多线程吞吐 (编译加 -pthread): 百万 key 的树上 threads 个读者各自随机查询, 同时 writers 个写者随机插删 (key 和读者的不重叠)
+ * 没有读者时每个写者做 WRITES / writers 次, 只看写的吞吐
+ */
+template<class Tree>
+void concurrent_run(Tree &btree, int threads, int writers, const char *name) {
+    const int TOTAL = 1000000, QUERY = 2000000, WRITES = 400000;
+    std::atomic<bool> stop(false);
+    std::atomic<long long> writes(0);
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    std::vector<std::thread> writerThreads, readers;
+    for (int w = 0; w < writers; w++) {
+        writerThreads.emplace_back([&, w] {
+            std::mt19937 rng(2021 + w);
+            for (int i = 0; threads == 0 ? i < WRITES / writers : !stop.load(); i++) {
+                int x = rng() % TOTAL + TOTAL + 1;
+                if (rng() % 2) btree.insert(x, x);
+                else btree.del(x);
+                writes++;
+            }
+        });
+    }
+    for (int t = 0; t < threads; t++) {
+        readers.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            int result;
+            for (int i = 0; i < QUERY / threads; i++) {
+                int x = rng() % TOTAL + 1;
+                bool found = btree.find(x, result);
+                assert(found && result == x);
+            }
+        });
+    }
+    for (std::thread &reader : readers) reader.join();
+    stop = true;
+    for (std::thread &writer : writerThreads) writer.join();
+    double sec = elapsed(st);
+    printf("%s, %d readers + %d writers: %.6lfs, %.0lf finds/s, %.0lf writes/s\n", name, threads, writers, sec,
+           threads == 0 ? 0 : QUERY / sec, writes.load() / sec);
+}
+
+void concurrent_test() {
+    const int TOTAL = 1000000;
+    std::vector<std::pair<int, int> > sorted;
+    for (int i = 1; i <= TOTAL; i++) sorted.push_back(std::make_pair(i, i));
+    remove("data.db");
+    {
+        Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db");
+        btree.bulkLoad(sorted.begin(), sorted.end());
+        concurrent_run(btree, 1, 0, "single-threaded tree");
+        concurrent_run(btree, 0, 1, "single-threaded tree");
+    }
+    remove("data.db");
+    {
+        Sirius::BTree<int, int, 64, Sirius::OrderedKey<int>, Sirius::LRUPolicy, true> btree("data.db");
+        btree.bulkLoad(sorted.begin(), sorted.end());
+        for (int threads : {1, 2, 4, 8}) concurrent_run(btree, threads, 0, "concurrent tree");
+        for (int writers : {1, 4}) concurrent_run(btree, 0, writers, "concurrent tree");
+        for (int writers : {1, 4}) concurrent_run(btree, 4, writers, "concurrent tree");
+    }
+}
+
+/*
+ * 在线整理: 五十万个 int 随机插入后随机删掉八成, 再每次搬 64 页直到紧凑, 看文件大小和每一步的耗时
+ * 整理完和重开后都和 std::map 核对: 留下的都能找到且值对, 删掉的都找不到, 从头扫一遍也一致 (搬过的页父亲指针改对了); 文件要变小
+ */
+template<class Tree>
+void compact_check(Tree &btree, const std::vector<int> &keys, const std::map<int, int> &std_map) {
+    assert(btree.size() == std_map.size());
+    for (int key : keys) {
+        int result;
+        auto it = std_map.find(key);
+        bool found = btree.find(key, result);
+        assert(found == (it != std_map.end()));
+        assert(!found || result == it->second);
+    }
+    auto expect = std_map.begin();
+    btree.scan(INT_MIN, INT_MAX, [&](int key, int val) {
+        assert(expect != std_map.end() && expect->first == key && expect->second == val);
+        expect++;
+    });
+    assert(expect == std_map.end());
+}
+
+void compact_test() {
+    const int TOTAL = 500000;
+    const int M = Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value;
+    std::vector<int> keys(TOTAL);
+    for (int i = 0; i < TOTAL; i++) keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(2021));
+    typedef Sirius::BTree<int, int, M, Sirius::OrderedKey<int> > Tree;
+    std::map<int, int> std_map;
+    remove("data.db");
+    {
+        Tree btree("data.db");
+        for (int key : keys) {
+            btree.insert(key, TOTAL - key);
+            std_map[key] = TOTAL - key;
+        }
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(2022));
+        for (int i = 0; i < TOTAL / 5 * 4; i++) {
+            btree.del(keys[i]);
+            std_map.erase(keys[i]);
+        }
+        btree.sync();
+        long long before = fileBytes("data.db");
+        printf("after deletes: %zu keys, file %.1lfMiB\n", btree.size(), before / 1048576.0);
+
+        struct timespec st, step;
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        size_t steps = 0, moved = 0, stepMoved;
+        double maxStep = 0;
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &step);
+            stepMoved = btree.compact(64);
+            maxStep = std::max(maxStep, elapsed(step));
+            moved += stepMoved, steps++;
+        } while (stepMoved > 0);
+        printf("compact (M = %d): %zu pages in %zu steps, %.6lfs, longest step %.6lfs, file %.1lfMiB\n", M, moved, steps,
+               elapsed(st), maxStep, fileBytes("data.db") / 1048576.0);
+        assert(moved > 0 && fileBytes("data.db") < before);
+        compact_check(btree, keys, std_map);
+    }
+    Tree btree("data.db");
+    compact_check(btree, keys, std_map);
+    std::cout << "compact test passed\n";
+}
+
+/*
+ * 计数: 五十万个 int 随机插入, 清零后再随机点查五十万次, 分别打出 cache 与读写计数
+ * 插入后该有的计数都不为 0, 清零后除了 resident 全是 0, 点查只读不写
+ */
+void stats_print(const char *name, const Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> >::Stats &stats) {
+    printf("%s: hit rate %.4lf, evictions %lu, write backs %lu (skipped %lu), direct writes %lu\n", name,
+           stats.cache.hitRate(), stats.cache.evictions, stats.cache.writeBacks, stats.cache.writeBacksSkipped,
+           stats.cache.directWrites);
+    printf("%s: %lu reads (%.1lfMiB), %lu writes (%.1lfMiB), %lu syncs, pages allocated %lu, freed %lu\n", name,
+           stats.io.reads, stats.io.bytesRead / 1048576.0, stats.io.writes, stats.io.bytesWritten / 1048576.0,
+           stats.io.syncs, stats.pagesAllocated, stats.pagesFreed);
+}
+
+void stats_test() {
+    const int TOTAL = 500000;
+    std::mt19937 rng(2021);
+    remove("data.db");
+    Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db");
+    for (int i = 0; i < TOTAL; i++) btree.insert(rng(), i);
+    btree.sync();
+    auto stats = btree.stats();
+    stats_print("insert", stats);
+    assert(stats.pagesAllocated > 0 && stats.io.writes > 0);
+    assert(stats.cache.writeBacks + stats.cache.directWrites > 0);
+
+    btree.resetStats();
+    stats = btree.stats();
+    const Sirius::CacheStats &cache = stats.cache;
+    assert(cache.hits == 0 && cache.misses == 0 && cache.evictions == 0 && cache.writeBacks == 0);
+    assert(cache.backgroundWriteBacks == 0 && cache.writeBacksSkipped == 0 && cache.mappedReads == 0);
+    assert(cache.directWrites == 0 && cache.prefetched == 0);
+    assert(stats.io.reads == 0 && stats.io.writes == 0 && stats.io.bytesRead == 0 && stats.io.bytesWritten == 0);
+    assert(stats.io.syncs == 0 && stats.pagesAllocated == 0 && stats.pagesFreed == 0);
+    assert(stats.filter.checks == 0 && stats.filter.negatives == 0 && stats.filter.falsePositives == 0);
+    assert(stats.filter.pagesSaved == 0 && stats.warmupReads == 0 && stats.warmupPages == 0);
+    assert(stats.backgroundWrites == 0 && stats.backgroundPages == 0 && stats.foregroundStalls == 0);
+
+    int val;
+    for (int i = 0; i < TOTAL; i++) btree.find(rng(), val);
+    stats = btree.stats();
+    stats_print("find", stats);
+    assert(stats.cache.hits + stats.cache.misses >= (size_t)TOTAL);
+    assert(stats.io.bytesWritten == 0);
+    std::cout << "stats test passed\n";
+}
+
+/*
+ * 快照: 一百万个 int 批量建好, 写者随机改二十万次; 对比没有快照, 以及拿着快照同时另一个线程扫整个快照
+ * 最后放掉快照再改二十万次, 看换下来的页能不能复用 (文件不再长)
+ * 有快照时, 写完后快照里被改过的 key 仍是拍快照之前的值, 树里是最后一次写的值
+ */
+typedef Sirius::BTree<int, int, 64, Sirius::OrderedKey<int>, Sirius::LRUPolicy, true> SnapshotTree;
+
+void snapshot_run(SnapshotTree &btree, int round, bool withSnapshot) {
+    const int TOTAL = 1000000, WRITES = 200000;
+    std::mt19937 rng(2021);
+    std::vector<int> writes(WRITES);
+    for (int &key : writes) key = rng() % TOTAL + 1;
+    std::map<int, int> before, after; //被改的 key 拍快照前、写完后的值
+    for (int i = 0; i < WRITES; i++) {
+        int val;
+        if (withSnapshot && !before.count(writes[i])) {
+            assert(btree.find(writes[i], val));
+            before[writes[i]] = val;
+        }
+        after[writes[i]] = round * WRITES + i;
+    }
+    double scanSec = 0;
+    size_t scanned = 0;
+    std::thread reader;
+    SnapshotTree::Snapshot snap;
+    if (withSnapshot) {
+        snap = btree.snapshot();
+        reader = std::thread([&, snap] {
+            struct timespec st;
+            clock_gettime(CLOCK_MONOTONIC, &st);
+            scanned = snap.scan(1, TOTAL, [](int, int) {});
+            scanSec = elapsed(st);
+        });
+    }
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 0; i < WRITES; i++) btree.modify(writes[i], round * WRITES + i);
+    btree.sync();
+    double writeSec = elapsed(st);
+    if (withSnapshot) {
+        reader.join();
+        assert(scanned == (size_t)TOTAL);
+        for (auto &kv : before) {
+            int val;
+            assert(kv.second != after[kv.first]);
+            assert(snap.find(kv.first, val) && val == kv.second);
+            assert(btree.find(kv.first, val) && val == after[kv.first]);
+        }
+    }
+    printf("%s: %d modifies %.6lfs", withSnapshot ? "with snapshot" : "no snapshot", WRITES, writeSec);
+    if (withSnapshot) printf(", snapshot scan %zu in %.6lfs", scanned, scanSec);
+    printf(", file %.1lfMiB\n", fileBytes("data.db") / 1048576.0);
+}
+
+void snapshot_test() {
+    const int TOTAL = 1000000;
+    std::vector<std::pair<int, int> > sorted;
+    for (int i = 1; i <= TOTAL; i++) sorted.push_back(std::make_pair(i, i));
+    remove("data.db");
+    SnapshotTree btree("data.db");
+    btree.bulkLoad(sorted.begin(), sorted.end());
+    btree.sync();
+    printf("bulk loaded, file %.1lfMiB\n", fileBytes("data.db") / 1048576.0);
+    snapshot_run(btree, 1, false);
+    snapshot_run(btree, 2, true);
+    snapshot_run(btree, 3, false);
+}
+
+/*
+ * 写优化: 两百万个随机 int 插入再随机查二十万次, 一页 4KiB 的 BTree 对比 BeTree, 看插入时间、数据文件读写量和查询时间
+ */
+template<class Tree, class IoOf>
+void betree_run(Tree &tree, const std::vector<int> &keys, const char *name, IoOf ioOf) {
+    std::mt19937 rng(2021);
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 0; i < (int)keys.size(); i++) tree.insert(keys[i], i);
+    tree.sync();
+    double insertSec = elapsed(st);
+    Sirius::IoStats io = ioOf(tree);
+    int val;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 0; i < 200000; i++) tree.find(keys[rng() % keys.size()], val);
+    printf("%s: insert %.6lfs, read %.1lfMiB, write %.1lfMiB, find %.6lfs, file %.1lfMiB\n", name, insertSec,
+           io.bytesRead / 1048576.0, io.bytesWritten / 1048576.0, elapsed(st), fileBytes("data.db") / 1048576.0);
+}
+
+/*
+ * B^ε 树的正确性: key 在 [0, KEYS) 里随机插、改、删, 和 std::map 按同样的语义 (insert 只插不存在的, modify 只改存在的) 对照
+ * 先插一半让根变成内部节点; 之后刚开始的几百条消息还在根的缓冲里, 越往后推到叶子的越多, 每隔一段都用 find 和整个 scan 核对, 最后重开再核对一次
+ */
+template<class Tree>
+void betree_check(Tree &tree, const std::map<int, int> &std_map, int keys) {
+    for (int key = 0; key < keys; key++) {
+        int result;
+        auto it = std_map.find(key);
+        bool found = tree.find(key, result);
+        assert(found == (it != std_map.end()));
+        assert(!found || result == it->second);
+    }
+    auto expect = std_map.begin();
+    size_t cnt = tree.scan(INT_MIN, INT_MAX, [&](int key, int val) {
+        assert(expect != std_map.end() && expect->first == key && expect->second == val);
+        expect++;
+    });
+    assert(expect == std_map.end() && cnt == std_map.size());
+}
+
+void betree_messages_test() {
+    const int KEYS = 50000, OPS = 400000;
+    typedef Sirius::BeTree<int, int, 16, 4096, Sirius::OrderedKey<int> > Tree;
+    std::mt19937 rng(2021);
+    std::map<int, int> std_map;
+    remove("data.db");
+    {
+        Tree tree("data.db");
+        for (int key = 0; key < KEYS; key += 2) {
+            tree.insert(key, key);
+            std_map[key] = key;
+        }
+        betree_check(tree, std_map, KEYS);
+        for (int i = 1; i <= OPS; i++) {
+            int key = rng() % KEYS, op = rng() % 3;
+            if (op == 0) {
+                tree.insert(key, i);
+                std_map.insert(std::make_pair(key, i));
+            } else if (op == 1) {
+                tree.modify(key, -i);
+                auto it = std_map.find(key);
+                if (it != std_map.end()) it->second = -i;
+            } else {
+                tree.del(key);
+                std_map.erase(key);
+            }
+            if (i == 100 || i == 1000 || i % 50000 == 0) betree_check(tree, std_map, KEYS);
+        }
+        tree.sync();
+        betree_check(tree, std_map, KEYS);
+    }
+    {
+        Tree tree("data.db");
+        betree_check(tree, std_map, KEYS);
+    }
+    remove("data.db");
+    std::cout << "betree messages test passed\n";
+}
+
+void betree_test() {
+    betree_messages_test();
+    const int TOTAL = 2000000;
+    std::mt19937 rng(2021);
+    std::vector<int> keys(TOTAL);
+    for (int &key : keys) key = rng();
+    {
+        remove("data.db");
+        Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value, Sirius::OrderedKey<int> > btree("data.db");
+        betree_run(btree, keys, "BTree", [](decltype(btree) &tree) {return tree.stats().io;});
+    }
+    {
+        remove("data.db");
+        Sirius::BeTree<int, int, 16, 4096, Sirius::OrderedKey<int> > betree("data.db");
+        betree_run(betree, keys, "BeTree", [](decltype(betree) &tree) {return tree.ioStats();});
+    }
+}
+
+/*
+ * 布隆过滤器: 一百万个随机偶数插入后清零计数, 再点查一百万次, 其中九成是不在树里的奇数; 对比不开和每个 key 10 位
+ */
+void bloom_run(int filterBits, const std::vector<int> &keys) {
+    std::mt19937 rng(2021);
+    remove("data.db");
+    remove("data.db.bloom");
+    Sirius::BTree<int, int, 64, Sirius::OrderedKey<int> > btree("data.db", Sirius::PAGER_PIO, 0, filterBits);
+    std::map<int, int> std_map; //重复的 key 留第一次插入的值
+    for (int i = 0; i < (int)keys.size(); i++) {
+        btree.insert(keys[i], i);
+        std_map.insert(std::make_pair(keys[i], i));
+    }
+    btree.sync();
+    btree.resetStats();
+    int val;
+    size_t found = 0;
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 0; i < (int)keys.size(); i++) {
+        if (rng() % 10 == 0) {
+            bool hit = btree.find(keys[rng() % keys.size()], val);
+            assert(hit);
+            found++;
+        } else {
+            bool hit = btree.find((int)(rng() >> 2) * 2 + 1, val);
+            assert(!hit);
+        }
+    }
+    double findSec = elapsed(st);
+    auto stats = btree.stats();
+    //过滤器不能漏掉在树里的 key, 误判率只打出来看
+    for (auto &kv : std_map) {
+        bool hit = btree.find(kv.first, val);
+        assert(hit && val == kv.second);
+    }
+    printf("filterBits %d: find %.6lfs (found %zu), cache hit rate %.4lf, read %zu pages, filter negatives %zu, false positive rate %.4lf, "
+           "pages saved %zu, filter file %.1lfMiB\n", filterBits, findSec, found, stats.cache.hitRate(), stats.io.reads,
+           stats.filter.negatives, stats.filter.falsePositiveRate(), stats.filter.pagesSaved, fileBytes("data.db.bloom") / 1048576.0);
+}
+
+void bloom_test() {
+    const int TOTAL = 1000000;
+    std::mt19937 rng(2021);
+    std::vector<int> keys(TOTAL);
+    for (int &key : keys) key = (rng() >> 2) * 2; //树里都是偶数, 奇数一定不在
+    bloom_run(0, keys);
+    bloom_run(10, keys);
+}
+
+/*
+ * 一棵热树 + 七棵冷树同时开着, 九成的点查落在热树上
+ * 私有 cache 每棵树固定 3000 个页框; 共享 pool 按字节给总预算, 谁热谁占
+ */
+template<class Policy>
+void pool_run(size_t budget, const char *name) {
+    typedef Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value,
+                          Sirius::OrderedKey<int>, Policy> Tree;
+    const int TREES = 8, HOT = 2000000, COLD = 200000, FINDS = 2000000;
+    Sirius::BufferPool::global().setBudget(budget);
+    std::vector<std::unique_ptr<Tree> > trees;
+    std::vector<std::pair<int, int> > sorted;
+    for (int t = 0; t < TREES; t++) {
+        std::string fileName = "data" + std::to_string(t) + ".db";
+        remove(fileName.c_str());
+        trees.emplace_back(new Tree(fileName.c_str()));
+        sorted.clear();
+        for (int i = 0; i < (t == 0 ? HOT : COLD); i++) sorted.push_back(std::make_pair(i, i));
+        trees[t]->bulkLoad(sorted.begin(), sorted.end());
+        trees[t]->resetStats();
+    }
+    std::mt19937 rng(2021);
+    int val;
+    size_t found = 0;
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (int i = 0; i < FINDS; i++) {
+        int t = rng() % 10 != 0 ? 0 : 1 + rng() % (TREES - 1);
+        int key = rng() % (t == 0 ? HOT : COLD);
+        bool hit = trees[t]->find(key, val);
+        assert(hit && val == key);
+        found++;
+    }
+    double findSec = elapsed(st);
+    assert(found == (size_t)FINDS);
+    size_t reads = 0, frames = 0;
+    for (auto &tree : trees) {
+        auto stats = tree->stats();
+        reads += stats.io.reads;
+        frames += stats.cache.resident;
+    }
+    printf("%s: find %.6lfs (found %d), read %zu pages, hot tree holds %zu of %zu frames\n", name, findSec, (int)found, reads,
+           trees[0]->stats().cache.resident, frames);
+    trees.clear();
+    for (int t = 0; t < TREES; t++) remove(("data" + std::to_string(t) + ".db").c_str());
+}
+
+/*
+ * 共享 pool 的脏页: 四棵树交错着随机插、改、删, 预算比四棵树的工作集加起来小, 中途再把预算调小
+ * 淘汰到别的树的脏页只能挂到它的待写回链上, 等它自己写回; 最后只写最晚关的那棵, 别的树带着待写回的页关掉
+ * 关树的顺序和开的不同, 重开后每棵树都和自己的 std::map 核对
+ */
+void pool_churn_test() {
+    typedef Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value,
+                          Sirius::OrderedKey<int>, Sirius::SharedPoolPolicy> Tree;
+    const int TREES = 4, KEYS = 100000, OPS = 600000;
+    const int closeOrder[TREES] = {2, 0, 3, 1}, reopenOrder[TREES] = {3, 1, 0, 2};
+    Sirius::BufferPool &pool = Sirius::BufferPool::global();
+    pool.setBudget(4 << 20);
+    std::vector<std::unique_ptr<Tree> > trees(TREES);
+    std::vector<std::map<int, int> > std_maps(TREES);
+    for (int t = 0; t < TREES; t++) {
+        std::string fileName = "data" + std::to_string(t) + ".db";
+        remove(fileName.c_str());
+        trees[t].reset(new Tree(fileName.c_str()));
+    }
+    std::mt19937 rng(2021);
+    for (int i = 1; i <= OPS + OPS / 10; i++) {
+        if (i == OPS / 2) pool.setBudget(1 << 20);
+        int t = i <= OPS ? rng() % TREES : closeOrder[TREES - 1], key = rng() % KEYS, op = rng() % 4;
+        std::map<int, int> &std_map = std_maps[t];
+        if (op <= 1) {
+            bool ok = trees[t]->insert(key, i);
+            assert(ok == std_map.insert(std::make_pair(key, i)).second);
+        } else if (op == 2) {
+            bool ok = trees[t]->modify(key, -i);
+            assert(ok == (std_map.count(key) > 0));
+            if (ok) std_map[key] = -i;
+        } else {
+            bool ok = trees[t]->del(key);
+            assert(ok == (std_map.erase(key) > 0));
+        }
+    }
+    for (int t : closeOrder) trees[t].reset();
+    for (int t : reopenOrder) trees[t].reset(new Tree(("data" + std::to_string(t) + ".db").c_str()));
+    for (int t = 0; t < TREES; t++) {
+        assert(trees[t]->size() == std_maps[t].size());
+        for (int key = 0; key < KEYS; key++) {
+            int val;
+            auto it = std_maps[t].find(key);
+            bool found = trees[t]->find(key, val);
+            assert(found == (it != std_maps[t].end()));
+            assert(!found || val == it->second);
+        }
+    }
+    trees.clear();
+    for (int t = 0; t < TREES; t++) remove(("data" + std::to_string(t) + ".db").c_str());
+    pool.setBudget(64 << 20);
+    std::cout << "pool churn test passed\n";
+}
+
+void pool_test() {
+    pool_churn_test();
+    const size_t PRIVATE = 8 * 3000 * 4096; //8 棵树各 3000 个不超过 4KiB 的页框
+    pool_run<Sirius::LRUPolicy>(0, "private LRUCache x 8");
+    pool_run<Sirius::SharedPoolPolicy>(PRIVATE, "shared pool, same memory");
+    pool_run<Sirius::SharedPoolPolicy>(PRIVATE / 2, "shared pool, half memory");
+}
+
+/*
+ * 点查索引对比: 同 varkey_test 的五十万个 URL key, 随机插入后同步, 清零计数, 再打乱顺序点查一遍
+ * 树要从根走到叶子, 可扩展哈希查目录 (在内存里) 后只读一个桶
+ * 之后删掉四分之三 (哈希的桶会一路合并), 再关掉重开, 每一步都核对剩下的都在、删掉的都不在
+ */
+struct TreeIo {
+    template<class Tree>
+    Sirius::IoStats operator()(Tree &tree) const {return tree.stats().io;}
+};
+
+struct HashIo {
+    template<class Index>
+    Sirius::IoStats operator()(Index &index) const {return index.ioStats();}
+};
+
+template<class Index, class IoOf>
+void hash_run(const std::vector<std::pair<std::string, int> > &kvs, const char *name, IoOf ioOf) {
+    const int DELETE = (int)kvs.size() / 4 * 3;
+    std::mt19937 rng(2021);
+    std::vector<int> order(kvs.size());
+    for (int i = 0; i < (int)order.size(); i++) order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+    //kvs[from, end) 里找到且值对的个数, [0, from) 都不能找到
+    auto countFound = [&](Index &index, int from) {
+        int result, found = 0;
+        for (int i : order) {
+            if (i >= from) found += index.find(kvs[i].first, result) && result == kvs[i].second;
+            else assert(!index.find(kvs[i].first, result));
+        }
+        return found;
+    };
+    remove("data.db");
+    {
+        Index index("data.db");
+        struct timespec st;
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        for (auto &kv : kvs) index.insert(kv.first, kv.second);
+        index.sync();
+        double insertSec = elapsed(st);
+        index.resetStats();
+        int result, found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        for (int i : order) found += index.find(kvs[i].first, result) && result == kvs[i].second;
+        double findSec = elapsed(st);
+        assert(found == (int)kvs.size());
+        printf("%s: insert %.6lfs, find %.6lfs (found %d), cache hit rate %.4lf, read %zu pages, file %.1lfMiB\n", name,
+               insertSec, findSec, found, index.cacheStats().hitRate(), ioOf(index).reads, fileBytes("data.db") / 1048576.0);
+        for (int i = 0; i < DELETE; i++) {
+            bool deleted = index.del(kvs[i].first);
+            assert(deleted);
+        }
+        found = countFound(index, DELETE);
+        assert(found == (int)kvs.size() - DELETE);
+    }
+    {
+        Index index("data.db");
+        int found = countFound(index, DELETE);
+        assert(found == (int)kvs.size() - DELETE);
+    }
+    remove("data.db");
+}
+
+void hash_test() {
+    typedef Sirius::HashKey<std::string> Hash;
+    typedef Sirius::FixedStringKey<64> Fixed;
+    const int TOTAL = 500000;
+    std::mt19937 rng(2021);
+    std::map<std::string, int> std_map;
+    for (int i = 1; i <= TOTAL; i++) std_map[urlKey(rng)] = i;
+    //HashKey 把撞哈希的 key 当重复拒绝, 先去掉它们, 四种索引存的是同一批 key
+    std::set<int> hashes;
+    std::vector<std::pair<std::string, int> > kvs;
+    for (auto &kv : std_map) {
+        if (hashes.insert(Hash::encode(kv.first)).second) kvs.push_back(kv);
+    }
+    std::shuffle(kvs.begin(), kvs.end(), rng);
+    hash_run<Sirius::BTree<std::string, int, Sirius::PageFanout<std::string, int, 4096, Hash>::value, Hash> >(kvs, "BTree, hash", TreeIo());
+    hash_run<Sirius::HashIndex<std::string, int, 4096, Hash> >(kvs, "HashIndex, hash", HashIo());
+    hash_run<Sirius::BTree<std::string, int, Sirius::PageFanout<std::string, int, 4096, Fixed>::value, Fixed> >(kvs, "BTree, fixed 64 bytes",
+                                                                                                              TreeIo());
+    hash_run<Sirius::HashIndex<std::string, int, 4096, Fixed> >(kvs, "HashIndex, fixed 64 bytes", HashIo());
+}
+
+/*
+ * 重启后的 cache 预热: 一百万个 key bulkLoad, 热数据为每 1024 个 key 里的头 256 个 (约 2000 页, cache 放得下, 页在文件里隔三页一个)
+ * 先开一次树点查热数据到稳定, 关闭时存下常驻页; 再用 O_DIRECT 重开 (不走页缓存, 未命中都真的读盘), 马上点查二十万次
+ * 看开头两万次的命中率、每次点查的 p99 和总时间; 预热的树和点查同时开始, 没有先等它读完
+ * 每次点查都核对值; 开了预热的一定有页被预读进来
+ */
+const int WARM_KEYS = 1000000;
+
+int warmKey(std::mt19937 &rng) {
+    return (int)(rng() % (WARM_KEYS / 1024)) * 1024 + (int)(rng() % 256);
+}
+
+void warm_run(bool warmup, const char *name) {
+    typedef Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value, Sirius::OrderedKey<int> > Tree;
+    const int FINDS = 200000, FIRST = 20000;
+    std::mt19937 rng(2021);
+    std::vector<double> cost(FINDS);
+    double firstHitRate = 0;
+    int val;
+    struct timespec st, one;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    Tree btree("data.db", Sirius::PAGER_DIRECT, 0, 0, warmup);
+    for (int i = 0; i < FINDS; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &one);
+        int key = warmKey(rng);
+        bool found = btree.find(key, val);
+        cost[i] = elapsed(one);
+        assert(found && val == key);
+        if (i + 1 == FIRST) firstHitRate = btree.cacheStats().hitRate();
+    }
+    double totalSec = elapsed(st);
+    auto stats = btree.stats();
+    std::vector<double> sorted(cost);
+    std::sort(sorted.begin(), sorted.end());
+    printf("%s: %d finds %.6lfs, first %d hit rate %.4lf, p99 %.1lfus, foreground reads %zu, prefetched %zu (%zu reads)\n", name,
+           FINDS, totalSec, FIRST, firstHitRate, sorted[FINDS * 99 / 100] * 1e6, stats.io.reads,
+           stats.cache.prefetched, stats.warmupReads);
+    assert(!warmup || stats.cache.prefetched > 0);
+}
+
+/*
+ * 后台读好了旧页、还没交给 cache 时, 这页被改了又淘汰写回, 再空出一个页框: 旧页不能装进来
+ * 等 loader 读完再接上 cache, 把这个先后固定下来
+ */
+void warm_stale_test() {
+    const int N = 64;
+    remove("warm.db");
+    int file = open("warm.db", O_RDWR | O_CREAT, 0644);
+    {
+        Sirius::LRUCache<int, 5> cache;
+        cache.setFile(file);
+        for (int i = 0; i < N; i++) cache.write(i * 4, i);
+    }
+    std::vector<long long> list;
+    for (int i = 0; i < N; i++) list.push_back(i * 4);
+    Sirius::WarmLoader loader("warm.db", list, sizeof(int), sizeof(int));
+    while (!loader.pending()) std::this_thread::yield(); //N 页连成一段, 只有一批
+    {
+        Sirius::LRUCache<int, 5> cache;
+        cache.setFile(file);
+        cache.warmTrack(true);
+        cache.write(0, -1);
+        int val;
+        for (int i = 1; i <= 5; i++) cache.read(i * 4, val); //把 0 挤出去, 写回盘上
+        cache.discard(5 * 4); //空出一个页框
+        cache.warmFrom(&loader);
+        cache.read(0, val);
+        assert(val == -1);
+        cache.read(6 * 4, val);
+        assert(val == 6 && cache.stats().prefetched > 0);
+    }
+    close(file);
+    remove("warm.db");
+}
+
+/*
+ * 预热时写: 带预热重开, 后台还在读的时候马上改、删热数据, 之后读到的页不能是后台读上来的旧内容
+ * 和 std::map 核对所有热 key, 关掉再带预热重开一次, 再核对一次
+ */
+void warm_check(std::map<int, int> &std_map, bool first) {
+    typedef Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value, Sirius::OrderedKey<int> > Tree;
+    const int WRITES = 20000;
+    Tree btree("data.db", Sirius::PAGER_DIRECT, 0, 0, true);
+    if (first) {
+        std::mt19937 rng(2022);
+        for (int i = 1; i <= WRITES; i++) {
+            int key = warmKey(rng);
+            if (rng() % 2) {
+                bool ok = btree.modify(key, -i);
+                assert(ok == (std_map.count(key) > 0));
+                if (ok) std_map[key] = -i;
+            } else {
+                bool ok = btree.del(key);
+                assert(ok == (std_map.erase(key) > 0));
+            }
+        }
+    }
+    for (int block = 0; block < WARM_KEYS / 1024; block++) {
+        for (int key = block * 1024; key < block * 1024 + 256; key++) {
+            int val;
+            auto it = std_map.find(key);
+            bool found = btree.find(key, val);
+            assert(found == (it != std_map.end()));
+            assert(!found || val == it->second);
+        }
+    }
+    assert(btree.size() == std_map.size());
+    assert(btree.stats().cache.prefetched > 0);
+}
+
+void warm_test() {
+    typedef Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value, Sirius::OrderedKey<int> > Tree;
+    remove("data.db");
+    remove("data.db.warm");
+    {
+        Tree btree("data.db", Sirius::PAGER_PIO, 0, 0, true);
+        std::vector<std::pair<int, int> > sorted;
+        for (int i = 0; i < WARM_KEYS; i++) sorted.push_back(std::make_pair(i, i));
+        btree.bulkLoad(sorted.begin(), sorted.end());
+        std::mt19937 rng(7);
+        int val;
+        for (int i = 0; i < 1000000; i++) btree.find(warmKey(rng), val);
+    }
+    warm_run(false, "cold restart");
+    warm_run(true, "warm-up restart");
+    warm_stale_test();
+    std::map<int, int> std_map;
+    for (int i = 0; i < WARM_KEYS; i++) std_map.insert(std_map.end(), std::make_pair(i, i));
+    warm_check(std_map, true);
+    warm_check(std_map, false);
+    std::cout << "warm test passed\n";
+}
+
+/*
+ * 后台写回: 一百万个随机 int 插入 (M = 254, O_DIRECT, 写盘都真的落到设备上), cache 装不下, 淘汰时常碰到脏页
+ * 不开时淘汰脏页要前台自己写; 开了以后淘汰和提前清理的脏页都交给后台线程, 看每次 insert 的 p99 / 最长和总时间
+ * 计时之后再插一万个不 sync, 由析构写回; 重开 (不开后台写回) 核对插进去的都在且值对
+ */
+void flusher_run(bool sequential, double dirtyHighWater, const char *name) {
+    typedef Sirius::BTree<int, int, Sirius::PageFanout<int, int, 4096, Sirius::OrderedKey<int> >::value, Sirius::OrderedKey<int> > Tree;
+    const int TOTAL = 1000000;
+    remove("data.db");
+    std::mt19937 rng(2021);
+    std::vector<double> cost(TOTAL);
+    std::vector<std::pair<int, int> > inserted;
+    inserted.reserve(TOTAL + TOTAL / 100);
+    {
+        struct timespec st, one;
+        Tree btree("data.db", Sirius::PAGER_DIRECT, 0, 0, false, dirtyHighWater);
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        for (int i = 0; i < TOTAL; i++) {
+            int key = sequential ? i : (int)rng();
+            clock_gettime(CLOCK_MONOTONIC, &one);
+            bool ok = btree.insert(key, i);
+            cost[i] = elapsed(one);
+            if (ok) inserted.push_back(std::make_pair(key, i));
+        }
+        btree.sync();
+        double totalSec = elapsed(st);
+        auto stats = btree.stats();
+        std::sort(cost.begin(), cost.end());
+        printf("%s: insert + sync %.6lfs, p99 %.1lfus, max %.1lfus, write backs %zu (background %zu in %zu writes, %zu stalls)\n", name,
+               totalSec, cost[TOTAL * 99 / 100] * 1e6, cost[TOTAL - 1] * 1e6, stats.cache.writeBacks, stats.backgroundPages,
+               stats.backgroundWrites, stats.foregroundStalls);
+        for (int i = TOTAL; i < TOTAL + TOTAL / 100; i++) {
+            int key = sequential ? i : (int)rng();
+            if (btree.insert(key, i)) inserted.push_back(std::make_pair(key, i));
+        }
+    }
+    Tree btree("data.db", Sirius::PAGER_DIRECT);
+    assert(btree.size() == inserted.size());
+    for (auto &kv : inserted) {
+        int result;
+        bool found = btree.find(kv.first, result);
+        assert(found && result == kv.second);
+    }
+}
+
+void flusher_test() {
+    flusher_run(false, 0, "random, no flusher");
+    flusher_run(false, 1, "random, high water 1");
+    flusher_run(false, 0.75, "random, high water 0.75");
+    flusher_run(true, 0, "sequential, no flusher");
+    flusher_run(true, 1, "sequential, high water 1");
+    flusher_run(true, 0.5, "sequential, high water 0.5");
+}
+
 #endif //DS01_B_TREE_UTILS_HPP
@@ -0,0 +1,418 @@
+#ifndef DS01_B_TREE_VLOG_HPP
+#define DS01_B_TREE_VLOG_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "BTree.hpp"
+
+namespace Sirius {
+
+    /*
+     * K-V 分离: 值不放在树里, 追加写到单独的值日志, 树里只存指向日志的 ValuePtr (16 字节)
+     * 即 BTree 构造函数那里说的 "B树作为索引, 另写一个文件池" 的做法; 值再大节点的阶数也不变, 值也可以不是定长类型
+     */
+    struct ValuePtr {
+        long long pos; //记录在值日志里的位置
+        unsigned len; //整条记录的字节数
+        unsigned pad;
+    };
+
+    /*
+     * 值 (以及 key, 垃圾回收时要用 key 回树里查) 怎么变成字节, 默认按字节原样拷贝, 要求可以直接读写
+     * std::string 存内容本身; 其它类型可以自己特化
+     */
+    template<class T, class Enable = void>
+    struct ValueCodec {
+        static_assert(std::is_trivially_copyable<T>::value, "specialize ValueCodec for this type");
+
+        static void encode(const T &val, std::vector<char> &out) {
+            const char *ptr = reinterpret_cast<const char *>(&val);
+            out.insert(out.end(), ptr, ptr + sizeof(T));
+        }
+
+        static T decode(const char *data, size_t len) {
+            if (len != sizeof(T)) throw "value size mismatch";
+            T ret;
+            memcpy(&ret, data, sizeof(T));
+            return ret;
+        }
+    };
+
+    template<>
+    struct ValueCodec<std::string> {
+        static void encode(const std::string &val, std::vector<char> &out) {
+            out.insert(out.end(), val.begin(), val.end());
+        }
+
+        static std::string decode(const char *data, size_t len) {
+            return std::string(data, len);
+        }
+    };
+
+    /*
+     * 值日志, 单文件: 第一页为文件头, 之后顺序追加记录 (记录头 + key 字节 + 值字节), 记录头带校验和
+     * [head, tail) 为还可能有用的部分, head 之前都已回收 (打洞还给文件系统, 位置不变, 指针不用改)
+     * 追加先进缓冲, 攒满或 sync 时才写; 文件头里的 tail 只记上次 sync 前已经落盘的位置,
+     * 打开时从它往后扫, 校验得过的记录都接上, 写了一半的尾巴截掉
+     */
+    class ValueLog {
+        typedef long long fpos_t;
+        static const unsigned MAGIC = 0x474f4c56; //"VLOG"
+        static const fpos_t DATA_BEGIN = 4096;
+        static const size_t BUF_SIZE = 1 << 20;
+
+        struct Header {
+            unsigned magic, version;
+            fpos_t head, tail;
+            fpos_t garbage; //[head, tail) 里估计的死记录字节数, 删改时累加, 回收时扣掉
+        };
+
+        struct RecordHead {
+            unsigned keyLen, valLen;
+            unsigned checksum, pad;
+        };
+
+        int fd;
+        Header header;
+        fpos_t tailPos, flushed; //tailPos 为逻辑尾 (含缓冲), flushed 之前都已写进文件
+        std::vector<char> buf;
+        bool unsynced;
+
+        //FNV-1a, 同 wal.hpp
+        static unsigned checksum(const char *data, size_t len, unsigned h = 2166136261u) {
+            for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)data[i]) * 16777619u;
+            return h;
+        }
+
+        static unsigned recordSum(RecordHead head, const char *body) {
+            head.checksum = 0;
+            return checksum(body, head.keyLen + head.valLen, checksum(reinterpret_cast<const char *>(&head), sizeof(RecordHead)));
+        }
+
+        void flush() {
+            if (buf.empty()) return;
+            diskWrite(fd, flushed, buf.data(), buf.size());
+            flushed += buf.size();
+            buf.clear();
+            unsynced = true;
+        }
+
+        void writeHeader() {
+            diskWrite(fd, 0, &header, sizeof(Header));
+            unsynced = true;
+        }
+
+        /*
+         * 从 header.tail 往后接上校验得过的记录
+         */
+        void recover() {
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            fpos_t pos = header.tail;
+            std::vector<char> body;
+            while (pos + (fpos_t)sizeof(RecordHead) <= fileStat.st_size) {
+                RecordHead head;
+                diskRead(fd, pos, &head, sizeof(RecordHead));
+                fpos_t len = sizeof(RecordHead) + (fpos_t)head.keyLen + head.valLen;
+                if (pos + len > fileStat.st_size) break;
+                body.resize(head.keyLen + head.valLen);
+                diskRead(fd, pos + sizeof(RecordHead), body.data(), body.size());
+                if (recordSum(head, body.data()) != head.checksum) break;
+                pos += len;
+            }
+            if (ftruncate(fd, pos) != 0) throw "value log truncate failed";
+            tailPos = flushed = pos;
+        }
+
+    public:
+        ValueLog(): fd(-1), tailPos(DATA_BEGIN), flushed(DATA_BEGIN), unsynced(false) {
+            memset(&header, 0, sizeof(Header));
+        }
+
+        ~ValueLog() {
+            close();
+        }
+
+        void open(const char *fileName) {
+            fd = ::open(fileName, O_RDWR | O_CREAT, 0644);
+            if (fd < 0) throw "cannot open value log";
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            if (fileStat.st_size == 0) {
+                header.magic = MAGIC, header.version = 1;
+                header.head = header.tail = DATA_BEGIN;
+                header.garbage = 0;
+                writeHeader();
+                sync();
+            } else {
+                diskRead(fd, 0, &header, sizeof(Header));
+                if (header.magic != MAGIC || header.version != 1) throw "bad value log";
+            }
+            recover();
+        }
+
+        void close() {
+            if (fd >= 0) {
+                sync();
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        /*
+         * 追加一条记录, 返回它的位置
+         */
+        ValuePtr append(const char *key, size_t keyLen, const char *val, size_t valLen) {
+            RecordHead head;
+            head.keyLen = keyLen, head.valLen = valLen;
+            head.checksum = head.pad = 0;
+            size_t off = buf.size();
+            buf.resize(off + sizeof(RecordHead) + keyLen + valLen);
+            memcpy(buf.data() + off + sizeof(RecordHead), key, keyLen);
+            memcpy(buf.data() + off + sizeof(RecordHead) + keyLen, val, valLen);
+            head.checksum = recordSum(head, buf.data() + off + sizeof(RecordHead));
+            memcpy(buf.data() + off, &head, sizeof(RecordHead));
+
+            ValuePtr ret;
+            ret.pos = tailPos, ret.len = sizeof(RecordHead) + keyLen + valLen, ret.pad = 0;
+            tailPos += ret.len;
+            if (buf.size() >= BUF_SIZE) flush();
+            return ret;
+        }
+
+        /*
+         * 撤销最后一条记录 (插入失败时), 不是最后一条就什么也不做, 留给垃圾回收
+         */
+        void rollback(const ValuePtr &ptr) {
+            if (ptr.pos + (fpos_t)ptr.len != tailPos) return;
+            tailPos = ptr.pos;
+            if (ptr.pos >= flushed) buf.resize(ptr.pos - flushed);
+            else flushed = ptr.pos, buf.clear(); //已经写进文件, 之后的追加直接盖掉
+        }
+
+        /*
+         * 读出整条记录, key 和值的字节分别由 keyData/valData 指向 body 里
+         */
+        void read(const ValuePtr &ptr, std::vector<char> &body, const char *&keyData, size_t &keyLen,
+                  const char *&valData, size_t &valLen) const {
+            RecordHead head;
+            body.resize(ptr.len - sizeof(RecordHead));
+            if (ptr.pos >= flushed) {
+                memcpy(&head, buf.data() + (ptr.pos - flushed), sizeof(RecordHead));
+                memcpy(body.data(), buf.data() + (ptr.pos - flushed) + sizeof(RecordHead), body.size());
+            } else {
+                diskRead(fd, ptr.pos, &head, sizeof(RecordHead));
+                diskRead(fd, ptr.pos + sizeof(RecordHead), body.data(), body.size());
+            }
+            if (sizeof(RecordHead) + head.keyLen + head.valLen != ptr.len || recordSum(head, body.data()) != head.checksum) {
+                throw "corrupted value log";
+            }
+            keyData = body.data(), keyLen = head.keyLen;
+            valData = body.data() + head.keyLen, valLen = head.valLen;
+        }
+
+        /*
+         * pos 处那条记录的指针, 垃圾回收顺着日志往后走时用
+         */
+        ValuePtr at(fpos_t pos) const {
+            RecordHead head;
+            if (pos >= flushed) memcpy(&head, buf.data() + (pos - flushed), sizeof(RecordHead));
+            else diskRead(fd, pos, &head, sizeof(RecordHead));
+            ValuePtr ret;
+            ret.pos = pos, ret.len = sizeof(RecordHead) + head.keyLen + head.valLen, ret.pad = 0;
+            return ret;
+        }
+
+        void addGarbage(fpos_t bytes) {
+            header.garbage += bytes;
+        }
+
+        /*
+         * 落盘: 缓冲写进文件, 文件头记下这次之前已落盘的尾巴, 一起 fdatasync
+         */
+        void sync() {
+            flush();
+            if (!unsynced) return;
+            fdatasync(fd);
+            if (header.tail != flushed) { //尾巴要在数据落盘之后才能记进文件头
+                header.tail = flushed;
+                diskWrite(fd, 0, &header, sizeof(Header));
+                fdatasync(fd);
+            }
+            unsynced = false;
+        }
+
+        /*
+         * 回收 [head, newHead): 调用者保证其中的活记录都已搬走且树已落盘
+         * 文件头先记下新的 head 并落盘, 再打洞; 整个日志都空了就截回去从头开始
+         */
+        void release(fpos_t newHead, fpos_t deadBytes) {
+            fpos_t oldHead = header.head;
+            header.head = newHead;
+            header.garbage = std::max(header.garbage - deadBytes, 0ll);
+            if (newHead == tailPos) {
+                header.head = header.tail = tailPos = flushed = DATA_BEGIN;
+                header.garbage = 0;
+                buf.clear();
+                writeHeader();
+                sync();
+                if (ftruncate(fd, DATA_BEGIN) != 0) throw "value log truncate failed";
+                return;
+            }
+            writeHeader();
+            sync();
+            fpos_t begin = oldHead / DATA_BEGIN * DATA_BEGIN, end = newHead / DATA_BEGIN * DATA_BEGIN;
+            if (begin < end) fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin); //不支持打洞的文件系统上只是不还空间
+        }
+
+        fpos_t head() const {return header.head;}
+
+        fpos_t tail() const {return tailPos;}
+
+        fpos_t garbage() const {return header.garbage;}
+
+        /*
+         * 实际占用的磁盘空间 (打过洞的部分不算)
+         */
+        fpos_t diskBytes() const {
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            return fileStat.st_blocks * 512;
+        }
+    };
+
+    /*
+     * K-V 分离的 B 树: 树 (索引) 存 key -> ValuePtr, 值在 "文件名.vlog" 里
+     * M 为 0 时按 ValuePtr 自动取一页 (4KiB) 能放下的阶数, 其它模板参数同 BTree
+     * 改、删只是让旧记录变成垃圾, 由 gc 回收; 不支持多线程
+     * 持久化: sync 先落盘值日志再落盘树; WAL 模式下日志每次落盘前也先落盘值日志, 树里的指针不会指向丢了的值
+     */
+    template<class Key, class Val, int M = 0, class KeyPolicy = HashKey<Key>, class CachePolicy = LRUPolicy>
+    class SeparatedBTree {
+        typedef long long fpos_t;
+        static const int ORDER = M > 0 ? M : PageFanout<Key, ValuePtr, 4096, KeyPolicy>::value;
+        typedef BTree<Key, ValuePtr, ORDER, KeyPolicy, CachePolicy> Index;
+
+        ValueLog vlog; //要先于树打开: 树的 WAL 重放时值日志已经恢复好
+        Index index;
+        std::vector<char> scratch, body;
+
+        ValuePtr append(const Key &key, const Val &val) {
+            scratch.clear();
+            ValueCodec<Key>::encode(key, scratch);
+            size_t keyLen = scratch.size();
+            ValueCodec<Val>::encode(val, scratch);
+            return vlog.append(scratch.data(), keyLen, scratch.data() + keyLen, scratch.size() - keyLen);
+        }
+
+        //在初始化列表里打开值日志, 返回原文件名给树
+        const char *openLog(const char *fileName) {
+            vlog.open((std::string(fileName) + ".vlog").c_str());
+            return fileName;
+        }
+
+    public:
+        SeparatedBTree(const char *fileName, PagerType pagerType = PAGER_PIO, int walGroup = 0, int filterBits = 0, bool warmup = false,
+                       double dirtyHighWater = 0):
+            index(openLog(fileName), pagerType, walGroup, filterBits, warmup, dirtyHighWater) {
+            index.setBeforeCommit([this] {vlog.sync();});
+        }
+
+        ~SeparatedBTree() {
+            vlog.sync(); //树析构时会做检查点 / 写回, 值要先落盘
+        }
+
+        bool insert(const Key &key, const Val &val) {
+            ValuePtr ptr = append(key, val);
+            if (index.insert(key, ptr)) return true;
+            vlog.rollback(ptr);
+            return false;
+        }
+
+        bool find(const Key &key, Val &val) {
+            ValuePtr ptr;
+            if (!index.find(key, ptr)) return false;
+            const char *keyData, *valData;
+            size_t keyLen, valLen;
+            vlog.read(ptr, body, keyData, keyLen, valData, valLen);
+            val = ValueCodec<Val>::decode(valData, valLen);
+            return true;
+        }
+
+        bool modify(const Key &key, const Val &val) {
+            ValuePtr old;
+            if (!index.find(key, old)) return false;
+            index.modify(key, append(key, val));
+            vlog.addGarbage(old.len);
+            return true;
+        }
+
+        bool del(const Key &key) {
+            ValuePtr old;
+            if (!index.find(key, old)) return false;
+            index.del(key);
+            vlog.addGarbage(old.len);
+            return true;
+        }
+
+        size_t size() const {return index.size();}
+
+        void sync() {
+            vlog.sync();
+            index.sync();
+        }
+
+        void commit() {
+            index.commit(); //WAL 模式下会先调 vlog.sync
+        }
+
+        /*
+         * 垃圾回收: 从日志头起看至多 maxBytes 字节的记录, 树里还指向它的 (活的) 重新追加到尾部并改指针
+         * 然后落盘, 日志头后移, 前面的部分还给文件系统; 返回回收的字节数
+         * 搬过去的记录都在这次的终点之后, 一次回收不会再碰到
+         */
+        fpos_t gc(fpos_t maxBytes) {
+            fpos_t begin = vlog.head(), end = std::min(vlog.tail(), begin + maxBytes), pos = begin, moved = 0;
+            while (pos < end) {
+                ValuePtr ptr = vlog.at(pos), cur;
+                const char *keyData, *valData;
+                size_t keyLen, valLen;
+                vlog.read(ptr, body, keyData, keyLen, valData, valLen);
+                Key key = ValueCodec<Key>::decode(keyData, keyLen);
+                if (index.find(key, cur) && cur.pos == pos) {
+                    index.modify(key, vlog.append(keyData, keyLen, valData, valLen));
+                    moved += ptr.len;
+                }
+                pos += ptr.len;
+            }
+            sync();
+            vlog.release(pos, pos - begin - moved);
+            return pos - begin - moved;
+        }
+
+        /*
+         * 值日志里 [head, tail) 中估计的垃圾比例, 可以据此决定什么时候 gc
+         */
+        double garbageRatio() const {
+            fpos_t len = vlog.tail() - vlog.head();
+            return len == 0 ? 0 : (double)vlog.garbage() / len;
+        }
+
+        fpos_t logBytes() const {return vlog.tail() - vlog.head();}
+
+        fpos_t logDiskBytes() const {return vlog.diskBytes();}
+
+        CacheStats cacheStats() const {return index.cacheStats();}
+
+        typename Index::Stats stats() {return index.stats();}
+
+        void resetStats() {index.resetStats();}
+    };
+}
+
+#endif //DS01_B_TREE_VLOG_HPP
@@ -0,0 +1,247 @@
+#ifndef DS01_B_TREE_WAL_HPP
+#define DS01_B_TREE_WAL_HPP
+
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pager.hpp"
+
+namespace Sirius {
+
+    /*
+     * 预写日志 (WAL), 日志文件里顺序追加记录: 记录头 + 内容, 记录头带校验和, 崩溃时写了一半的尾巴校验不过直接丢掉
+     * - 前像: 上次检查点之后, 数据文件的某一块 (BLOCK 字节) 第一次要被覆盖前, 先把原内容记下并落盘, 然后才允许写
+     * - 重做: 每个修改操作一条逻辑记录, 内容由使用者决定, 攒够 groupSize 条才 fsync 一次 (组提交)
+     *   前像另放一个缓冲, 淘汰脏页逼着前像落盘时不带上还没提交的重做记录, 没提交的操作崩溃后一定不在
+     * 恢复: 先用前像把数据文件退回检查点时的样子 (并截回当时的长度), 再按顺序重放重做记录
+     * 检查点: 使用者写回所有脏页并落盘后清空日志, 开始新的一轮
+     */
+    class WriteAheadLog: public PagerHook {
+        typedef long long fpos_t;
+        static const fpos_t BLOCK = 4096;
+
+        enum RecordType {
+            REC_EPOCH = 1, //一轮的开头, pos 为检查点时数据文件的长度
+            REC_IMAGE, //前像, pos 为块的位置
+            REC_REDO //重做
+        };
+
+        struct RecordHead {
+            int type;
+            unsigned len;
+            fpos_t pos;
+            unsigned checksum;
+        };
+
+        int fd;
+        Pager *pager;
+        std::vector<char> buf, redoBuf, block; //buf 为还没写进日志文件的前像等记录, redoBuf 为还没提交的重做记录
+        int groupSize, pending;
+        bool unsynced;
+        fpos_t logSize; //日志文件里已经写了的字节数
+        fpos_t epochSize;
+        std::unordered_set<fpos_t> imaged; //这一轮已经记过前像的块
+        size_t syncCount, redoCount;
+        mutable std::mutex lock; //多线程模式下读者的 cache 淘汰也会写页, 和写者的日志记录并发
+        std::function<void()> beforeCommit; //日志落盘、检查点之前调用, 记录里引用的外部数据 (如值日志) 要先落盘
+
+        //FNV-1a
+        static unsigned checksum(const char *data, size_t len, unsigned h = 2166136261u) {
+            for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)data[i]) * 16777619u;
+            return h;
+        }
+
+        void append(int type, fpos_t pos, const char *data, size_t len) {
+            RecordHead head;
+            memset(&head, 0, sizeof(RecordHead));
+            head.type = type;
+            head.len = len;
+            head.pos = pos;
+            head.checksum = checksum(data, len, checksum(reinterpret_cast<const char *>(&head), sizeof(RecordHead)));
+            const char *bytes = reinterpret_cast<const char *>(&head);
+            std::vector<char> &to = type == REC_REDO ? redoBuf : buf;
+            to.insert(to.end(), bytes, bytes + sizeof(RecordHead));
+            to.insert(to.end(), data, data + len);
+        }
+
+        /*
+         * 第 b 块这一轮第一次被写就记前像, 检查点之后才长出来的部分不用记 (恢复时截掉即可)
+         */
+        bool image(fpos_t b) {
+            fpos_t begin = b * BLOCK;
+            if (begin >= epochSize || !imaged.insert(b).second) return false;
+            size_t len = std::min((fpos_t)BLOCK, epochSize - begin);
+            block.resize(len);
+            pager->read(begin, block.data(), len);
+            append(REC_IMAGE, begin, block.data(), len);
+            return true;
+        }
+
+        /*
+         * 缓冲写进日志并 fsync; withRedo 为假时只写前像, 重做记录留到提交
+         */
+        void sync(bool withRedo) {
+            if (withRedo) {
+                buf.insert(buf.end(), redoBuf.begin(), redoBuf.end());
+                redoBuf.clear();
+                pending = 0;
+            }
+            if ((!buf.empty() || unsynced) && beforeCommit) beforeCommit();
+            if (!buf.empty()) {
+                diskWrite(fd, logSize, buf.data(), buf.size());
+                logSize += buf.size();
+                buf.clear();
+                unsynced = true;
+            }
+            if (unsynced) {
+                fdatasync(fd);
+                syncCount++;
+                unsynced = false;
+            }
+        }
+
+    public:
+        WriteAheadLog(): fd(-1), pager(nullptr), groupSize(1), pending(0), unsynced(false),
+                         logSize(0), epochSize(0), syncCount(0), redoCount(0) {}
+
+        ~WriteAheadLog() {
+            close();
+        }
+
+        void open(const char *fileName, int _groupSize) {
+            fd = ::open(fileName, O_RDWR | O_CREAT, 0644);
+            if (fd < 0) throw "cannot open log file";
+            groupSize = std::max(_groupSize, 1);
+        }
+
+        void close() {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        bool enabled() const {return fd >= 0;}
+
+        void setPager(Pager *_pager) {
+            pager = _pager;
+        }
+
+        void setBeforeCommit(std::function<void()> hook) {
+            std::lock_guard<std::mutex> guard(lock);
+            beforeCommit = hook;
+        }
+
+        /*
+         * 恢复, 要在数据文件交给 Pager 之前做: 前像直接写回数据文件, 截回检查点时的长度并落盘
+         * 日志截到最后一条完整的记录, 这一轮记过的块保留, 重放时新碰到的块接着往后记
+         * 返回重做记录的内容, 由使用者按顺序重放
+         */
+        std::vector<std::vector<char> > recover(int dataFd) {
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            std::vector<char> log(fileStat.st_size);
+            diskRead(fd, 0, log.data(), log.size());
+
+            std::vector<std::vector<char> > redo;
+            bool hasEpoch = false;
+            size_t off = 0;
+            imaged.clear();
+            while (off + sizeof(RecordHead) <= log.size()) {
+                RecordHead head;
+                memcpy(&head, &log[off], sizeof(RecordHead));
+                if (off + sizeof(RecordHead) + head.len > log.size()) break;
+                const char *data = log.data() + off + sizeof(RecordHead);
+                unsigned sum = head.checksum;
+                head.checksum = 0;
+                if (checksum(data, head.len, checksum(reinterpret_cast<const char *>(&head), sizeof(RecordHead))) != sum) break;
+                if (head.type == REC_EPOCH) {
+                    if (hasEpoch) break;
+                    hasEpoch = true;
+                    epochSize = head.pos;
+                } else if (!hasEpoch) {
+                    break;
+                } else if (head.type == REC_IMAGE) {
+                    if (imaged.insert(head.pos / BLOCK).second) diskWrite(dataFd, head.pos, data, head.len);
+                } else {
+                    redo.push_back(std::vector<char>(data, data + head.len));
+                }
+                off += sizeof(RecordHead) + head.len;
+            }
+
+            if (hasEpoch) {
+                if (ftruncate(dataFd, epochSize) != 0) throw "recover truncate failed";
+                fdatasync(dataFd);
+            } else {
+                off = 0;
+            }
+            if (ftruncate(fd, off) != 0) throw "log truncate failed";
+            logSize = off;
+            return redo;
+        }
+
+        void beforeWrite(fpos_t pos, size_t len) override {
+            if (len == 0) return;
+            std::lock_guard<std::mutex> guard(lock);
+            bool added = false;
+            for (fpos_t b = pos / BLOCK; b <= (pos + (fpos_t)len - 1) / BLOCK; ++b) added |= image(b);
+            if (added) sync(false); //前像必须先落盘
+        }
+
+        /*
+         * 只记前像不落盘, 要写一大批页之前先全记下, 再由调用者 commit 一次
+         */
+        void preImage(fpos_t pos, size_t len) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (fpos_t b = pos / BLOCK; b <= (pos + (fpos_t)len - 1) / BLOCK; ++b) image(b);
+        }
+
+        void logRedo(const void *data, size_t len) {
+            std::lock_guard<std::mutex> guard(lock);
+            append(REC_REDO, 0, reinterpret_cast<const char *>(data), len);
+            redoCount++;
+            if (++pending >= groupSize) sync(true);
+        }
+
+        /*
+         * 组提交: 缓冲里的记录写进日志并 fsync, 之后这些操作崩溃也不会丢
+         */
+        void commit() {
+            std::lock_guard<std::mutex> guard(lock);
+            sync(true);
+        }
+
+        /*
+         * 新的一轮, 调用者保证数据文件此时已经落盘, 长度为 fileSize
+         */
+        void checkpoint(fpos_t fileSize) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (beforeCommit) beforeCommit();
+            buf.clear();
+            redoBuf.clear();
+            pending = 0;
+            if (ftruncate(fd, 0) != 0) throw "log truncate failed";
+            logSize = 0;
+            imaged.clear();
+            epochSize = fileSize;
+            append(REC_EPOCH, fileSize, nullptr, 0);
+            unsynced = true;
+            sync(true);
+        }
+
+        fpos_t size() const {
+            std::lock_guard<std::mutex> guard(lock);
+            return logSize + buf.size() + redoBuf.size();
+        }
+
+        size_t syncs() const {return syncCount;}
+
+        size_t records() const {return redoCount;}
+    };
+}
+
+#endif //DS01_B_TREE_WAL_HPP
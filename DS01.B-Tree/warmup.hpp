@@ -0,0 +1,203 @@
+#ifndef DS01_B_TREE_WARMUP_HPP
+#define DS01_B_TREE_WARMUP_HPP
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pager.hpp"
+
+namespace Sirius {
+
+    /*
+     * cache 预热: 关闭 (和 sync) 时把 cache 里常驻的页的位置按从热到冷存到一个小文件里, 下次打开时在后台读回来
+     * 后台线程把位置排好序, 相邻 (或只隔几页) 的连成一段, 一次至多读 RUN_BYTES 字节, 读好一段交出一批
+     * 后台线程不碰 cache: cache 每次被访问时看一眼有没有读好的批, 有就在自己的线程里装进空闲页框
+     *
+     * 读回来的页可能已经旧了: 打开之后被改过 (写回了) 或被释放的页, 盘上的内容和后台读到的不一定是同一版
+     * 所以 cache 从开始预热起记下所有 write / discard 过的位置, 这些页一律不装; 已经在 cache 里的页也不装
+     * 只往空闲页框里装, 不淘汰任何页, cache 满了剩下的就不要了
+     */
+    class WarmLoader {
+        typedef long long fpos_t;
+        static const int WARM_VERSION = 1;
+        static const fpos_t RUN_BYTES = 1 << 20; //一次读盘至多这么多
+        static const fpos_t MAX_GAP = 4; //中间只空这么几页也连起来读, 多读一点换少一次读盘
+
+        struct Header {
+            char magic[8];
+            int version;
+            int pad;
+            long long pageBytes; //页的字节数, 节点大小不同的文件不认
+            long long count;
+        };
+
+        struct Batch {
+            std::vector<fpos_t> pos;
+            std::vector<char> bytes;
+        };
+
+        size_t pageBytes;
+        std::mutex lock;
+        std::vector<Batch> ready; //读好还没交出去的
+        int inFlight; //已经交出去、还在装的批数
+        bool done; //后台线程读完了 (或被叫停)
+        bool closed; //已经告诉过 cache 预热结束
+        std::atomic<bool> signal; //有新的批或读完了, cache 每次访问只看这一个原子变量
+        std::atomic<bool> stop;
+        std::atomic<size_t> readCalls, pagesRead; //后台线程记
+        std::thread worker;
+
+        void publish(Batch &batch) {
+            if (batch.pos.empty()) return;
+            std::lock_guard<std::mutex> guard(lock);
+            ready.push_back(std::move(batch));
+            batch = Batch();
+            signal.store(true, std::memory_order_release);
+        }
+
+        void run(std::string dataName, std::vector<fpos_t> list, fpos_t stride) {
+            int fd = open(dataName.c_str(), O_RDONLY);
+            Batch batch;
+            if (fd >= 0) {
+                std::vector<char> buf;
+                size_t i = 0;
+                try {
+                    while (i < list.size() && !stop.load(std::memory_order_relaxed)) {
+                        size_t j = i + 1;
+                        while (j < list.size() && list[j] - list[i] + (fpos_t)pageBytes <= RUN_BYTES &&
+                               list[j] - list[j - 1] <= stride * MAX_GAP) ++j;
+                        fpos_t first = list[i], len = list[j - 1] - first + pageBytes;
+                        buf.resize(len);
+                        diskRead(fd, first, buf.data(), len);
+                        readCalls.fetch_add(1, std::memory_order_relaxed);
+                        for (size_t k = i; k < j; ++k) {
+                            batch.pos.push_back(list[k]);
+                            batch.bytes.insert(batch.bytes.end(), buf.data() + (list[k] - first),
+                                               buf.data() + (list[k] - first) + pageBytes);
+                        }
+                        pagesRead.fetch_add(j - i, std::memory_order_relaxed);
+                        publish(batch);
+                        i = j;
+                    }
+                } catch (...) {} //读不出来就算了, 剩下的页等用到时再读
+                close(fd);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+            signal.store(true, std::memory_order_release);
+        }
+
+    public:
+        /*
+         * 把 list (从热到冷) 写到 fileName, 不落盘: 丢了或写坏了只是下次预热不了或多读几页
+         */
+        static void save(const std::string &fileName, const std::vector<fpos_t> &list, size_t pageBytes) {
+            int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) return;
+            Header head;
+            memset(&head, 0, sizeof(Header));
+            strcpy(head.magic, "SRWARM");
+            head.version = WARM_VERSION;
+            head.pageBytes = pageBytes;
+            head.count = list.size();
+            try {
+                diskWrite(fd, 0, &head, sizeof(Header));
+                if (!list.empty()) diskWrite(fd, sizeof(Header), list.data(), list.size() * sizeof(fpos_t));
+            } catch (...) {}
+            close(fd);
+        }
+
+        /*
+         * 读回 save 存的位置, 没有或对不上返回空; 位置本身对不对由调用者检查
+         */
+        static std::vector<fpos_t> load(const std::string &fileName, size_t pageBytes) {
+            std::vector<fpos_t> list;
+            int fd = open(fileName.c_str(), O_RDONLY);
+            if (fd < 0) return list;
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            Header head;
+            if ((size_t)fileStat.st_size >= sizeof(Header)) {
+                diskRead(fd, 0, &head, sizeof(Header));
+                if (memcmp(head.magic, "SRWARM", 7) == 0 && head.version == WARM_VERSION && head.pageBytes == (long long)pageBytes &&
+                    head.count >= 0 && (size_t)fileStat.st_size == sizeof(Header) + head.count * sizeof(fpos_t)) {
+                    list.resize(head.count);
+                    if (head.count > 0) diskRead(fd, sizeof(Header), list.data(), head.count * sizeof(fpos_t));
+                }
+            }
+            close(fd);
+            return list;
+        }
+
+        /*
+         * 开始在后台读 list 里的页 (每页 pageBytes 字节, 相邻两页的位置差 stride)
+         */
+        WarmLoader(const std::string &dataName, std::vector<fpos_t> list, size_t _pageBytes, fpos_t stride):
+                pageBytes(_pageBytes), inFlight(0), done(false), closed(false), signal(false), stop(false),
+                readCalls(0), pagesRead(0) {
+            std::sort(list.begin(), list.end());
+            list.erase(std::unique(list.begin(), list.end()), list.end());
+            worker = std::thread(&WarmLoader::run, this, dataName, std::move(list), stride);
+        }
+
+        WarmLoader(const WarmLoader &) = delete;
+        WarmLoader &operator=(const WarmLoader &) = delete;
+
+        ~WarmLoader() {
+            stop.store(true, std::memory_order_relaxed);
+            worker.join();
+        }
+
+        //有读好的批, 或者读完了还没告诉 cache
+        bool pending() const {return signal.load(std::memory_order_acquire);}
+
+        /*
+         * 把读好的批全拿走, 对每一页调用 install(pos, bytes); 多个线程可以同时调用, 各拿各的
+         */
+        template<class Func>
+        void take(Func install) {
+            std::vector<Batch> got;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                signal.store(false, std::memory_order_relaxed);
+                if (ready.empty()) return;
+                got.swap(ready);
+                inFlight++;
+            }
+            for (const Batch &batch : got) {
+                for (size_t i = 0; i < batch.pos.size(); ++i) install(batch.pos[i], batch.bytes.data() + i * pageBytes);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            inFlight--;
+        }
+
+        /*
+         * 后台读完了、读好的都装完了时返回 true, 只返回一次; 之后 cache 可以不再记改过的位置
+         */
+        bool finish() {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!done || !ready.empty() || inFlight > 0 || closed) return false;
+            closed = true;
+            return true;
+        }
+
+        bool finished() {
+            std::lock_guard<std::mutex> guard(lock);
+            return closed;
+        }
+
+        //后台读盘的次数和读上来的页数
+        size_t reads() const {return readCalls.load(std::memory_order_relaxed);}
+
+        size_t pages() const {return pagesRead.load(std::memory_order_relaxed);}
+    };
+}
+
+#endif //DS01_B_TREE_WARMUP_HPP